@@ -19,6 +19,7 @@ ifdef PRECOMPILE
 # magisk main binary
 include $(CLEAR_VARS)
 LOCAL_MODULE := magisk
+LOCAL_STATIC_LIBRARIES := libmagiskboot
 LOCAL_SHARED_LIBRARIES := libsqlite libselinux
 
 LOCAL_C_INCLUDES := \
@@ -30,14 +31,18 @@ LOCAL_SRC_FILES := \
 	daemon/magisk.c \
 	daemon/daemon.c \
 	daemon/socket_trans.c \
+	daemon/session.c \
+	daemon/stats.c \
+	daemon/status.c \
 	daemon/log_monitor.c \
 	daemon/bootstages.c \
+	daemon/boottrace.c \
 	utils/misc.c \
-	utils/vector.c \
 	utils/xwrap.c \
 	utils/list.c \
 	utils/img.c \
 	utils/file.c \
+	utils/wait.c \
 	magiskhide/magiskhide.c \
 	magiskhide/proc_monitor.c \
 	magiskhide/hide_utils.c \
@@ -65,6 +70,8 @@ LOCAL_SRC_FILES := \
 	utils/vector.c \
 	utils/file.c \
 	utils/xwrap.c \
+	utils/memfind.c \
+	utils/wait.c \
 	magiskpolicy/api.c \
 	magiskpolicy/magiskpolicy.c \
 	magiskpolicy/rules.c \
@@ -86,10 +93,52 @@ LOCAL_SRC_FILES := init/monogisk.c
 LOCAL_LDFLAGS := -static
 include $(BUILD_EXECUTABLE)
 
+# magiskboot hardware accelerated SHA, requires its own instruction set flags
+include $(CLEAR_VARS)
+LOCAL_MODULE := libshaaccel
+LOCAL_SRC_FILES := magiskboot/sha_accel.c
+ifneq (,$(filter x86 x86_64,$(TARGET_ARCH_ABI)))
+LOCAL_CFLAGS := -mssse3 -msse4.1 -msha
+endif
+ifeq ($(TARGET_ARCH_ABI), arm64-v8a)
+LOCAL_CFLAGS := -march=armv8-a+crypto
+endif
+include $(BUILD_STATIC_LIBRARY)
+
+# libmagiskboot, the in-memory boot image API of magiskboot and the daemon
+# Self-contained, nothing in it exits or needs utils/xwrap.c
+include $(CLEAR_VARS)
+LOCAL_MODULE := libmagiskboot
+LOCAL_STATIC_LIBRARIES := liblzma liblz4 libbz2 libshaaccel
+LOCAL_C_INCLUDES := \
+	jni/include \
+	$(LIBLZMA) \
+	$(LIBLZ4) \
+	$(LIBBZ2)
+
+LOCAL_SRC_FILES := \
+	magiskboot/api.c \
+	magiskboot/stream.c \
+	magiskboot/cpio_vec.c \
+	magiskboot/compress.c \
+	magiskboot/sparse.c \
+	magiskboot/dtb_index.c \
+	magiskboot/boot_utils.c \
+	magiskboot/sha1.c \
+	magiskboot/sha256.c \
+	magiskboot/hash.c \
+	magiskboot/types.c \
+	utils/memfind.c \
+	utils/vector.c
+
+LOCAL_EXPORT_C_INCLUDES := jni/include jni/magiskboot
+LOCAL_EXPORT_LDLIBS := -lz
+include $(BUILD_STATIC_LIBRARY)
+
 # magiskboot
 include $(CLEAR_VARS)
 LOCAL_MODULE := magiskboot
-LOCAL_STATIC_LIBRARIES := liblzma liblz4 libbz2 libfdt
+LOCAL_STATIC_LIBRARIES := libmagiskboot libfdt
 LOCAL_C_INCLUDES := \
 	jni/include \
 	$(LIBLZMA) \
@@ -101,15 +150,15 @@ LOCAL_SRC_FILES := \
 	magiskboot/main.c \
 	magiskboot/bootimg.c \
 	magiskboot/hexpatch.c \
-	magiskboot/compress.c \
-	magiskboot/boot_utils.c \
+	magiskboot/flash.c \
+	magiskboot/patch.c \
+	magiskboot/batch.c \
 	magiskboot/cpio.c \
-	magiskboot/sha1.c \
-	magiskboot/types.c \
 	magiskboot/dtb.c \
+	magiskboot/compress_cli.c \
+	magiskboot/cache.c \
 	utils/xwrap.c \
-	utils/file.c \
-	utils/vector.c
+	utils/file.c
 
 LOCAL_CFLAGS := -DNO_SELINUX
 LOCAL_LDLIBS := -lz
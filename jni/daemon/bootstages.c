@@ -154,9 +154,11 @@ static void exec_common_script(const char* stage) {
 			if (access(buf2, X_OK) == -1)
 				continue;
 			LOGI("%s.d: exec [%s]\n", stage, entry->d_name);
+			int t = trace_begin("%s.d: %s", stage, entry->d_name);
 			int pid = exec_command(0, NULL, bb_setenv, "sh", buf2, NULL);
 			if (pid != -1)
 				waitpid(pid, NULL, 0);
+			trace_end(t);
 		}
 	}
 
@@ -171,9 +173,11 @@ static void exec_module_script(const char* stage) {
 		if (access(buf2, F_OK) == -1 || access(buf, F_OK) == 0)
 			continue;
 		LOGI("%s: exec [%s.sh]\n", module, stage);
+		int t = trace_begin("%s: %s.sh", module, stage);
 		int pid = exec_command(0, NULL, bb_setenv, "sh", buf2, NULL);
 		if (pid != -1)
 			waitpid(pid, NULL, 0);
+		trace_end(t);
 	}
 
 }
@@ -493,7 +497,10 @@ static void daemon_init() {
 
 static int prepare_img() {
 	// First merge images
-	if (merge_img("/data/magisk_merge.img", MAINIMG)) {
+	int t = trace_begin("merge_img");
+	int merge_err = merge_img("/data/magisk_merge.img", MAINIMG);
+	trace_end(t);
+	if (merge_err) {
 		LOGE("Image merge /data/magisk_merge.img -> " MAINIMG " failed!\n");
 		return 1;
 	}
@@ -505,7 +512,9 @@ static int prepare_img() {
 
 	LOGI("* Mounting " MAINIMG "\n");
 	// Mounting magisk image
+	t = trace_begin("mount_image");
 	char *magiskloop = mount_image(MAINIMG, MOUNTPOINT);
+	trace_end(t);
 	if (magiskloop == NULL)
 		return 1;
 
@@ -541,16 +550,22 @@ static int prepare_img() {
 	closedir(dir);
 
 	// Trim image
+	t = trace_begin("trim_img");
 	umount_image(MOUNTPOINT, magiskloop);
 	free(magiskloop);
 	trim_img(MAINIMG);
+	trace_end(t);
 
 	// Remount them back :)
+	t = trace_begin("remount_image");
 	magiskloop = mount_image(MAINIMG, MOUNTPOINT);
 	free(magiskloop);
+	trace_end(t);
 
 	// Fix file selinux contexts
+	t = trace_begin("fix_filecon");
 	fix_filecon();
+	trace_end(t);
 	return 0;
 }
 
@@ -573,6 +588,7 @@ static void unblock_boot_process() {
 }
 
 void post_fs(int client) {
+	int stage = trace_begin("post-fs");
 	LOGI("** post-fs mode running\n");
 	// ack
 	write_int(client, 0);
@@ -586,14 +602,19 @@ void post_fs(int client) {
 	buf = xmalloc(PATH_MAX);
 	buf2 = xmalloc(PATH_MAX);
 
+	int t = trace_begin("simple_mount");
 	simple_mount("/system");
 	simple_mount("/vendor");
+	trace_end(t);
 
 unblock:
+	trace_end(stage);
+	status_stage_done(STAGE_POST_FS);
 	unblock_boot_process();
 }
 
 void post_fs_data(int client) {
+	int stage = trace_begin("post-fs-data"), t;
 	// ack
 	write_int(client, 0);
 	close(client);
@@ -618,32 +639,42 @@ void post_fs_data(int client) {
 	else if (access("/data/user_de/0/com.topjohnwu.magisk/install", F_OK) == 0)
 		bin_path = "/data/user_de/0/com.topjohnwu.magisk/install";
 	if (bin_path) {
+		t = trace_begin("install_binaries");
 		rm_rf(DATABIN);
 		cp_afc(bin_path, DATABIN);
 		rm_rf(bin_path);
 		// Lazy.... use shell blob to match files
 		exec_command_sync("sh", "-c", "mv /data/magisk/stock_boot* /data", NULL);
+		trace_end(t);
 	}
 
 	// Initialize
+	t = trace_begin("daemon_init");
 	daemon_init();
+	trace_end(t);
 
 	// uninstaller
 	if (access(UNINSTALLER, F_OK) == 0) {
 		close(open(UNBLOCKFILE, O_RDONLY | O_CREAT));
 		setenv("BOOTMODE", "true", 1);
 		exec_command(0, NULL, bb_setenv, "sh", UNINSTALLER, NULL);
+		trace_end(stage);
 		return;
 	}
 
 	// Merge, trim, mount magisk.img, which will also travel through the modules
 	// After this, it will create the module list
-	if (prepare_img())
+	t = trace_begin("prepare_img");
+	int img_err = prepare_img();
+	trace_end(t);
+	if (img_err)
 		goto core_only; // Mounting fails, we can only do core only stuffs
 
 	// Run common scripts
 	LOGI("* Running post-fs-data.d scripts\n");
+	t = trace_begin("post-fs-data.d");
 	exec_common_script("post-fs-data");
+	trace_end(t);
 
 	// Core only mode
 	if (access(DISABLEFILE, F_OK) == 0)
@@ -651,7 +682,9 @@ void post_fs_data(int client) {
 
 	// Execute module scripts
 	LOGI("* Running module post-fs-data scripts\n");
+	t = trace_begin("module post-fs-data scripts");
 	exec_module_script("post-fs-data");
+	trace_end(t);
 
 	char *module;
 	struct node_entry *sys_root, *ven_root = NULL, *child;
@@ -664,12 +697,15 @@ void post_fs_data(int client) {
 	int has_modules = 0;
 
 	LOGI("* Loading modules\n");
+	int load = trace_begin("load_modules");
 	vec_for_each(&module_list, module) {
 		// Read props
 		snprintf(buf, PATH_MAX, "%s/%s/system.prop", MOUNTPOINT, module);
 		if (access(buf, F_OK) == 0) {
 			LOGI("%s: loading [system.prop]\n", module);
+			t = trace_begin("%s: system.prop", module);
 			read_prop_file(buf, 0);
+			trace_end(t);
 		}
 		// Check whether enable auto_mount
 		snprintf(buf, PATH_MAX, "%s/%s/auto_mount", MOUNTPOINT, module);
@@ -690,8 +726,11 @@ void post_fs_data(int client) {
 			unlink(buf2);
 			xsymlink(buf, buf2);
 		}
+		t = trace_begin("%s: construct_tree", module);
 		construct_tree(module, sys_root);
+		trace_end(t);
 	}
+	trace_end(load);
 
 	if (has_modules) {
 		// Extract the vendor node out of system tree and swap with placeholder
@@ -711,8 +750,10 @@ void post_fs_data(int client) {
 		}
 
 		// Magic!!
+		t = trace_begin("magic_mount");
 		magic_mount(sys_root);
 		if (ven_root) magic_mount(ven_root);
+		trace_end(t);
 	}
 
 	// Cleanup memory
@@ -727,12 +768,20 @@ core_only:
 	}
 
 	auto_start_magiskhide();
+	trace_end(stage);
+	status_stage_done(STAGE_POST_FS_DATA);
+	save_boot_trace();
+	unblock_boot_process();
 
 unblock:
+	// /data is not ready yet, late_start saves the trace
+	trace_end(stage);
+	status_stage_done(STAGE_POST_FS_DATA);
 	unblock_boot_process();
 }
 
 void late_start(int client) {
+	int stage = trace_begin("late_start"), t;
 	LOGI("** late_start service mode running\n");
 	// ack
 	write_int(client, 0);
@@ -743,23 +792,29 @@ void late_start(int client) {
 	if (buf2 == NULL) buf2 = xmalloc(PATH_MAX);
 
 	// Wait till the full patch is done
-	while (access(PATCHDONE, F_OK) == -1)
-		usleep(500); /* Wait 0.5ms */
+	t = trace_begin("wait_patch_done");
+	wait_for_path(PATCHDONE, F_OK, -1);
+	trace_end(t);
 
 	// Run scripts after full patch, most reliable way to run scripts
 	LOGI("* Running service.d scripts\n");
+	t = trace_begin("service.d");
 	exec_common_script("service");
+	trace_end(t);
 
 	// Core only mode
 	if (access(DISABLEFILE, F_OK) == 0)
 		goto core_only;
 
 	LOGI("* Running module service scripts\n");
+	t = trace_begin("module service scripts");
 	exec_module_script("service");
+	trace_end(t);
 
 core_only:
 	// Install Magisk Manager if exists
 	if (access(MANAGERAPK, F_OK) == 0) {
+		t = trace_begin("install_manager");
 		while (1) {
 			sleep(5);
 			int apk_res = -1, pid;
@@ -777,6 +832,7 @@ core_only:
 			}
 		}
 		unlink(MANAGERAPK);
+		trace_end(t);
 	}
 
 	// All boot stage done, cleanup everything
@@ -785,5 +841,9 @@ core_only:
 	buf = buf2 = NULL;
 	vec_deep_destroy(&module_list);
 
+	trace_end(stage);
+	status_stage_done(STAGE_LATE_START);
+	save_boot_trace();
+
 	stop_debug_full_log();
 }
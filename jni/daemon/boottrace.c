@@ -0,0 +1,171 @@
+/* boottrace.c - Timeline of the boot stages
+ *
+ * Spans are recorded as fixed size events with their names in a string
+ * pool, all in one static buffer, so tracing a step costs a clock read and
+ * a few stores. The buffer is saved to BOOTTRACE after post-fs-data and
+ * late_start, and exported as Chrome trace-event JSON by magisk --boot-trace.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/syscall.h>
+
+#include "magisk.h"
+#include "utils.h"
+#include "daemon.h"
+
+#define TRACE_MAGIC    "MTRC"
+#define TRACE_EVENTS   1024
+#define TRACE_STRINGS  (16 * 1024)
+#define TRACE_RUNNING  UINT32_MAX
+
+typedef struct trace_event {
+	uint64_t begin;   // CLOCK_BOOTTIME in us
+	uint32_t dur;     // In us, TRACE_RUNNING until the span ends
+	uint32_t tid;
+	uint32_t name;    // Offset into the string pool
+} trace_event;
+
+typedef struct trace_header {
+	char magic[4];
+	uint32_t num;
+	uint32_t strings;
+} trace_header;
+
+static struct {
+	trace_header hdr;
+	trace_event events[TRACE_EVENTS];
+	char strings[TRACE_STRINGS];
+} trace = { .hdr.magic = TRACE_MAGIC };
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t now_us() {
+	struct timespec ts;
+	clock_gettime(CLOCK_BOOTTIME, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/* Start a span named by fmt, returns the id to pass to trace_end,
+ * or -1 when the buffer is full */
+int trace_begin(const char *fmt, ...) {
+	char name[128];
+	va_list argv;
+	va_start(argv, fmt);
+	int len = vsnprintf(name, sizeof(name), fmt, argv) + 1;
+	va_end(argv);
+	if (len > sizeof(name))
+		len = sizeof(name);
+
+	int id = -1;
+	pthread_mutex_lock(&trace_lock);
+	if (trace.hdr.num < TRACE_EVENTS && trace.hdr.strings + len <= TRACE_STRINGS) {
+		id = trace.hdr.num++;
+		trace.events[id] = (trace_event) {
+			.begin = now_us(),
+			.dur = TRACE_RUNNING,
+			.tid = syscall(__NR_gettid),
+			.name = trace.hdr.strings
+		};
+		memcpy(trace.strings + trace.hdr.strings, name, len);
+		trace.hdr.strings += len;
+	}
+	pthread_mutex_unlock(&trace_lock);
+	return id;
+}
+
+void trace_end(int id) {
+	if (id < 0)
+		return;
+	uint64_t end = now_us();
+	pthread_mutex_lock(&trace_lock);
+	trace.events[id].dur = end - trace.events[id].begin;
+	pthread_mutex_unlock(&trace_lock);
+}
+
+/* Write the buffer to BOOTTRACE, replacing the trace of the last boot */
+void save_boot_trace() {
+	pthread_mutex_lock(&trace_lock);
+	int fd = creat(BOOTTRACE ".tmp", 0600);
+	if (fd >= 0) {
+		xwrite(fd, &trace.hdr, sizeof(trace.hdr));
+		xwrite(fd, trace.events, trace.hdr.num * sizeof(trace_event));
+		xwrite(fd, trace.strings, trace.hdr.strings);
+		close(fd);
+		rename(BOOTTRACE ".tmp", BOOTTRACE);
+	}
+	pthread_mutex_unlock(&trace_lock);
+}
+
+static void print_json_str(const char *s) {
+	putchar('"');
+	for (; *s; ++s) {
+		if (*s == '"' || *s == '\\')
+			printf("\\%c", *s);
+		else if ((unsigned char) *s < 0x20)
+			printf("\\u%04x", *s);
+		else
+			putchar(*s);
+	}
+	putchar('"');
+}
+
+/* Print the saved trace as Chrome trace-event JSON, spans that never ended
+ * become begin events. Every thread is named after its first span. */
+int print_boot_trace() {
+	trace_header hdr;
+	trace_event *events = NULL;
+	char *strings = NULL;
+	int fd = open(BOOTTRACE, O_RDONLY | O_CLOEXEC), ret = 1;
+	if (fd < 0) {
+		fprintf(stderr, "No boot trace at " BOOTTRACE "\n");
+		return 1;
+	}
+	if (read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) || memcmp(hdr.magic, TRACE_MAGIC, 4) != 0 ||
+		hdr.num > TRACE_EVENTS || hdr.strings > TRACE_STRINGS)
+		goto corrupt;
+	events = xmalloc(hdr.num * sizeof(*events) + 1);
+	strings = xcalloc(hdr.strings + 1, 1);
+	if (read(fd, events, hdr.num * sizeof(*events)) != hdr.num * sizeof(*events) ||
+		read(fd, strings, hdr.strings) != hdr.strings)
+		goto corrupt;
+
+	printf("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	printf("{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"magisk_daemon\"}}");
+	for (uint32_t i = 0; i < hdr.num; ++i) {
+		trace_event *e = &events[i];
+		const char *name = e->name < hdr.strings ? strings + e->name : "";
+		int first = 1;
+		for (uint32_t j = 0; j < i && first; ++j)
+			first = events[j].tid != e->tid;
+		if (first) {
+			printf(",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":", e->tid);
+			print_json_str(name);
+			printf("}}");
+		}
+		printf(",\n{\"name\":");
+		print_json_str(name);
+		printf(",\"cat\":\"boot\",\"pid\":1,\"tid\":%u,\"ts\":%llu", e->tid, (unsigned long long) e->begin);
+		if (e->dur == TRACE_RUNNING)
+			printf(",\"ph\":\"B\"}");
+		else
+			printf(",\"ph\":\"X\",\"dur\":%u}", e->dur);
+	}
+	printf("\n]}\n");
+	ret = 0;
+	goto done;
+
+corrupt:
+	fprintf(stderr, "Corrupted boot trace at " BOOTTRACE "\n");
+done:
+	close(fd);
+	free(events);
+	free(strings);
+	return ret;
+}
@@ -2,6 +2,11 @@
  *
  * Start the daemon and wait for requests
  * Connect the daemon and send requests through sockets
+ *
+ * A single thread accepts connections and waits with epoll until each client
+ * has sent its request. Short requests are queued to a fixed pool of workers,
+ * requests that may block for a long time (MagiskHide, su sessions and boot
+ * stages) get a thread of their own, so they never hold up the pool.
  */
 
 #include <stdlib.h>
@@ -10,6 +15,7 @@
 #include <string.h>
 #include <errno.h>
 #include <pthread.h>
+#include <sys/epoll.h>
 #include <sys/un.h>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -18,19 +24,89 @@
 #include <selinux/selinux.h>
 
 #include "magisk.h"
+#include "list.h"
 #include "utils.h"
 #include "daemon.h"
 #include "magiskpolicy.h"
 #include "resetprop.h"
 
+#define DAEMON_WORKERS   4
+#define QUEUE_SIZE       64
+#define WORKER_STACK     (128 * 1024)
+#define LONG_STACK       (256 * 1024)
+// Milliseconds a client may stay connected without sending its request
+#define PENDING_TIMEOUT  5000
+// Milliseconds to stop accepting after accept failed, e.g. out of fds
+#define ACCEPT_BACKOFF   200
+
 pthread_t sepol_patch;
 int is_restart = 0;
 
-static void *request_handler(void *args) {
-	int client = *((int *) args);
-	free(args);
-	client_request req = read_int(client);
+// Boot stages wait for the startup work that runs after the socket is ready
+static int init_done = 0;
+static pthread_mutex_t init_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t init_cond = PTHREAD_COND_INITIALIZER;
+
+static void wait_init() {
+	pthread_mutex_lock(&init_lock);
+	while (!init_done)
+		pthread_cond_wait(&init_cond, &init_lock);
+	pthread_mutex_unlock(&init_lock);
+}
+
+typedef struct request {
+	int client;
+	client_request req;
+	// When the connection was accepted
+	struct timespec start;
+	// Position in the acceptor's list of clients waiting to send their request
+	struct list_head pos;
+} request;
+
+// Nice value and I/O priority level of the threads handling each class
+static const struct {
+	int nice;
+	int io;
+} prio_level[PRIO_NUM] = {
+	[PRIO_BOOT] = { -10, 0 },
+	[PRIO_HIDE] = { -5, 2 },
+	[PRIO_SU]   = { 0, IOPRIO_DEFAULT },
+	[PRIO_INFO] = { 5, 6 },
+};
+
+// Only short requests wait for a worker, long ones get a thread of their own.
+// So the queue ordering only lets MagiskHide list changes overtake queries
+enum {
+	QUEUE_HIDE = 0,
+	QUEUE_QUERY,
+	QUEUE_NUM
+};
 
+// Requests waiting for a worker. Workers empty QUEUE_HIDE first, and the
+// acceptor blocks when QUEUE_SIZE are waiting
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+	request queue[QUEUE_NUM][QUEUE_SIZE];
+	int head[QUEUE_NUM], num[QUEUE_NUM];
+	int total;
+	pool_status status;
+} pool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.not_empty = PTHREAD_COND_INITIALIZER,
+	.not_full = PTHREAD_COND_INITIALIZER,
+	.status = { .workers = DAEMON_WORKERS }
+};
+
+static void get_pool_status(pool_status *st) {
+	pthread_mutex_lock(&pool.lock);
+	*st = pool.status;
+	st->queued = pool.total;
+	pthread_mutex_unlock(&pool.lock);
+}
+
+void handle_request(int client, client_request req) {
 	struct ucred credentials;
 	get_client_cred(client, &credentials);
 
@@ -43,10 +119,12 @@ static void *request_handler(void *args) {
 	case POST_FS:
 	case POST_FS_DATA:
 	case LATE_START:
+	case POOL_STATUS:
+	case DAEMON_STATS:
 		if (credentials.uid != 0) {
 			write_int(client, ROOT_REQUIRED);
 			close(client);
-			return NULL;
+			return;
 		}
 	default:
 		break;
@@ -80,20 +158,267 @@ static void *request_handler(void *args) {
 		close(client);
 		break;
 	case POST_FS:
+		wait_init();
 		post_fs(client);
 		break;
 	case POST_FS_DATA:
+		wait_init();
 		post_fs_data(client);
 		break;
 	case LATE_START:
+		wait_init();
 		late_start(client);
 		break;
+	case SESSION:
+		session_receiver(client);
+		break;
+	case POOL_STATUS: {
+		pool_status st;
+		get_pool_status(&st);
+		write_int(client, DAEMON_SUCCESS);
+		write_buf(client, &st, sizeof(st));
+		close(client);
+		break;
+	}
+	case DAEMON_STATS: {
+		daemon_stats st;
+		get_daemon_stats(&st);
+		get_pool_status(&st.pool);
+		write_int(client, DAEMON_SUCCESS);
+		write_buf(client, &st, sizeof(st));
+		close(client);
+		break;
+	}
 	default:
+		close(client);
 		break;
 	}
+}
+
+request_prio get_prio(client_request req) {
+	switch (req) {
+	case POST_FS:
+	case POST_FS_DATA:
+	case LATE_START:
+		return PRIO_BOOT;
+	case LAUNCH_MAGISKHIDE:
+	case STOP_MAGISKHIDE:
+	case ADD_HIDELIST:
+	case RM_HIDELIST:
+		return PRIO_HIDE;
+	case SUPERUSER:
+		return PRIO_SU;
+	default:
+		return PRIO_INFO;
+	}
+}
+
+void set_prio(request_prio p) {
+	set_priority(prio_level[p].nice, prio_level[p].io);
+}
+
+static void spawn(void *(*func)(void *), void *arg, size_t stack) {
+	pthread_t thread;
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, stack);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	xpthread_create(&thread, &attr, func, arg);
+	pthread_attr_destroy(&attr);
+}
+
+static void *worker(void *args) {
+	int cur = PRIO_NUM;
+	while (1) {
+		pthread_mutex_lock(&pool.lock);
+		while (pool.total == 0)
+			pthread_cond_wait(&pool.not_empty, &pool.lock);
+		int q = pool.num[QUEUE_HIDE] ? QUEUE_HIDE : QUEUE_QUERY;
+		request r = pool.queue[q][pool.head[q]];
+		pool.head[q] = (pool.head[q] + 1) % QUEUE_SIZE;
+		--pool.num[q];
+		--pool.total;
+		++pool.status.busy;
+		if (pool.status.busy + pool.status.long_active > pool.status.handler_peak)
+			pool.status.handler_peak = pool.status.busy + pool.status.long_active;
+		pthread_cond_signal(&pool.not_full);
+		pthread_mutex_unlock(&pool.lock);
+
+		request_prio p = get_prio(r.req);
+		if (p != cur) {
+			set_prio(p);
+			cur = p;
+		}
+		stats_wait(p, &r.start);
+		handle_request(r.client, r.req);
+		stats_request(r.req, &r.start);
+
+		pthread_mutex_lock(&pool.lock);
+		--pool.status.busy;
+		pthread_mutex_unlock(&pool.lock);
+	}
+	return NULL;
+}
+
+static void long_done(void *args) {
+	request *r = args;
+	stats_request(r->req, &r->start);
+	pthread_mutex_lock(&pool.lock);
+	--pool.status.long_active;
+	pthread_mutex_unlock(&pool.lock);
+}
+
+static void *long_handler(void *args) {
+	request r = *(request *) args;
+	free(args);
+	request_prio p = get_prio(r.req);
+	set_prio(p);
+	stats_wait(p, &r.start);
+	// The boot stages end the thread with pthread_exit
+	pthread_cleanup_push(long_done, &r);
+	handle_request(r.client, r.req);
+	pthread_cleanup_pop(1);
 	return NULL;
 }
 
+static int is_long(client_request req) {
+	switch (req) {
+	case LAUNCH_MAGISKHIDE:
+	case SUPERUSER:
+	case POST_FS:
+	case POST_FS_DATA:
+	case LATE_START:
+	case SESSION:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/* Takes the ownership of r */
+static void dispatch(request *r) {
+	pthread_mutex_lock(&pool.lock);
+	++pool.status.accepted;
+	if (is_long(r->req)) {
+		++pool.status.long_active;
+		if (pool.status.long_active > pool.status.long_peak)
+			pool.status.long_peak = pool.status.long_active;
+		if (pool.status.busy + pool.status.long_active > pool.status.handler_peak)
+			pool.status.handler_peak = pool.status.busy + pool.status.long_active;
+		pthread_mutex_unlock(&pool.lock);
+		spawn(long_handler, r, LONG_STACK);
+		return;
+	}
+	// New connections wait in the listen backlog while the queue is full
+	while (pool.total == QUEUE_SIZE)
+		pthread_cond_wait(&pool.not_full, &pool.lock);
+	int q = get_prio(r->req) == PRIO_HIDE ? QUEUE_HIDE : QUEUE_QUERY;
+	pool.queue[q][(pool.head[q] + pool.num[q]) % QUEUE_SIZE] = *r;
+	free(r);
+	++pool.num[q];
+	++pool.total;
+	if (pool.total > pool.status.queue_peak)
+		pool.status.queue_peak = pool.total;
+	pthread_cond_signal(&pool.not_empty);
+	pthread_mutex_unlock(&pool.lock);
+}
+
+static long elapsed_ms(const struct timespec *since) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - since->tv_sec) * 1000L + (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+/* Accept connections and dispatch each client once its request arrived,
+ * clients that connect but never send anything don't take up a worker,
+ * and are dropped after PENDING_TIMEOUT so they can't exhaust our fds */
+static void accept_loop(int sockfd) {
+	// Clients are tracked by their request, the listening socket has none
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL }, events[16];
+	int efd = epoll_create1(EPOLL_CLOEXEC);
+	fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK);
+	epoll_ctl(efd, EPOLL_CTL_ADD, sockfd, &ev);
+
+	// Oldest connection first
+	struct list_head pending;
+	init_list_head(&pending);
+	// Set while the listening socket is out of the epoll set after an accept error
+	int backoff = 0;
+	struct timespec backoff_start;
+
+	for (int i = 0; i < DAEMON_WORKERS; ++i)
+		spawn(worker, NULL, WORKER_STACK);
+
+	while (1) {
+		int timeout = -1;
+		if (pending.next != &pending) {
+			request *r = list_entry(pending.next, request, pos);
+			timeout = PENDING_TIMEOUT - elapsed_ms(&r->start);
+			if (timeout < 0)
+				timeout = 0;
+		}
+		if (backoff) {
+			int left = ACCEPT_BACKOFF - elapsed_ms(&backoff_start);
+			if (left < 0)
+				left = 0;
+			if (timeout < 0 || left < timeout)
+				timeout = left;
+		}
+
+		int num = epoll_wait(efd, events, sizeof(events) / sizeof(*events), timeout);
+		if (num < 0 && errno != EINTR)
+			PLOGE("epoll_wait");
+		for (int i = 0; i < num; ++i) {
+			request *r = events[i].data.ptr;
+			if (r == NULL) {
+				// Accepted sockets are blocking, as the handlers expect
+				int client;
+				while ((client = accept4(sockfd, NULL, NULL, SOCK_CLOEXEC)) >= 0) {
+					r = xmalloc(sizeof(*r));
+					r->client = client;
+					clock_gettime(CLOCK_MONOTONIC, &r->start);
+					list_insert_end(&pending, &r->pos);
+					ev = (struct epoll_event) { .events = EPOLLIN | EPOLLRDHUP, .data.ptr = r };
+					epoll_ctl(efd, EPOLL_CTL_ADD, client, &ev);
+				}
+				if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED) {
+					// The socket stays readable, stop polling it for a while instead of spinning
+					PLOGE("accept");
+					epoll_ctl(efd, EPOLL_CTL_DEL, sockfd, NULL);
+					clock_gettime(CLOCK_MONOTONIC, &backoff_start);
+					backoff = 1;
+				}
+				continue;
+			}
+			list_pop(&r->pos);
+			epoll_ctl(efd, EPOLL_CTL_DEL, r->client, NULL);
+			if ((r->req = read_request(r->client)) < 0) {
+				close(r->client);
+				free(r);
+				continue;
+			}
+			dispatch(r);
+		}
+
+		// Drop the clients that have not sent their request in time
+		while (pending.next != &pending) {
+			request *r = list_entry(pending.next, request, pos);
+			if (elapsed_ms(&r->start) < PENDING_TIMEOUT)
+				break;
+			list_pop(&r->pos);
+			epoll_ctl(efd, EPOLL_CTL_DEL, r->client, NULL);
+			close(r->client);
+			free(r);
+		}
+
+		if (backoff && elapsed_ms(&backoff_start) >= ACCEPT_BACKOFF) {
+			ev = (struct epoll_event) { .events = EPOLLIN, .data.ptr = NULL };
+			epoll_ctl(efd, EPOLL_CTL_ADD, sockfd, &ev);
+			backoff = 0;
+		}
+	}
+}
+
 /* Setup the address and return socket fd */
 static int setup_socket(struct sockaddr_un *sun) {
 	int fd = xsocket(AF_LOCAL, SOCK_STREAM | SOCK_CLOEXEC, 0);
@@ -103,7 +428,21 @@ static int setup_socket(struct sockaddr_un *sun) {
 	return fd;
 }
 
+/* Return the listening daemon socket, or -1 if another process owns it */
+static int listen_socket() {
+	struct sockaddr_un sun;
+	int fd = setup_socket(&sun);
+	if (bind(fd, (struct sockaddr*) &sun, sizeof(sun)) == -1) {
+		close(fd);
+		return -1;
+	}
+	xlisten(fd, SOMAXCONN);
+	return fd;
+}
+
 static void *start_magisk_hide(void *args) {
+	// Not the priority of the boot stage that started it
+	set_prio(PRIO_HIDE);
 	launch_magiskhide(-1);
 	return NULL;
 }
@@ -118,23 +457,10 @@ void auto_start_magiskhide() {
 	free(hide_prop);
 }
 
-void start_daemon() {
-	setcon("u:r:su:s0");
-	umask(0);
-	int fd = xopen("/dev/null", O_RDWR | O_CLOEXEC);
-	xdup2(fd, STDIN_FILENO);
-	xdup2(fd, STDOUT_FILENO);
-	xdup2(fd, STDERR_FILENO);
-	close(fd);
-
-	struct sockaddr_un sun;
-	fd = setup_socket(&sun);
-
-	if (xbind(fd, (struct sockaddr*) &sun, sizeof(sun)) == -1)
-		exit(1);
-	xlisten(fd, 10);
-
-	if ((is_restart = access(UNBLOCKFILE, F_OK) == 0)) {
+/* Startup work that clients don't need to wait for */
+static void *late_init(void *args) {
+	int t = trace_begin("daemon late_init");
+	if (is_restart) {
 		// Restart stuffs if the daemon is restarted
 		exec_command_sync("logcat", "-b", "all", "-c", NULL);
 		auto_start_magiskhide();
@@ -146,24 +472,50 @@ void start_daemon() {
 
 	LOGI("Magisk v" xstr(MAGISK_VERSION) "(" xstr(MAGISK_VER_CODE) ") daemon started\n");
 
-	// Change process name
-	strcpy(argv0, "magisk_daemon");
-
 	// Unlock all blocks for rw
 	unlock_blocks();
 
 	// Notifiy init the daemon is started
 	close(xopen(UNBLOCKFILE, O_RDONLY | O_CREAT));
 
+	trace_end(t);
+	stats_init_done();
+	pthread_mutex_lock(&init_lock);
+	init_done = 1;
+	pthread_cond_broadcast(&init_cond);
+	pthread_mutex_unlock(&init_lock);
+	return NULL;
+}
+
+/* sockfd is the listening socket if the caller already created it, or -1 */
+void start_daemon(int sockfd) {
+	int t = trace_begin("daemon start");
+	stats_start();
+	setcon("u:r:su:s0");
+	umask(0);
+	int fd = xopen("/dev/null", O_RDWR | O_CLOEXEC);
+	xdup2(fd, STDIN_FILENO);
+	xdup2(fd, STDOUT_FILENO);
+	xdup2(fd, STDERR_FILENO);
+	close(fd);
+
+	if (sockfd < 0 && (sockfd = listen_socket()) < 0)
+		exit(1);
+
+	status_init();
+
+	is_restart = access(UNBLOCKFILE, F_OK) == 0;
+
+	// Change process name
+	strcpy(argv0, "magisk_daemon");
+
+	// Serve requests while the rest of the startup runs
+	spawn(late_init, NULL, LONG_STACK);
+	trace_end(t);
+	stats_ready();
+
 	// Loop forever to listen for requests
-	while(1) {
-		int *client = xmalloc(sizeof(int));
-		*client = xaccept4(fd, NULL, NULL, SOCK_CLOEXEC);
-		pthread_t thread;
-		xpthread_create(&thread, NULL, request_handler, client);
-		// Detach the thread, we will never join it
-		pthread_detach(thread);
-	}
+	accept_loop(sockfd);
 }
 
 /* Connect the daemon, and return a socketfd */
@@ -178,17 +530,24 @@ int connect_daemon() {
 			exit(1);
 		}
 
-		if (xfork() == 0) {
-			LOGD("client: connect fail, try launching new daemon process\n");
-			close(fd);
-			xsetsid();
-			start_daemon();
+		// Listen before forking, so the connection below is queued right away.
+		// If the bind fails, another client is starting the daemon already.
+		// The socket is labeled like the daemon, not like this client
+		setsockcreatecon("u:r:su:s0");
+		int sockfd = listen_socket();
+		setsockcreatecon(NULL);
+		if (sockfd >= 0) {
+			if (xfork() == 0) {
+				LOGD("client: connect fail, try launching new daemon process\n");
+				close(fd);
+				xsetsid();
+				start_daemon(sockfd);
+			}
+			close(sockfd);
 		}
 
-		do {
-			// Wait for 10ms
+		while (connect(fd, (struct sockaddr*) &sun, sizeof(sun)))
 			usleep(10);
-		} while (connect(fd, (struct sockaddr*) &sun, sizeof(sun)));
 	}
 	return fd;
 }
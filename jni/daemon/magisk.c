@@ -55,6 +55,17 @@ static void usage() {
 		"   --unlock-blocks           set BLKROSET flag to OFF for all block devices\n"
 		"   --restorecon              fix selinux context on Magisk files and folders\n"
 		"   --clone-attr SRC DEST     clone permission, owner, and selinux context\n"
+		"   --pool-status             print the load of the daemon request handlers\n"
+		"   --stats                   print request counts and latencies, handler\n"
+		"                             threads, su and MagiskHide activity and memory\n"
+		"                             usage of the daemon\n"
+		"   --boot-trace              print the timeline of the boot stages of the last\n"
+		"                             boot as Chrome trace-event JSON\n"
+		"   --batch                   send the commands on stdin over one daemon connection\n"
+		"                             without waiting for each response. Commands are\n"
+		"                             -v, -V, --pool-status and the magiskhide options\n"
+		"                             --disable, --ls, --add PROCESS and --rm PROCESS.\n"
+		"                             Prints <line> <result> for each of them\n"
 		"\n"
 		"Supported init services:\n"
 		"   daemon, post-fs, post-fs-data, service\n"
@@ -76,6 +87,11 @@ int main(int argc, char *argv[]) {
 			printf("%s\n", MAGISK_VER_STR);
 			return 0;
 		} else if (strcmp(argv[1], "-v") == 0) {
+			status_page st;
+			if (status_read(&st) == 0) {
+				printf("%s\n", st.ver_str);
+				return 0;
+			}
 			int fd = connect_daemon();
 			write_int(fd, CHECK_VERSION);
 			char *v = read_string(fd);
@@ -83,6 +99,11 @@ int main(int argc, char *argv[]) {
 			free(v);
 			return 0;
 		} else if (strcmp(argv[1], "-V") == 0) {
+			status_page st;
+			if (status_read(&st) == 0) {
+				printf("%d\n", st.ver_code);
+				return 0;
+			}
 			int fd = connect_daemon();
 			write_int(fd, CHECK_VERSION_CODE);
 			printf("%d\n", read_int(fd));
@@ -147,9 +168,37 @@ int main(int argc, char *argv[]) {
 			if (argc < 4) usage();
 			clone_attr(argv[2], argv[3]);
 			return 0;
+		} else if (strcmp(argv[1], "--pool-status") == 0) {
+			int fd = connect_daemon();
+			write_int(fd, POOL_STATUS);
+			if (read_int(fd) != DAEMON_SUCCESS) {
+				fprintf(stderr, "Root is required\n");
+				return 1;
+			}
+			pool_status st;
+			read_buf(fd, &st, sizeof(st));
+			printf("workers: %d/%d busy\n", st.busy, st.workers);
+			printf("queued: %d (peak %d)\n", st.queued, st.queue_peak);
+			printf("long-lived: %d (peak %d)\n", st.long_active, st.long_peak);
+			printf("accepted: %ld\n", st.accepted);
+			return 0;
+		} else if (strcmp(argv[1], "--stats") == 0) {
+			int fd = connect_daemon();
+			write_int(fd, DAEMON_STATS);
+			daemon_stats st;
+			if (read_int(fd) != DAEMON_SUCCESS || read_buf(fd, &st, sizeof(st))) {
+				fprintf(stderr, "Root is required\n");
+				return 1;
+			}
+			print_daemon_stats(&st);
+			return 0;
+		} else if (strcmp(argv[1], "--boot-trace") == 0) {
+			return print_boot_trace();
+		} else if (strcmp(argv[1], "--batch") == 0) {
+			return session_batch();
 		} else if (strcmp(argv[1], "--daemon") == 0) {
 			// Start daemon, this process won't return
-			start_daemon();
+			start_daemon(-1);
 		} else if (strcmp(argv[1], "--post-fs") == 0) {
 			int fd = connect_daemon();
 			write_int(fd, POST_FS);
@@ -0,0 +1,193 @@
+/* session.c - Many requests over one daemon connection
+ *
+ * After SESSION, the client sends any number of [seq][request][args...]
+ * without waiting for the responses. The daemon handles them in order on
+ * the same connection and answers each with [seq][response...], the client
+ * closes its end when it is done.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#include "magisk.h"
+#include "utils.h"
+#include "daemon.h"
+
+// Requests that may block for a long time need a connection of their own
+static int session_allowed(client_request req) {
+	switch (req) {
+	case STOP_MAGISKHIDE:
+	case ADD_HIDELIST:
+	case RM_HIDELIST:
+	case LS_HIDELIST:
+	case CHECK_VERSION:
+	case CHECK_VERSION_CODE:
+	case POOL_STATUS:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+void session_receiver(int client) {
+	int seq, req;
+	request_prio cur = get_prio(SESSION);
+	// A client leaving early must not take down the daemon
+	sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	while (try_read_int(client, &seq) && try_read_int(client, &req)) {
+		struct timespec start;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		write_int(client, seq);
+		if (!session_allowed(req)) {
+			write_int(client, DAEMON_ERROR);
+			continue;
+		}
+		// Each request runs at the priority of its own class
+		if (get_prio(req) != cur) {
+			cur = get_prio(req);
+			set_prio(cur);
+		}
+		// Handlers close the connection when they are done, give them a copy
+		handle_request(dup(client), req);
+		stats_request(req, &start);
+	}
+	close(client);
+}
+
+static const char *response_str(int code) {
+	switch (code) {
+	case DAEMON_SUCCESS:
+		return "OK";
+	case ROOT_REQUIRED:
+		return "Root is required for this operation";
+	case HIDE_IS_ENABLED:
+		return "Magisk hide is already enabled";
+	case HIDE_NOT_ENABLED:
+		return "Magisk hide is not enabled yet";
+	case HIDE_ITEM_EXIST:
+		return "Process already exists in hide list";
+	case HIDE_ITEM_NOT_EXIST:
+		return "Process does not exist in hide list";
+	default:
+		return "Error occured in daemon";
+	}
+}
+
+typedef struct batch_reader {
+	int fd;
+	// The request of every sent seq, in order
+	int pending;
+	int failed;
+} batch_reader;
+
+static void *read_responses(void *args) {
+	batch_reader *r = args;
+	int req, seq, code;
+	while (read(r->pending, &req, sizeof(req)) == sizeof(req)) {
+		seq = read_int(r->fd);
+		switch (req) {
+		case CHECK_VERSION: {
+			char *v = read_string(r->fd);
+			printf("%d %s\n", seq, v);
+			free(v);
+			break;
+		}
+		case CHECK_VERSION_CODE:
+			printf("%d %d\n", seq, read_int(r->fd));
+			break;
+		case POOL_STATUS:
+			if ((code = read_int(r->fd)) == DAEMON_SUCCESS) {
+				pool_status st;
+				read_buf(r->fd, &st, sizeof(st));
+				printf("%d workers %d/%d queued %d long %d accepted %ld\n", seq,
+					   st.busy, st.workers, st.queued, st.long_active, st.accepted);
+			} else {
+				printf("%d %s\n", seq, response_str(code));
+				++r->failed;
+			}
+			break;
+		default:
+			code = read_int(r->fd);
+			printf("%d %s\n", seq, response_str(code));
+			if (code != DAEMON_SUCCESS) {
+				++r->failed;
+				break;
+			}
+			if (req == LS_HIDELIST) {
+				for (int i = read_int(r->fd); i > 0; --i) {
+					char *s = read_string(r->fd);
+					printf("%d %s\n", seq, s);
+					free(s);
+				}
+			}
+			break;
+		}
+		fflush(stdout);
+	}
+	return NULL;
+}
+
+/* Send the commands read from stdin over one connection, returns 0 if all of
+ * them succeeded */
+int session_batch() {
+	char line[4096];
+	int fd = connect_daemon(), pending[2], seq = 0, failed = 0;
+	batch_reader r = { .fd = fd };
+	pthread_t reader;
+
+	write_int(fd, SESSION);
+	xpipe2(pending, O_CLOEXEC);
+	r.pending = pending[0];
+	xpthread_create(&reader, NULL, read_responses, &r);
+
+	while (fgets(line, sizeof(line), stdin)) {
+		char *cmd = strtok(line, " \t\r\n"), *arg = strtok(NULL, " \t\r\n");
+		client_request req;
+		if (cmd == NULL || cmd[0] == '#')
+			continue;
+		++seq;
+		if (strcmp(cmd, "-v") == 0) {
+			req = CHECK_VERSION;
+		} else if (strcmp(cmd, "-V") == 0) {
+			req = CHECK_VERSION_CODE;
+		} else if (strcmp(cmd, "--pool-status") == 0) {
+			req = POOL_STATUS;
+		} else if (strcmp(cmd, "--disable") == 0) {
+			req = STOP_MAGISKHIDE;
+		} else if (strcmp(cmd, "--ls") == 0) {
+			req = LS_HIDELIST;
+		} else if (strcmp(cmd, "--add") == 0 && arg) {
+			req = ADD_HIDELIST;
+		} else if (strcmp(cmd, "--rm") == 0 && arg) {
+			req = RM_HIDELIST;
+		} else {
+			fprintf(stderr, "%d: unsupported command [%s]\n", seq, cmd);
+			++failed;
+			continue;
+		}
+		write_int(fd, seq);
+		write_int(fd, req);
+		if (req == ADD_HIDELIST || req == RM_HIDELIST)
+			write_string(fd, arg);
+		xwrite(pending[1], &req, sizeof(req));
+	}
+
+	// The daemon ends the session after the last request
+	close(pending[1]);
+	shutdown(fd, SHUT_WR);
+	pthread_join(reader, NULL);
+	close(pending[0]);
+	close(fd);
+	return failed + r.failed != 0;
+}
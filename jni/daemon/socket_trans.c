@@ -1,39 +1,120 @@
 /* socket_trans.c - Functions to transfer data through socket
+ *
+ * Every value is sent as a frame: a header with the type, payload length,
+ * sequence and the number of attached fds, followed by the payload, all
+ * with a single sendmsg. The fds travel as SCM_RIGHTS with the frame.
+ * Reads go through a per-thread buffer, one recvmsg fills it with as many
+ * frames as are available, and the helpers take their values from there.
  */
 
 #include <unistd.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <limits.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <pthread.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <sys/socket.h>
 
 #include "magisk.h"
 #include "utils.h"
 #include "daemon.h"
 
-/*
- * Receive a file descriptor from a Unix socket.
- * Contributed by @mkasick
- *
- * Returns the file descriptor on success, or -1 if a file
- * descriptor was not actually included in the message
- *
- * On error the function terminates by calling exit(-1)
- */
-int recv_fd(int sockfd) {
-    // Need to receive data from the message, otherwise don't care about it.
-    char iovbuf;
+enum {
+    FRAME_INT,
+    FRAME_STRING,
+    FRAME_BUF,
+    FRAME_FDS,
+};
 
-    struct iovec iov = {
-        .iov_base = &iovbuf,
-        .iov_len  = 1,
+typedef struct frame_hdr {
+    uint32_t type;
+    uint32_t len;
+    uint32_t seq;
+    uint32_t nfds;
+} frame_hdr;
+
+#define READ_BUF_SIZE (2 * PATH_MAX)
+
+// Data read ahead from the socket this thread currently reads
+static __thread struct {
+    ino_t ino;
+    size_t pos, len;
+    int fds[MAX_FRAME_FDS * 2];
+    int nfds;
+    char buf[READ_BUF_SIZE];
+} rd;
+
+static pthread_once_t reader_once = PTHREAD_ONCE_INIT;
+static pthread_key_t reader_key;
+
+static int send_frame(int sockfd, uint32_t type, const void *data, size_t len,
+                      const int *fds, int nfds) {
+    frame_hdr hdr = { .type = type, .len = len, .nfds = nfds };
+    struct iovec iov[2] = {
+        { .iov_base = &hdr,          .iov_len = sizeof(hdr) },
+        { .iov_base = (void *) data, .iov_len = len },
     };
+    struct msghdr msg = {
+        .msg_iov    = iov,
+        .msg_iovlen = len ? 2 : 1,
+    };
+    char cmsgbuf[CMSG_SPACE(sizeof(int) * MAX_FRAME_FDS)];
+
+    if (nfds) {
+        msg.msg_control    = cmsgbuf;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+
+        cmsg->cmsg_len   = CMSG_LEN(sizeof(int) * nfds);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type  = SCM_RIGHTS;
+
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+    }
+
+    return xsendmsg(sockfd, &msg, 0) == sizeof(hdr) + len ? 0 : -1;
+}
+
+static void drop_reader(void *unused) {
+    for (int i = 0; i < rd.nfds; ++i)
+        close(rd.fds[i]);
+    rd.ino = 0;
+    rd.pos = rd.len = 0;
+    rd.nfds = 0;
+}
+
+static void reader_key_init() {
+    pthread_key_create(&reader_key, drop_reader);
+}
+
+/* Switch the read buffer to sockfd. The fd number alone says nothing, it is
+ * reused once a client is closed, so read ahead data is only kept for the
+ * same socket inode and dropped for any other */
+static void select_reader(int sockfd) {
+    struct stat st;
+    if (fstat(sockfd, &st))
+        st.st_ino = 0;
+    if (st.st_ino && st.st_ino == rd.ino)
+        return;
+    drop_reader(NULL);
+    rd.ino = st.st_ino;
+}
 
-    char cmsgbuf[CMSG_SPACE(sizeof(int))];
+static int fill_reader(int sockfd) {
+    memmove(rd.buf, rd.buf + rd.pos, rd.len - rd.pos);
+    rd.len -= rd.pos;
+    rd.pos = 0;
 
+    struct iovec iov = {
+        .iov_base = rd.buf + rd.len,
+        .iov_len  = sizeof(rd.buf) - rd.len,
+    };
+    char cmsgbuf[CMSG_SPACE(sizeof(int) * MAX_FRAME_FDS)];
     struct msghdr msg = {
         .msg_iov        = &iov,
         .msg_iovlen     = 1,
@@ -41,108 +122,192 @@ int recv_fd(int sockfd) {
         .msg_controllen = sizeof(cmsgbuf),
     };
 
-    xrecvmsg(sockfd, &msg, MSG_WAITALL);
-
-    // Was a control message actually sent?
-    switch (msg.msg_controllen) {
-    case 0:
-        // No, so the file descriptor was closed and won't be used.
+    ssize_t n;
+    do {
+        n = recvmsg(sockfd, &msg, MSG_CMSG_CLOEXEC);
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0)
         return -1;
-    case sizeof(cmsgbuf):
-        // Yes, grab the file descriptor from it.
-        break;
-    default:
-        goto error;
+    rd.len += n;
+
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+        int num = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        int *fds = (int *) CMSG_DATA(cmsg);
+        if (num) {
+            // Close the queued fds if the thread exits before taking them
+            pthread_once(&reader_once, reader_key_init);
+            pthread_setspecific(reader_key, &rd);
+        }
+        for (int i = 0; i < num; ++i) {
+            if (rd.nfds < sizeof(rd.fds) / sizeof(*rd.fds))
+                rd.fds[rd.nfds++] = fds[i];
+            else
+                close(fds[i]);
+        }
     }
+    return 0;
+}
 
-    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+/* Read the next frame, which has to be of the given type. The payload points
+ * into the read buffer and stays valid until the next read on this thread */
+static int recv_frame(int sockfd, uint32_t type, frame_hdr *hdr, const void **payload) {
+    select_reader(sockfd);
+    while (rd.len - rd.pos < sizeof(*hdr)) {
+        if (fill_reader(sockfd))
+            return -1;
+    }
+    memcpy(hdr, rd.buf + rd.pos, sizeof(*hdr));
+    if (hdr->type != type || hdr->len > sizeof(rd.buf) - sizeof(*hdr) ||
+        hdr->nfds > MAX_FRAME_FDS)
+        return -1;
+    while (rd.len - rd.pos < sizeof(*hdr) + hdr->len) {
+        if (fill_reader(sockfd))
+            return -1;
+    }
+    *payload = rd.buf + rd.pos + sizeof(*hdr);
+    rd.pos += sizeof(*hdr) + hdr->len;
+    return 0;
+}
 
-    if (cmsg             == NULL                  ||
-        cmsg->cmsg_len   != CMSG_LEN(sizeof(int)) ||
-        cmsg->cmsg_level != SOL_SOCKET            ||
-        cmsg->cmsg_type  != SCM_RIGHTS) {
-error:
+/*
+ * Receive up to max file descriptors sent together with send_fds.
+ *
+ * Returns the number of file descriptors received, the ones that
+ * did not fit are closed
+ *
+ * On error the function terminates by calling exit(-1)
+ */
+int recv_fds(int sockfd, int *fds, int max) {
+    frame_hdr hdr;
+    const void *payload;
+    if (recv_frame(sockfd, FRAME_FDS, &hdr, &payload) || hdr.nfds > rd.nfds) {
         LOGE("unable to read fd");
         exit(-1);
     }
-
-    return *(int *)CMSG_DATA(cmsg);
+    int num = 0;
+    for (int i = 0; i < hdr.nfds; ++i) {
+        if (num < max)
+            fds[num++] = rd.fds[i];
+        else
+            close(rd.fds[i]);
+    }
+    rd.nfds -= hdr.nfds;
+    memmove(rd.fds, rd.fds + hdr.nfds, rd.nfds * sizeof(int));
+    return num;
 }
 
 /*
- * Send a file descriptor through a Unix socket.
- * Contributed by @mkasick
+ * Send up to MAX_FRAME_FDS file descriptors through a Unix socket in
+ * one message. Closed file descriptors are skipped.
  *
  * On error the function terminates by calling exit(-1)
- *
- * fd may be -1, in which case the dummy data is sent,
- * but no control message with the FD is sent.
  */
-void send_fd(int sockfd, int fd) {
-    // Need to send some data in the message, this will do.
-    struct iovec iov = {
-        .iov_base = "",
-        .iov_len  = 1,
-    };
-
-    struct msghdr msg = {
-        .msg_iov        = &iov,
-        .msg_iovlen     = 1,
-    };
-
-    char cmsgbuf[CMSG_SPACE(sizeof(int))];
-
-    if (fd != -1) {
+void send_fds(int sockfd, const int *fds, int num) {
+    int open_fds[MAX_FRAME_FDS], nfds = 0;
+    for (int i = 0; i < num && nfds < MAX_FRAME_FDS; ++i) {
         // Is the file descriptor actually open?
-        if (fcntl(fd, F_GETFD) == -1) {
-            if (errno != EBADF) {
+        if (fds[i] < 0 || fcntl(fds[i], F_GETFD) == -1) {
+            if (fds[i] >= 0 && errno != EBADF) {
                 PLOGE("unable to send fd");
             }
-            // It's closed, don't send a control message or sendmsg will EBADF.
-        } else {
-            // It's open, send the file descriptor in a control message.
-            msg.msg_control    = cmsgbuf;
-            msg.msg_controllen = sizeof(cmsgbuf);
-
-            struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
-
-            cmsg->cmsg_len   = CMSG_LEN(sizeof(int));
-            cmsg->cmsg_level = SOL_SOCKET;
-            cmsg->cmsg_type  = SCM_RIGHTS;
-
-            *(int *)CMSG_DATA(cmsg) = fd;
+            // It's closed, don't send it or sendmsg will EBADF.
+            continue;
         }
+        open_fds[nfds++] = fds[i];
     }
+    if (send_frame(sockfd, FRAME_FDS, NULL, 0, open_fds, nfds)) {
+        LOGE("unable to send fd");
+        exit(-1);
+    }
+}
 
-    xsendmsg(sockfd, &msg, 0);
+/*
+ * Receive a file descriptor from a Unix socket.
+ *
+ * Returns the file descriptor on success, or -1 if a file
+ * descriptor was not actually included in the message
+ */
+int recv_fd(int sockfd) {
+    int fd;
+    return recv_fds(sockfd, &fd, 1) ? fd : -1;
+}
+
+/*
+ * Send a file descriptor through a Unix socket.
+ *
+ * fd may be -1, in which case the message is sent without any fd.
+ */
+void send_fd(int sockfd, int fd) {
+    send_fds(sockfd, &fd, 1);
+}
+
+/* Returns 0 if the peer closed the connection instead of sending an int */
+int try_read_int(int fd, int *val) {
+    frame_hdr hdr;
+    const void *payload;
+    if (recv_frame(fd, FRAME_INT, &hdr, &payload) || hdr.len != sizeof(int))
+        return 0;
+    memcpy(val, payload, sizeof(int));
+    return 1;
 }
 
 int read_int(int fd) {
-    int val;
-    xxread(fd, &val, sizeof(int));
+    int val = -1;
+    if (!try_read_int(fd, &val))
+        LOGE("unable to read int");
     return val;
 }
 
 void write_int(int fd, int val) {
     if (fd < 0) return;
-    xwrite(fd, &val, sizeof(int));
+    send_frame(fd, FRAME_INT, &val, sizeof(val), NULL, 0);
+}
+
+/* Read the request a client sends first, without waiting and without
+ * reading ahead, as the connection is handed to another thread afterwards.
+ * Returns -1 if it has not fully arrived */
+int read_request(int fd) {
+    struct {
+        frame_hdr hdr;
+        int val;
+    } frame;
+    if (recv(fd, &frame, sizeof(frame), MSG_DONTWAIT) != sizeof(frame) ||
+        frame.hdr.type != FRAME_INT || frame.hdr.len != sizeof(int))
+        return -1;
+    return frame.val;
 }
 
 char* read_string(int fd) {
-    int len = read_int(fd);
-    if (len > PATH_MAX || len < 0) {
-        LOGE("invalid string length %d", len);
+    frame_hdr hdr;
+    const char *payload;
+    if (recv_frame(fd, FRAME_STRING, &hdr, (const void **) &payload) || hdr.len > PATH_MAX) {
+        LOGE("invalid string");
         exit(1);
     }
-    char* val = xmalloc(sizeof(char) * (len + 1));
-    xxread(fd, val, len);
-    val[len] = '\0';
+    char* val = xmalloc(sizeof(char) * (hdr.len + 1));
+    memcpy(val, payload, hdr.len);
+    val[hdr.len] = '\0';
     return val;
 }
 
 void write_string(int fd, const char* val) {
     if (fd < 0) return;
-    int len = strlen(val);
-    write_int(fd, len);
-    xwrite(fd, val, len);
+    send_frame(fd, FRAME_STRING, val, strlen(val), NULL, 0);
+}
+
+/* Read exactly len bytes sent with write_buf, returns 0 on success */
+int read_buf(int fd, void *buf, size_t len) {
+    frame_hdr hdr;
+    const void *payload;
+    if (recv_frame(fd, FRAME_BUF, &hdr, &payload) || hdr.len != len)
+        return -1;
+    memcpy(buf, payload, len);
+    return 0;
+}
+
+void write_buf(int fd, const void *buf, size_t len) {
+    if (fd < 0) return;
+    send_frame(fd, FRAME_BUF, buf, len, NULL, 0);
 }
@@ -0,0 +1,253 @@
+/* stats.c - Daemon performance counters
+ *
+ * Every thread counts into a block of its own, so recording a request is a
+ * few relaxed stores without any lock or shared cache line. Blocks are only
+ * ever added to a global list, a block of an exited thread is taken over by
+ * the next new thread, and DAEMON_STATS sums all blocks when asked.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "magisk.h"
+#include "utils.h"
+#include "daemon.h"
+
+typedef struct thread_stats {
+	struct thread_stats *next;
+	int in_use;
+	long hide_events;
+	long count[REQUEST_NUM];
+	uint32_t hist[REQUEST_NUM][STATS_BUCKETS];
+	long wait_count[PRIO_NUM];
+	uint32_t wait_hist[PRIO_NUM][STATS_BUCKETS];
+	// su requests of the last minute, one slot per second
+	long su_sec[60];
+	int su_count[60];
+} thread_stats;
+
+static thread_stats *all_stats;
+static pthread_key_t stats_key;
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+static __thread thread_stats *self;
+static struct timespec start_time;
+static long ready_us, init_us;
+
+static void release_stats(void *block) {
+	__atomic_store_n(&((thread_stats *) block)->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void init_stats() {
+	pthread_key_create(&stats_key, release_stats);
+}
+
+static thread_stats *get_stats() {
+	if (self)
+		return self;
+	pthread_once(&stats_once, init_stats);
+	for (thread_stats *s = __atomic_load_n(&all_stats, __ATOMIC_ACQUIRE); s; s = s->next) {
+		int unused = 0;
+		if (__atomic_compare_exchange_n(&s->in_use, &unused, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+			self = s;
+			break;
+		}
+	}
+	if (self == NULL) {
+		self = xcalloc(1, sizeof(*self));
+		self->in_use = 1;
+		self->next = __atomic_load_n(&all_stats, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&all_stats, &self->next, self, 1,
+											__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	}
+	pthread_setspecific(stats_key, self);
+	return self;
+}
+
+static inline void inc(long *counter) {
+	// Only the owning thread writes, readers may see a slightly stale value
+	__atomic_store_n(counter, *counter + 1, __ATOMIC_RELAXED);
+}
+
+static long now_sec() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+static long since_start_us() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start_time.tv_sec) * 1000000L + (now.tv_nsec - start_time.tv_nsec) / 1000;
+}
+
+void stats_start() {
+	clock_gettime(CLOCK_MONOTONIC, &start_time);
+}
+
+void stats_ready() {
+	__atomic_store_n(&ready_us, since_start_us(), __ATOMIC_RELAXED);
+}
+
+void stats_init_done() {
+	__atomic_store_n(&init_us, since_start_us(), __ATOMIC_RELAXED);
+}
+
+/* Bucket i holds latencies below 2^i us */
+static int bucket(const struct timespec *start) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	// A 32 bit long holds only 36 minutes in us
+	int64_t us = (now.tv_sec - start->tv_sec) * 1000000LL + (now.tv_nsec - start->tv_nsec) / 1000;
+	int i = 0;
+	while (i < STATS_BUCKETS - 1 && us >= (1LL << i))
+		++i;
+	return i;
+}
+
+void stats_request(client_request req, const struct timespec *start) {
+	if (req < 0 || req >= REQUEST_NUM)
+		return;
+	thread_stats *s = get_stats();
+	int b = bucket(start);
+	inc(&s->count[req]);
+	__atomic_store_n(&s->hist[req][b], s->hist[req][b] + 1, __ATOMIC_RELAXED);
+	if (req == SUPERUSER) {
+		long sec = now_sec();
+		int slot = sec % 60;
+		if (s->su_sec[slot] != sec) {
+			// A new second, the count of a minute ago is dropped
+			__atomic_store_n(&s->su_count[slot], 0, __ATOMIC_RELAXED);
+			__atomic_store_n(&s->su_sec[slot], sec, __ATOMIC_RELAXED);
+		}
+		__atomic_store_n(&s->su_count[slot], s->su_count[slot] + 1, __ATOMIC_RELAXED);
+	}
+}
+
+void stats_wait(request_prio prio, const struct timespec *start) {
+	thread_stats *s = get_stats();
+	int b = bucket(start);
+	inc(&s->wait_count[prio]);
+	__atomic_store_n(&s->wait_hist[prio][b], s->wait_hist[prio][b] + 1, __ATOMIC_RELAXED);
+}
+
+void stats_hide_event() {
+	inc(&get_stats()->hide_events);
+}
+
+static void read_memory(daemon_stats *st) {
+	char line[128];
+	FILE *fp = fopen("/proc/self/status", "re");
+	if (fp == NULL)
+		return;
+	while (fgets(line, sizeof(line), fp)) {
+		sscanf(line, "VmRSS: %ld", &st->rss_kb);
+		sscanf(line, "VmHWM: %ld", &st->rss_peak_kb);
+		sscanf(line, "Threads: %d", &st->threads);
+	}
+	fclose(fp);
+}
+
+void get_daemon_stats(daemon_stats *st) {
+	memset(st, 0, sizeof(*st));
+	st->uptime = now_sec() - start_time.tv_sec;
+	st->ready_us = __atomic_load_n(&ready_us, __ATOMIC_RELAXED);
+	st->init_us = __atomic_load_n(&init_us, __ATOMIC_RELAXED);
+	long sec = now_sec();
+	for (thread_stats *s = __atomic_load_n(&all_stats, __ATOMIC_ACQUIRE); s; s = s->next) {
+		st->hide_events += __atomic_load_n(&s->hide_events, __ATOMIC_RELAXED);
+		for (int i = 0; i < REQUEST_NUM; ++i) {
+			st->count[i] += __atomic_load_n(&s->count[i], __ATOMIC_RELAXED);
+			for (int j = 0; j < STATS_BUCKETS; ++j)
+				st->hist[i][j] += __atomic_load_n(&s->hist[i][j], __ATOMIC_RELAXED);
+		}
+		for (int i = 0; i < PRIO_NUM; ++i) {
+			st->wait_count[i] += __atomic_load_n(&s->wait_count[i], __ATOMIC_RELAXED);
+			for (int j = 0; j < STATS_BUCKETS; ++j)
+				st->wait_hist[i][j] += __atomic_load_n(&s->wait_hist[i][j], __ATOMIC_RELAXED);
+		}
+		for (int i = 0; i < 60; ++i) {
+			if (sec - __atomic_load_n(&s->su_sec[i], __ATOMIC_RELAXED) < 60)
+				st->su_last_min += __atomic_load_n(&s->su_count[i], __ATOMIC_RELAXED);
+		}
+	}
+	read_memory(st);
+}
+
+static const char *request_names[REQUEST_NUM] = {
+	[DO_NOTHING] = "do_nothing",
+	[LAUNCH_MAGISKHIDE] = "launch_magiskhide",
+	[STOP_MAGISKHIDE] = "stop_magiskhide",
+	[ADD_HIDELIST] = "add_hidelist",
+	[RM_HIDELIST] = "rm_hidelist",
+	[LS_HIDELIST] = "ls_hidelist",
+	[SUPERUSER] = "superuser",
+	[CHECK_VERSION] = "check_version",
+	[CHECK_VERSION_CODE] = "check_version_code",
+	[POST_FS] = "post_fs",
+	[POST_FS_DATA] = "post_fs_data",
+	[LATE_START] = "late_start",
+	[POOL_STATUS] = "pool_status",
+	[SESSION] = "session",
+	[DAEMON_STATS] = "daemon_stats",
+	[TEST] = "test",
+};
+
+static const char *prio_names[PRIO_NUM] = {
+	[PRIO_BOOT] = "boot",
+	[PRIO_HIDE] = "magiskhide",
+	[PRIO_SU] = "superuser",
+	[PRIO_INFO] = "query",
+};
+
+/* Upper bound of the bucket the percentile falls in */
+static void percentile(const uint32_t *hist, long count, int pct, char *buf, size_t size) {
+	long rank = (count * pct + 99) / 100, seen = 0;
+	int i;
+	for (i = 0; i < STATS_BUCKETS - 1; ++i) {
+		seen += hist[i];
+		if (seen >= rank)
+			break;
+	}
+	long long us = 1LL << i;
+	if (i == STATS_BUCKETS - 1)
+		snprintf(buf, size, ">%llds", us / 2000000);
+	else if (us < 1000)
+		snprintf(buf, size, "<%lldus", us);
+	else if (us < 1000000)
+		snprintf(buf, size, "<%lldms", us / 1000);
+	else
+		snprintf(buf, size, "<%llds", us / 1000000);
+}
+
+static void print_table(const char *title, const char **names, int num, const long *count,
+						const uint32_t (*hist)[STATS_BUCKETS]) {
+	printf("\n%-20s %8s %8s %8s %8s\n", title, "count", "p50", "p95", "p99");
+	for (int i = 0; i < num; ++i) {
+		char p50[16], p95[16], p99[16];
+		if (count[i] == 0)
+			continue;
+		percentile(hist[i], count[i], 50, p50, sizeof(p50));
+		percentile(hist[i], count[i], 95, p95, sizeof(p95));
+		percentile(hist[i], count[i], 99, p99, sizeof(p99));
+		printf("%-20s %8ld %8s %8s %8s\n", names[i], count[i], p50, p95, p99);
+	}
+}
+
+void print_daemon_stats(const daemon_stats *st) {
+	long su = st->count[SUPERUSER];
+	printf("uptime: %ld s\n", st->uptime);
+	printf("startup: serving after %ld us, initialized after %ld us\n", st->ready_us, st->init_us);
+	printf("handlers: %d active, %d peak (%d/%d workers busy, %d queued, %d long-lived)\n",
+		   st->pool.busy + st->pool.long_active, st->pool.handler_peak, st->pool.busy,
+		   st->pool.workers, st->pool.queued, st->pool.long_active);
+	printf("su: %ld total, %d last minute, %.1f per minute\n", su, st->su_last_min,
+		   st->uptime ? su * 60.0 / st->uptime : 0.0);
+	printf("hide events: %ld\n", st->hide_events);
+	printf("memory: %ld kB rss, %ld kB peak, %d threads\n", st->rss_kb, st->rss_peak_kb, st->threads);
+	print_table("request", request_names, REQUEST_NUM, st->count, st->hist);
+	print_table("queue wait", prio_names, PRIO_NUM, st->wait_count, st->wait_hist);
+}
@@ -0,0 +1,133 @@
+/* status.c - Daemon status published in shared memory
+ *
+ * The daemon keeps its version, the MagiskHide state and list, and the
+ * finished boot stages in a page on tmpfs. Root clients map it and read a
+ * consistent copy without a round trip to the daemon. The daemon is the
+ * only writer, readers retry while the sequence number is odd or changed
+ * under them, and fall back to the socket if the page is missing or stale.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <errno.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "magisk.h"
+#include "utils.h"
+#include "daemon.h"
+
+#define STATUS_MAGIC   0x5453474d  /* "MGST" */
+#define STATUS_RETRY   1000
+
+static status_page *page;
+static pthread_mutex_t status_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void write_begin() {
+	pthread_mutex_lock(&status_lock);
+	__atomic_store_n(&page->seq, page->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void write_end() {
+	__atomic_store_n(&page->seq, page->seq + 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&status_lock);
+}
+
+/* Create a new page and replace the one of the previous daemon, readers
+ * still holding the old page keep a valid mapping */
+void status_init() {
+	int fd = open(STATUSPAGE ".tmp", O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0)
+		return;
+	void *map = MAP_FAILED;
+	if (ftruncate(fd, sizeof(status_page)) == 0)
+		map = mmap(NULL, sizeof(status_page), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		unlink(STATUSPAGE ".tmp");
+		return;
+	}
+	page = map;
+	page->magic = STATUS_MAGIC;
+	page->layout = STATUS_LAYOUT;
+	page->pid = getpid();
+	page->ver_code = MAGISK_VER_CODE;
+	strncpy(page->ver_str, MAGISK_VER_STR, sizeof(page->ver_str) - 1);
+	rename(STATUSPAGE ".tmp", STATUSPAGE);
+}
+
+void status_stage_done(int stage) {
+	if (page == NULL)
+		return;
+	write_begin();
+	page->boot_stages |= stage;
+	write_end();
+}
+
+/* Publish the MagiskHide state, list is the current hide list or NULL */
+void status_hide(int enabled, struct vector *list) {
+	char *s;
+	if (page == NULL)
+		return;
+	write_begin();
+	page->hide_enabled = enabled;
+	page->hide_num = 0;
+	page->hide_size = 0;
+	if (list) {
+		vec_for_each(list, s) {
+			size_t len = strlen(s) + 1;
+			if (page->hide_size + len > sizeof(page->hide_list)) {
+				// Too long, readers ask the daemon
+				page->hide_num = -1;
+				break;
+			}
+			memcpy(page->hide_list + page->hide_size, s, len);
+			page->hide_size += len;
+			++page->hide_num;
+		}
+	}
+	write_end();
+}
+
+/* Copy a consistent snapshot of the page of the running daemon into st.
+ * Returns 0 on success, or -1 if the socket has to be used instead */
+int status_read(status_page *st) {
+	int fd = open(STATUSPAGE, O_RDONLY | O_CLOEXEC), ret = -1;
+	if (fd < 0)
+		return -1;
+	struct stat s;
+	const status_page *map = MAP_FAILED;
+	if (fstat(fd, &s) == 0 && s.st_size == sizeof(*map))
+		map = mmap(NULL, sizeof(*map), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return -1;
+
+	for (int i = 0; i < STATUS_RETRY; ++i) {
+		uint32_t seq = __atomic_load_n(&map->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1) {
+			sched_yield();
+			continue;
+		}
+		memcpy(st, map, sizeof(*st));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&map->seq, __ATOMIC_RELAXED) == seq) {
+			ret = 0;
+			break;
+		}
+	}
+	munmap((void *) map, sizeof(*map));
+
+	// The page outlives a daemon that died
+	if (ret == 0 && (st->magic != STATUS_MAGIC || st->layout != STATUS_LAYOUT ||
+		(kill(st->pid, 0) && errno == ESRCH)))
+		ret = -1;
+	return ret;
+}
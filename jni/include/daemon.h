@@ -5,6 +5,8 @@
 #define _DAEMON_H_
 
 #include <pthread.h>
+#include <stdint.h>
+#include <time.h>
 
 extern pthread_t sepol_patch;
 extern int is_restart;
@@ -23,9 +25,24 @@ typedef enum {
 	POST_FS,
 	POST_FS_DATA,
 	LATE_START,
+	POOL_STATUS,
+	SESSION,
+	DAEMON_STATS,
 	TEST
 } client_request;
 
+#define REQUEST_NUM (TEST + 1)
+
+// Scheduling classes of the requests, they set the CPU and I/O priority of
+// the handling thread
+typedef enum {
+	PRIO_BOOT = 0,  // Boot stages, init is waiting for them
+	PRIO_HIDE,      // MagiskHide, racing against the app startup
+	PRIO_SU,
+	PRIO_INFO,      // Queries
+	PRIO_NUM
+} request_prio;
+
 // Return codes for daemon
 typedef enum {
 	DAEMON_ERROR = -1,
@@ -37,20 +54,110 @@ typedef enum {
 	HIDE_ITEM_NOT_EXIST,
 } daemon_response;
 
+// Load of the daemon request handlers
+typedef struct pool_status {
+	int workers;      // Threads in the pool for short requests
+	int busy;         // Workers handling a request
+	int queued;       // Requests waiting for a worker
+	int queue_peak;
+	int long_active;  // Long-lived handlers with their own thread
+	int long_peak;
+	int handler_peak; // Most busy workers and long-lived handlers at once
+	long accepted;    // Requests received since the daemon started
+} pool_status;
+
 // daemon.c
 
-void start_daemon();
+void start_daemon(int sockfd);
 int connect_daemon();
 void auto_start_magiskhide();
+void handle_request(int client, client_request req);
+request_prio get_prio(client_request req);
+void set_prio(request_prio p);
+
+// stats.c
+
+// Latency histogram buckets, bucket i counts requests that took less than 2^i us
+#define STATS_BUCKETS 32
+
+typedef struct daemon_stats {
+	long uptime;      // In seconds
+	long ready_us;    // From the daemon start until requests are served
+	long init_us;     // From the daemon start until the startup work is done
+	pool_status pool;
+	int su_last_min;
+	long hide_events;
+	long rss_kb;
+	long rss_peak_kb;
+	int threads;
+	long count[REQUEST_NUM];
+	uint32_t hist[REQUEST_NUM][STATS_BUCKETS];
+	// Time from accept until a handler picked the request up
+	long wait_count[PRIO_NUM];
+	uint32_t wait_hist[PRIO_NUM][STATS_BUCKETS];
+} daemon_stats;
+
+void stats_start();
+void stats_ready();
+void stats_init_done();
+void stats_request(client_request req, const struct timespec *start);
+void stats_wait(request_prio prio, const struct timespec *start);
+void stats_hide_event();
+void get_daemon_stats(daemon_stats *st);
+void print_daemon_stats(const daemon_stats *st);
+
+// status.c
+
+#define STATUS_LAYOUT     1
+#define STATUS_LIST_SIZE  (16 * 1024)
+
+// Bits of status_page.boot_stages
+#define STAGE_POST_FS       0x1
+#define STAGE_POST_FS_DATA  0x2
+#define STAGE_LATE_START    0x4
+
+typedef struct status_page {
+	uint32_t magic;
+	uint32_t layout;      // Bumped when the fields change
+	uint32_t seq;         // Odd while the daemon is writing
+	int32_t pid;          // Of the daemon
+	int32_t ver_code;
+	char ver_str[64];
+	int32_t boot_stages;  // The finished boot stages
+	int32_t hide_enabled;
+	int32_t hide_num;     // -1 if the list did not fit in hide_list
+	uint32_t hide_size;
+	char hide_list[STATUS_LIST_SIZE];  // hide_num NUL terminated names
+} status_page;
+
+struct vector;
+
+void status_init();
+void status_stage_done(int stage);
+void status_hide(int enabled, struct vector *list);
+int status_read(status_page *st);
+
+// session.c
+
+void session_receiver(int client);
+int session_batch();
 
 // socket_trans.c
 
+#define MAX_FRAME_FDS 8
+
 int recv_fd(int sockfd);
 void send_fd(int sockfd, int fd);
+int recv_fds(int sockfd, int *fds, int max);
+void send_fds(int sockfd, const int *fds, int num);
 int read_int(int fd);
+int try_read_int(int fd, int *val);
 void write_int(int fd, int val);
+int read_request(int fd);
 char* read_string(int fd);
 void write_string(int fd, const char* val);
+int read_buf(int fd, void *buf, size_t len);
+void write_buf(int fd, const void *buf, size_t len);
 
 /***************
  * Boot Stages *
@@ -61,6 +168,13 @@ void post_fs_data(int client);
 void late_start(int client);
 void fix_filecon();
 
+// boottrace.c
+
+int trace_begin(const char *fmt, ...);
+void trace_end(int id);
+void save_boot_trace();
+int print_boot_trace();
+
 /**************
  * MagiskHide *
  **************/
@@ -0,0 +1,124 @@
+/* libmagiskboot.h - Boot image and ramdisk manipulation as a library
+ *
+ * Everything declared here works on memory buffers, never exits, and reports
+ * failures with the negative BOOT_E* codes below. Results are written to an
+ * out_stream, which either appends to a growing buffer or writes to a fd.
+ */
+
+#ifndef _LIBMAGISKBOOT_H_
+#define _LIBMAGISKBOOT_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "vector.h"
+
+#define BOOT_OK          0
+#define BOOT_ENOMEM     -1
+#define BOOT_EIO        -2
+#define BOOT_EFORMAT    -3
+#define BOOT_ECODEC     -4
+#define BOOT_ENOENT     -5
+#define BOOT_EINVAL     -6
+#define BOOT_EELF32     -7
+#define BOOT_EELF64     -8
+
+const char *boot_strerror(int err);
+
+/* Streams */
+
+typedef struct out_stream {
+	int fd;
+	// File offset of the first byte, -1 if fd cannot seek
+	off_t base;
+	void *buf;
+	size_t size;
+	size_t cap;
+} out_stream;
+
+// Write to fd, or append to buf which the caller frees
+void fd_stream(out_stream *out, int fd);
+void mem_stream(out_stream *out);
+int stream_write(out_stream *out, const void *buf, size_t size);
+// Overwrite data already written, pos counts from the start of the stream
+int stream_patch(out_stream *out, size_t pos, const void *buf, size_t size);
+
+/* Boot images */
+
+typedef enum {
+	BOOT_KERNEL,
+	BOOT_RAMDISK,
+	BOOT_SECOND,
+	BOOT_DTB,
+	BOOT_EXTRA,
+	BOOT_COMPONENT_NUM
+} boot_component;
+
+struct boot_img;
+struct boot_img_hdr;
+
+typedef struct boot_image boot_image;
+
+// The image buffer is referenced, not copied, and has to outlive the handle.
+// Sparse images are expanded into memory owned by the handle
+int boot_open(const void *buf, size_t size, boot_image **img);
+void boot_close(boot_image *img);
+const struct boot_img_hdr *boot_header(boot_image *img);
+int boot_is_chromeos(boot_image *img);
+
+// Component data as stored in the image, i.e. still compressed
+int boot_get(boot_image *img, boot_component c, const void **data, size_t *size);
+int boot_set(boot_image *img, boot_component c, const void *data, size_t size);
+// A file_t from types.h
+int boot_format(boot_image *img, boot_component c);
+
+// Assemble the image with its components, MTK headers, tail and a fresh id
+int boot_build(boot_image *img, out_stream *out);
+
+// Parse an AOSP boot image without printing or exiting
+int boot_parse(const void *buf, size_t size, struct boot_img *boot);
+
+/* Compression, format is a file_t. Returns the output size or an error */
+
+long long boot_compress(int format, out_stream *out, const void *buf, size_t size);
+long long boot_decompress(int format, out_stream *out, const void *buf, size_t size);
+
+/* Device tree blobs */
+
+typedef struct dtb_table {
+	int qcdt;         // QCDT (dt.img) version, 0 for concatenated blobs
+	int num;
+	struct dtb_blob {
+		void *fdt;
+		uint32_t size;
+	} *blobs;
+} dtb_table;
+
+// Index the blobs of a dtb table by their totalsize, free with dtb_table_free
+int dtb_index(const void *buf, size_t size, dtb_table *table);
+void dtb_table_free(dtb_table *table);
+// The first valid blob in buf, used to find appended dtbs
+void *dtb_find(const void *buf, size_t size);
+
+/* Android sparse images */
+
+// Expand to an anonymous mapping of the whole image, free with munmap
+int sparse_expand(const void *buf, size_t size, void **out, size_t *out_size);
+// Runs of zero blocks become zero FILL chunks
+int sparse_build(out_stream *out, const void *buf, size_t size);
+
+/* Ramdisk cpio, a vector of struct cpio_entry */
+
+struct cpio_entry;
+
+int cpio_vec_parse(const void *buf, size_t size, struct vector *v);
+long long cpio_vec_dump(struct vector *v, out_stream *out, int dedup);
+void cpio_vec_destroy(struct vector *v);
+struct cpio_entry *cpio_vec_find(struct vector *v, const char *entry);
+int cpio_vec_insert(struct vector *v, struct cpio_entry *n);
+int cpio_vec_add(struct vector *v, mode_t mode, const char *entry, const void *data, size_t size);
+int cpio_vec_mkdir(struct vector *v, mode_t mode, const char *entry);
+int cpio_vec_rm(struct vector *v, const char *entry, int recursive);
+int cpio_vec_mv(struct vector *v, const char *from, const char *to);
+
+#endif
@@ -16,8 +16,10 @@
 #define LOGFILE         "/cache/magisk.log"
 #define LASTLOG         "/cache/last_magisk.log"
 #define DEBUG_LOG       "/data/magisk_debug.log"
+#define BOOTTRACE       "/data/magisk_boot.trace"
 #define UNBLOCKFILE     "/dev/.magisk.unblock"
 #define PATCHDONE       "/dev/.magisk.patch.done"
+#define STATUSPAGE      "/dev/.magisk.status"
 #define DISABLEFILE     "/cache/.disable_magisk"
 #define UNINSTALLER     "/cache/magisk_uninstaller.sh"
 #define CACHEMOUNT      "/cache/magisk_mount"
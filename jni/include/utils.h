@@ -90,6 +90,13 @@ void get_client_cred(int fd, struct ucred *cred);
 int switch_mnt_ns(int pid);
 int fork_dont_care();
 
+#define IOPRIO_WHO_PROCESS  1
+#define IOPRIO_CLASS_BE     2
+#define IOPRIO_CLASS_SHIFT  13
+#define IOPRIO_DEFAULT      4
+
+void set_priority(int nice, int io_level);
+
 // file.c
 
 extern char **excl_list;
@@ -119,6 +126,20 @@ void restorecon(int dirfd, int force);
 void mmap_ro(const char *filename, void **buf, size_t *size);
 void mmap_rw(const char *filename, void **buf, size_t *size);
 
+// memfind.c
+
+void *memfind(const void *buf, size_t size, const void *pattern, size_t len);
+/* Usage: memfind_for_each(void *p, void *buf, size_t size, void *pattern, size_t len)
+ * Iterate through all non-overlapping matches of pattern in buf */
+#define memfind_for_each(p, buf, size, pattern, len) \
+	for (p = memfind(buf, size, pattern, len); p; \
+		p = memfind((char *) p + (len), (char *) (buf) + (size) - ((char *) p + (len)), pattern, len))
+
+// wait.c
+
+int wait_for_path(const char *path, int mode, int timeout_ms);
+int wait_for_proc(int pid, int (*check)(int), int timeout_ms);
+
 // img.c
 
 #define round_size(a) ((((a) / 32) + 2) * 32)
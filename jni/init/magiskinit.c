@@ -152,15 +152,12 @@ static void *patch_init_rc(char *data, uint32_t *size) {
 }
 
 static void patch_ramdisk() {
-	void *addr;
+	void *addr, *p;
 	size_t size;
 	mmap_rw("/init", &addr, &size);
-	for (int i = 0; i < size; ++i) {
-		if (memcmp(addr + i, "/system/etc/selinux/plat_sepolicy.cil", 37) == 0) {
-			memcpy(addr + i, "/system/etc/selinux/plat_sepolicy.xxx", 37);
-			break;
-		}
-	}
+	p = memfind(addr, size, "/system/etc/selinux/plat_sepolicy.cil", 37);
+	if (p)
+		memcpy(p, "/system/etc/selinux/plat_sepolicy.xxx", 37);
 	munmap(addr, size);
 
 	mmap_rw("/init.rc", &addr, &size);
@@ -349,9 +346,8 @@ int main(int argc, char *argv[]) {
 		// Fork a new process for full patch
 		setsid();
 		sepol_allow("su", ALL, ALL, ALL);
-		while (access(SELINUX_LOAD, W_OK) == -1) {
-			usleep(500); /* Wait 0.5ms */
-		}
+		// Init mounts selinuxfs before loading the policy
+		wait_for_path(SELINUX_LOAD, W_OK, -1);
 		dump_policydb(SELINUX_LOAD);
 		close(open(PATCHDONE, O_RDONLY | O_CREAT, 0));
 		destroy_policydb();
@@ -0,0 +1,329 @@
+/* api.c - Boot image parsing and assembling for libmagiskboot
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "magiskboot.h"
+#include "sparse.h"
+#include "utils.h"
+#include "hash.h"
+
+int boot_parse(const void *buf, size_t size, boot_img *boot) {
+	void *base, *end;
+	size_t pos = 0;
+	int chromeos = 0;
+	memset(boot, 0, sizeof(*boot));
+	for(base = (void *) buf, end = (void *) buf + size; base < end; base += 256, size -= 256) {
+		switch (check_type(base)) {
+		case CHROMEOS:
+			// The caller should know it's chromeos, as it needs additional signing
+			chromeos = 1;
+			continue;
+		case ELF32:
+			return BOOT_EELF32;
+		case ELF64:
+			return BOOT_EELF64;
+		case AOSP:
+			if (size < sizeof(boot->hdr))
+				return BOOT_EFORMAT;
+			// Read the header
+			memcpy(&boot->hdr, base, sizeof(boot->hdr));
+			// The header has to fit in its page, boot_build pads it to one
+			if (boot->hdr.page_size < sizeof(boot->hdr) ||
+				(boot->hdr.page_size & (boot->hdr.page_size - 1)))
+				return BOOT_EFORMAT;
+			pos += boot->hdr.page_size;
+
+			boot->kernel = base + pos;
+			pos += boot->hdr.kernel_size;
+			mem_align(&pos, boot->hdr.page_size);
+
+			boot->ramdisk = base + pos;
+			pos += boot->hdr.ramdisk_size;
+			mem_align(&pos, boot->hdr.page_size);
+
+			if (boot->hdr.second_size) {
+				boot->second = base + pos;
+				pos += boot->hdr.second_size;
+				mem_align(&pos, boot->hdr.page_size);
+			}
+
+			if (boot->hdr.extra_size) {
+				boot->extra = base + pos;
+				pos += boot->hdr.extra_size;
+				mem_align(&pos, boot->hdr.page_size);
+			}
+
+			// Sections may not be padded at the end of the image
+			if (boot->extra ? boot->extra + boot->hdr.extra_size > end :
+				boot->second ? boot->second + boot->hdr.second_size > end :
+				boot->ramdisk + boot->hdr.ramdisk_size > end)
+				return BOOT_EFORMAT;
+
+			if (pos < size) {
+				boot->tail = base + pos;
+				boot->tail_size = end - base - pos;
+			}
+
+			// Search for appended dtb in kernel, skipping stray magic in the kernel
+			boot->dtb = dtb_find(boot->kernel, boot->hdr.kernel_size);
+			if (boot->dtb) {
+				uint32_t off = boot->dtb - boot->kernel;
+				boot->dt_size = boot->hdr.kernel_size - off;
+				boot->hdr.kernel_size = off;
+			}
+
+			boot->ramdisk_type = check_type(boot->ramdisk);
+			boot->kernel_type = check_type(boot->kernel);
+
+			// Check MTK
+			if (boot->kernel_type == MTK && boot->hdr.kernel_size >= 512) {
+				boot->flags |= MTK_KERNEL;
+				memcpy(&boot->mtk_kernel_hdr, boot->kernel, sizeof(mtk_hdr));
+				boot->kernel += 512;
+				boot->hdr.kernel_size -= 512;
+				boot->kernel_type = check_type(boot->kernel);
+			}
+			if (boot->ramdisk_type == MTK && boot->hdr.ramdisk_size >= 512) {
+				boot->flags |= MTK_RAMDISK;
+				memcpy(&boot->mtk_ramdisk_hdr, boot->ramdisk, sizeof(mtk_hdr));
+				boot->ramdisk += 512;
+				boot->hdr.ramdisk_size -= 512;
+				boot->ramdisk_type = check_type(boot->ramdisk);
+			}
+
+			if (chromeos)
+				boot->flags |= CHROMEOS_IMG;
+			return BOOT_OK;
+		default:
+			continue;
+		}
+	}
+	return BOOT_EFORMAT;
+}
+
+struct boot_image {
+	boot_img boot;
+	// Components replaced with boot_set
+	void *owned[BOOT_COMPONENT_NUM];
+	// Expanded sparse image the components point into
+	void *sparse;
+	size_t sparse_size;
+};
+
+int boot_open(const void *buf, size_t size, boot_image **img) {
+	boot_image *i = calloc(sizeof(*i), 1);
+	if (i == NULL)
+		return BOOT_ENOMEM;
+	int err = BOOT_OK;
+	if (size >= sizeof(sparse_header) && check_type(buf) == SPARSE) {
+		err = sparse_expand(buf, size, &i->sparse, &i->sparse_size);
+		buf = i->sparse;
+		size = i->sparse_size;
+	}
+	if (err == BOOT_OK)
+		err = boot_parse(buf, size, &i->boot);
+	if (err < 0) {
+		boot_close(i);
+		return err;
+	}
+	*img = i;
+	return BOOT_OK;
+}
+
+void boot_close(boot_image *img) {
+	if (img == NULL)
+		return;
+	for (int i = 0; i < BOOT_COMPONENT_NUM; ++i)
+		free(img->owned[i]);
+	if (img->sparse)
+		munmap(img->sparse, img->sparse_size);
+	free(img);
+}
+
+const boot_img_hdr *boot_header(boot_image *img) {
+	return &img->boot.hdr;
+}
+
+int boot_is_chromeos(boot_image *img) {
+	return (img->boot.flags & CHROMEOS_IMG) != 0;
+}
+
+// The header is packed, so sizes are accessed by value
+static int component(boot_img *boot, boot_component c, void ***data, uint32_t *size) {
+	switch (c) {
+	case BOOT_KERNEL:
+		*data = &boot->kernel;
+		*size = boot->hdr.kernel_size;
+		break;
+	case BOOT_RAMDISK:
+		*data = &boot->ramdisk;
+		*size = boot->hdr.ramdisk_size;
+		break;
+	case BOOT_SECOND:
+		*data = &boot->second;
+		*size = boot->hdr.second_size;
+		break;
+	case BOOT_DTB:
+		*data = &boot->dtb;
+		*size = boot->dt_size;
+		break;
+	case BOOT_EXTRA:
+		*data = &boot->extra;
+		*size = boot->hdr.extra_size;
+		break;
+	default:
+		return BOOT_EINVAL;
+	}
+	return BOOT_OK;
+}
+
+int boot_get(boot_image *img, boot_component c, const void **data, size_t *size) {
+	void **d;
+	uint32_t s;
+	if (component(&img->boot, c, &d, &s) < 0)
+		return BOOT_EINVAL;
+	if (s == 0)
+		return BOOT_ENOENT;
+	*data = *d;
+	*size = s;
+	return BOOT_OK;
+}
+
+int boot_set(boot_image *img, boot_component c, const void *data, size_t size) {
+	boot_img *boot = &img->boot;
+	void **d, *copy = NULL;
+	uint32_t s;
+	if (component(boot, c, &d, &s) < 0 || size > UINT32_MAX)
+		return BOOT_EINVAL;
+	if (size && (copy = malloc(size)) == NULL)
+		return BOOT_ENOMEM;
+	if (size)
+		memcpy(copy, data, size);
+	free(img->owned[c]);
+	img->owned[c] = copy;
+	*d = copy;
+	switch (c) {
+	case BOOT_KERNEL:
+		boot->hdr.kernel_size = size;
+		boot->kernel_type = size >= 16 ? check_type(copy) : UNKNOWN;
+		break;
+	case BOOT_RAMDISK:
+		boot->hdr.ramdisk_size = size;
+		boot->ramdisk_type = size >= 16 ? check_type(copy) : UNKNOWN;
+		break;
+	case BOOT_SECOND:
+		boot->hdr.second_size = size;
+		break;
+	case BOOT_DTB:
+		boot->dt_size = size;
+		break;
+	default:
+		boot->hdr.extra_size = size;
+		break;
+	}
+	return BOOT_OK;
+}
+
+int boot_format(boot_image *img, boot_component c) {
+	switch (c) {
+	case BOOT_KERNEL:
+		return img->boot.kernel_type;
+	case BOOT_RAMDISK:
+		return img->boot.ramdisk_type;
+	default:
+		return UNKNOWN;
+	}
+}
+
+typedef struct section {
+	const void *mtk;
+	const void *data[2];
+	uint32_t size[2];
+	uint32_t total;
+} section;
+
+static int write_zeros(out_stream *out, size_t size) {
+	static const char zeros[4096];
+	for (size_t len; size; size -= len) {
+		len = size < sizeof(zeros) ? size : sizeof(zeros);
+		int err = stream_write(out, zeros, len);
+		if (err < 0)
+			return err;
+	}
+	return BOOT_OK;
+}
+
+/* Used by repack as well: the sections are page aligned, and the id is
+ * the SHA1 of every section followed by its size, like mkbootimg.
+ * Fd streams have to be seekable, the header is rewritten at the end */
+int boot_build(boot_image *img, out_stream *out) {
+	boot_img *boot = &img->boot;
+	boot_img_hdr hdr = boot->hdr;
+	mtk_hdr mtk[2] = { boot->mtk_kernel_hdr, boot->mtk_ramdisk_hdr };
+	char mtk_buf[2][512];
+	section secs[4] = {
+		{ NULL, { boot->kernel, boot->dtb }, { boot->hdr.kernel_size, boot->dt_size } },
+		{ NULL, { boot->ramdisk }, { boot->hdr.ramdisk_size } },
+		{ NULL, { boot->second }, { boot->hdr.second_size } },
+		{ NULL, { boot->extra }, { boot->hdr.extra_size } },
+	};
+	size_t start = out->size;
+	int err;
+
+	for (int i = 0; i < 4; ++i)
+		secs[i].total = secs[i].size[0] + secs[i].size[1];
+	for (int i = 0; i < 2; ++i) {
+		if (!(boot->flags & (i ? MTK_RAMDISK : MTK_KERNEL)))
+			continue;
+		mtk[i].size = secs[i].total;
+		secs[i].total += 512;
+		memset(mtk_buf[i], 0, sizeof(mtk_buf[i]));
+		memcpy(mtk_buf[i], &mtk[i], sizeof(mtk[i]));
+		secs[i].mtk = mtk_buf[i];
+	}
+	hdr.kernel_size = secs[0].total;
+	hdr.ramdisk_size = secs[1].total;
+	hdr.second_size = secs[2].total;
+	hdr.extra_size = secs[3].total;
+
+	// The header is written again once the id is known
+	memset(hdr.id, 0, sizeof(hdr.id));
+	if ((err = stream_write(out, &hdr, sizeof(hdr))) < 0 ||
+		(err = write_zeros(out, hdr.page_size - sizeof(hdr))) < 0)
+		return err;
+
+	// Sections go through the sink, which computes the boot id in the same
+	// pass. Padding is written around it and stays out of the digest
+	hash_sink sink;
+	sink_init(&sink, out, HASH_SHA1);
+	for (int i = 0; i < 4; ++i) {
+		// mkbootimg only hashes the dt blob when there is one
+		if (i == 3 && secs[i].total == 0)
+			break;
+		if (secs[i].mtk && (err = sink_write(&sink, secs[i].mtk, 512)) < 0)
+			return err;
+		for (int j = 0; j < 2; ++j) {
+			if (secs[i].size[j] && (err = sink_write(&sink, secs[i].data[j], secs[i].size[j])) < 0)
+				return err;
+		}
+		hash_update(&sink.ctx, sink.type, &secs[i].total, sizeof(uint32_t));
+		size_t pos = out->size - start;
+		mem_align(&pos, hdr.page_size);
+		if ((err = write_zeros(out, pos - (out->size - start))) < 0)
+			return err;
+	}
+
+	// Keep the tail, currently only for LG Bump and Samsung SEANDROIDENFORCE
+	if (boot->tail_size >= 16 && (memcmp(boot->tail, "SEANDROIDENFORCE", 16) == 0 ||
+								  memcmp(boot->tail, LG_BUMP_MAGIC, 16) == 0) &&
+		(err = stream_write(out, boot->tail, 16)) < 0)
+		return err;
+
+	unsigned char id[SHA1_DIGEST_SIZE];
+	sink_final(&sink, id);
+	memcpy(hdr.id, id, sizeof(id));
+	return stream_patch(out, start, &hdr, sizeof(hdr));
+}
@@ -0,0 +1,109 @@
+/* batch.c - Patch many boot images concurrently
+ *
+ * Each job only works with the paths in its manifest line, nothing depends
+ * on the current directory, so all jobs can share one process.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+
+#include "magiskboot.h"
+#include "utils.h"
+
+#define MAX_ARGS 64
+
+typedef struct batch_job {
+	char *line;
+	char *image;
+	char out[PATH_MAX];
+	patch_opts opts;
+	patch_result res;
+	int ret;
+} batch_job;
+
+static const char *batch_result(int ret) {
+	switch (ret) {
+	case 0:
+		return "OK";
+	case PATCH_CHROMEOS:
+		return "OK, needs ChromeOS signing";
+	case PATCH_ELF32:
+		return "Sony ELF32 image";
+	case PATCH_ELF64:
+		return "Sony ELF64 image";
+	case PATCH_OTHER:
+		return "Patched by other programs";
+	case PATCH_NORESTORE:
+		return "Cannot restore ramdisk";
+	default:
+		return "Failed";
+	}
+}
+
+static void batch_patch(void *arg) {
+	batch_job *job = arg;
+	job->ret = patch_boot(job->image, job->out, &job->opts, &job->res);
+}
+
+/* Split a manifest line in place, returns the number of arguments */
+static int split_line(char *line, char *argv[]) {
+	int argc = 0;
+	for (char *tok = strtok(line, " \t\r\n"); tok; tok = strtok(NULL, " \t\r\n")) {
+		if (argc == MAX_ARGS)
+			return -1;
+		argv[argc++] = tok;
+	}
+	return argc;
+}
+
+void batch(const char *manifest) {
+	char buf[PATH_MAX * 4], *argv[MAX_ARGS];
+	batch_job *jobs = NULL;
+	int num = 0, lineno = 0, failed = 0;
+
+	FILE *fp = xfopen(manifest, "r");
+	while (fgets(buf, sizeof(buf), fp)) {
+		++lineno;
+		char *p = buf;
+		while (isspace(*p)) ++p;
+		if (*p == '\0' || *p == '#')
+			continue;
+		jobs = xrealloc(jobs, (num + 1) * sizeof(*jobs));
+		batch_job *job = &jobs[num++];
+		memset(job, 0, sizeof(*job));
+		job->line = strdup(p);
+		int argc = split_line(job->line, argv);
+		if (argc < 0)
+			LOGE("Too many arguments in manifest line %d\n", lineno);
+		if (argc < 2)
+			LOGE("Invalid manifest line %d: <bootimg> <outdir> [options...]\n", lineno);
+		if (patch_parse_opts(argc - 2, argv + 2, &job->opts))
+			LOGE("Invalid options in manifest line %d\n", lineno);
+		job->image = argv[0];
+		if (mkdir_p(argv[1], 0755))
+			LOGE("Cannot create [%s]\n", argv[1]);
+		snprintf(job->out, sizeof(job->out), "%s/" NEW_BOOT, argv[1]);
+	}
+	fclose(fp);
+
+	fprintf(stderr, "Patching [%d] boot images\n\n", num);
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	parallel_for(jobs, sizeof(*jobs), num, batch_patch);
+
+	fprintf(stderr, "\n");
+	for (int i = 0; i < num; ++i) {
+		batch_job *job = &jobs[i];
+		if (job->ret != 0 && job->ret != PATCH_CHROMEOS)
+			++failed;
+		fprintf(stderr, "BATCH [%s] [%s] [%s] [%.1f ms]\n", job->image, job->res.status,
+				batch_result(job->ret), job->res.time);
+		free(job->opts.adds);
+		free(job->line);
+	}
+	fprintf(stderr, "BATCH_TOTAL [%d/%d] [%.1f ms]\n", num - failed, num, elapsed_ms(&start));
+	free(jobs);
+	exit(failed != 0);
+}
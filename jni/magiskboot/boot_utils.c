@@ -1,13 +1,10 @@
 #include <unistd.h>
 #include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
 
-#include "utils.h"
-
-void write_zero(int fd, size_t size) {
-	size_t pos = lseek(fd, 0, SEEK_CUR);
-	ftruncate(fd, pos + size);
-	lseek(fd, pos + size, SEEK_SET);
-}
+#include "magiskboot.h"
 
 void mem_align(size_t *pos, size_t align) {
 	size_t mask = align - 1;
@@ -16,24 +13,6 @@ void mem_align(size_t *pos, size_t align) {
 	}
 }
 
-void file_align(int fd, size_t align, int out) {
-	size_t pos = lseek(fd, 0, SEEK_CUR);
-	size_t mask = align - 1;
-	size_t off;
-	if (pos & mask) {
-		off = align - (pos & mask);
-		if (out) {
-			write_zero(fd, off);
-		} else {
-			lseek(fd, pos + off, SEEK_SET);
-		}
-	}
-}
-
-int open_new(const char *filename) {
-	return xopen(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-}
-
 int check_verity_pattern(const char *s) {
 	int pos = 0;
 	if (s[0] == ',') ++pos;
@@ -54,3 +33,46 @@ int check_encryption_pattern(const char *s) {
 	}
 	return -1;
 }
+
+struct parallel_ctx {
+	char *jobs;
+	size_t job_size;
+	int num;
+	int next;
+	void (*func)(void *);
+};
+
+static void *parallel_worker(void *arg) {
+	struct parallel_ctx *ctx = arg;
+	int i;
+	while ((i = __atomic_fetch_add(&ctx->next, 1, __ATOMIC_RELAXED)) < ctx->num)
+		ctx->func(ctx->jobs + i * ctx->job_size);
+	return NULL;
+}
+
+/* Run func on each of the num jobs (an array of job_size elements) with
+ * at most one thread per online CPU, and return when all jobs are done */
+void parallel_for(void *jobs, size_t job_size, int num, void (*func)(void *)) {
+	struct parallel_ctx ctx = {
+		.jobs = jobs, .job_size = job_size, .num = num, .next = 0, .func = func
+	};
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int nthreads = cpus < num ? cpus : num;
+	if (nthreads < 1)
+		nthreads = 1;
+	// The calling thread is one of the workers, and does all of the jobs
+	// if no other thread can be created
+	pthread_t threads[nthreads];
+	int started = 1;
+	while (started < nthreads && pthread_create(&threads[started], NULL, parallel_worker, &ctx) == 0)
+		++started;
+	parallel_worker(&ctx);
+	for (int i = 1; i < started; ++i)
+		pthread_join(threads[i], NULL);
+}
+
+double elapsed_ms(const struct timespec *start) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000.0 + (now.tv_nsec - start->tv_nsec) / 1000000.0;
+}
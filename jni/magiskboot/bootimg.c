@@ -1,11 +1,18 @@
 #include <stdlib.h>
 #include <unistd.h>
+#include <time.h>
 #include <sys/mman.h>
 
 #include "bootimg.h"
 #include "magiskboot.h"
 #include "utils.h"
 #include "logging.h"
+#include "hash.h"
+#include "sparse.h"
+
+int open_new(const char *filename) {
+	return xopen(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+}
 
 static void dump(void *buf, size_t size, const char *filename) {
 	int fd = open_new(filename);
@@ -13,17 +20,77 @@ static void dump(void *buf, size_t size, const char *filename) {
 	close(fd);
 }
 
-static size_t restore(const char *filename, int fd) {
-	int ifd = xopen(filename, O_RDONLY);
-	size_t size = lseek(ifd, 0, SEEK_END);
-	lseek(ifd, 0, SEEK_SET);
-	xsendfile(fd, ifd, NULL, size);
-	close(ifd);
-	return size;
+static size_t fd_size(int fd) {
+	return lseek(fd, 0, SEEK_END);
 }
 
-static void restore_buf(int fd, const void *buf, size_t size) {
-	xwrite(fd, buf, size);
+/* Create an anonymous temporary file in the current directory */
+static int tmp_file() {
+	char path[] = "magiskboot-XXXXXX";
+	int fd = mkstemp(path);
+	if (fd < 0)
+		PLOGE("mkstemp");
+	unlink(path);
+	return fd;
+}
+
+static void sha1_hex(const void *buf, size_t size, char *hex) {
+	unsigned char digest[SHA1_DIGEST_SIZE];
+	hash_buf(buf, size, HASH_SHA1, digest);
+	for (int i = 0; i < SHA1_DIGEST_SIZE; ++i)
+		sprintf(hex + i * 2, "%02x", digest[i]);
+}
+
+/* The manifest records the SHA1 of each decompressed component together with
+ * the SHA1 of the compressed data it came from, one line per component:
+ * <filename> <raw sha1> <compressed sha1> */
+static void manifest_entry(char *entry, const char *filename, const void *comp, size_t comp_size) {
+	char raw_sha1[41], comp_sha1[41];
+	void *raw;
+	size_t raw_size;
+	mmap_ro(filename, &raw, &raw_size);
+	sha1_hex(raw, raw_size, raw_sha1);
+	munmap(raw, raw_size);
+	sha1_hex(comp, comp_size, comp_sha1);
+	sprintf(entry, "%s %s %s\n", filename, raw_sha1, comp_sha1);
+}
+
+/* Return 1 if raw is what was decompressed from comp during unpack */
+static int manifest_match(const char *filename, const void *raw, size_t raw_size,
+						  const void *comp, size_t comp_size) {
+	char name[PATH_MAX], raw_sha1[41], comp_sha1[41], sha1[41];
+	int match = 0;
+	FILE *fp = fopen(MANIFEST_FILE, "r");
+	if (fp == NULL)
+		return 0;
+	while (fscanf(fp, "%255s %40s %40s", name, raw_sha1, comp_sha1) == 3) {
+		if (strcmp(name, filename) != 0)
+			continue;
+		sha1_hex(comp, comp_size, sha1);
+		if (strcmp(sha1, comp_sha1) != 0)
+			break;
+		sha1_hex(raw, raw_size, sha1);
+		match = strcmp(sha1, raw_sha1) == 0;
+		break;
+	}
+	fclose(fp);
+	return match;
+}
+
+/* Compress raw file to fd, or copy the original compressed data if unchanged */
+static size_t compress_or_reuse(file_t type, int fd, const char *filename,
+								const void *orig, size_t orig_size) {
+	size_t raw_size, size;
+	void *raw;
+	mmap_ro(filename, &raw, &raw_size);
+	if (manifest_match(filename, raw, raw_size, orig, orig_size)) {
+		fprintf(stderr, "Reuse unmodified [%s]\n", filename);
+		size = xwrite(fd, orig, orig_size);
+	} else {
+		size = comp(type, fd, raw, raw_size);
+	}
+	munmap(raw, raw_size);
+	return size;
 }
 
 static void print_hdr(const boot_img_hdr *hdr) {
@@ -49,266 +116,382 @@ static void print_hdr(const boot_img_hdr *hdr) {
 	}
 	fprintf(stderr, "NAME [%s]\n", hdr->name);
 	fprintf(stderr, "CMDLINE [%s]\n", hdr->cmdline);
+	fprintf(stderr, "ID [");
+	for (int i = 0; i < SHA1_DIGEST_SIZE; ++i)
+		fprintf(stderr, "%02x", ((const uint8_t *) hdr->id)[i]);
+	fprintf(stderr, "]\n");
 	fprintf(stderr, "\n");
 }
 
 int parse_img(void *orig, size_t size, boot_img *boot) {
-	void *base, *end;
-	size_t pos = 0;
-	int ret = 0;
-	memset(boot, 0, sizeof(*boot));
-	for(base = orig, end = orig + size; base < end; base += 256, size -= 256) {
-		switch (check_type(base)) {
-		case CHROMEOS:
-			// The caller should know it's chromeos, as it needs additional signing
-			ret = 2;
-			continue;
-		case ELF32:
-			exit(3);
-		case ELF64:
-			exit(4);
-		case AOSP:
-			// Read the header
-			memcpy(&boot->hdr, base, sizeof(boot->hdr));
-			pos += boot->hdr.page_size;
-
-			print_hdr(&boot->hdr);
-
-			boot->kernel = base + pos;
-			pos += boot->hdr.kernel_size;
-			mem_align(&pos, boot->hdr.page_size);
-
-			boot->ramdisk = base + pos;
-			pos += boot->hdr.ramdisk_size;
-			mem_align(&pos, boot->hdr.page_size);
-
-			if (boot->hdr.second_size) {
-				boot->second = base + pos;
-				pos += boot->hdr.second_size;
-				mem_align(&pos, boot->hdr.page_size);
-			}
-
-			if (boot->hdr.extra_size) {
-				boot->extra = base + pos;
-				pos += boot->hdr.extra_size;
-				mem_align(&pos, boot->hdr.page_size);
-			}
+	switch (boot_parse(orig, size, boot)) {
+	case BOOT_OK:
+		break;
+	case BOOT_EELF32:
+		exit(3);
+	case BOOT_EELF64:
+		exit(4);
+	default:
+		LOGE("No boot image magic found!\n");
+		return 1;
+	}
 
-			if (pos < size) {
-				boot->tail = base + pos;
-				boot->tail_size = end - base - pos;
-			}
+	print_hdr(&boot->hdr);
+	if (boot->dtb) {
+		dtb_table table;
+		fprintf(stderr, "DTB [%d]\n", boot->dt_size);
+		if (dtb_index(boot->dtb, boot->dt_size, &table) == 0) {
+			fprintf(stderr, "DTB_NUM [%d]\n", table.num);
+			dtb_table_free(&table);
+		}
+	}
+	if (boot->flags & MTK_KERNEL)
+		fprintf(stderr, "MTK_KERNEL_HDR [512]\n");
+	if (boot->flags & MTK_RAMDISK)
+		fprintf(stderr, "MTK_RAMDISK_HDR [512]\n");
 
-			// Search for dtb in kernel
-			for (int i = 0; i < boot->hdr.kernel_size; ++i) {
-				if (memcmp(boot->kernel + i, DTB_MAGIC, 4) == 0) {
-					boot->dtb = boot->kernel + i;
-					boot->dt_size = boot->hdr.kernel_size - i;
-					boot->hdr.kernel_size = i;
-					fprintf(stderr, "DTB [%d]\n", boot->dt_size);
-				}
-			}
+	char fmt[16];
 
-			boot->ramdisk_type = check_type(boot->ramdisk);
-			boot->kernel_type = check_type(boot->kernel);
-
-			// Check MTK
-			if (boot->kernel_type == MTK) {
-				fprintf(stderr, "MTK_KERNEL_HDR [512]\n");
-				boot->flags |= MTK_KERNEL;
-				memcpy(&boot->mtk_kernel_hdr, boot->kernel, sizeof(mtk_hdr));
-				boot->kernel += 512;
-				boot->hdr.kernel_size -= 512;
-				boot->kernel_type = check_type(boot->kernel);
-			}
-			if (boot->ramdisk_type == MTK) {
-				fprintf(stderr, "MTK_RAMDISK_HDR [512]\n");
-				boot->flags |= MTK_RAMDISK;
-				memcpy(&boot->mtk_ramdisk_hdr, boot->ramdisk, sizeof(mtk_hdr));
-				boot->ramdisk += 512;
-				boot->hdr.ramdisk_size -= 512;
-				boot->ramdisk_type = check_type(boot->ramdisk + 512);
-			}
+	get_type_name(boot->kernel_type, fmt);
+	fprintf(stderr, "KERNEL_FMT [%s]\n", fmt);
+	get_type_name(boot->ramdisk_type, fmt);
+	fprintf(stderr, "RAMDISK_FMT [%s]\n", fmt);
+	fprintf(stderr, "\n");
 
-			char fmt[16];
+	// The caller should know it's chromeos, as it needs additional signing
+	return (boot->flags & CHROMEOS_IMG) ? 2 : 0;
+}
 
-			get_type_name(boot->kernel_type, fmt);
-			fprintf(stderr, "KERNEL_FMT [%s]\n", fmt);
-			get_type_name(boot->ramdisk_type, fmt);
-			fprintf(stderr, "RAMDISK_FMT [%s]\n", fmt);
-			fprintf(stderr, "\n");
+typedef struct unpack_job {
+	const char *filename;
+	file_t type;
+	void *buf;
+	size_t size;
+	double time;
+	char manifest[128];
+} unpack_job;
+
+static void unpack_component(void *arg) {
+	unpack_job *job = arg;
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (COMPRESSED(job->type)) {
+		cache_decomp(job->type, job->buf, job->size, job->filename);
+		manifest_entry(job->manifest, job->filename, job->buf, job->size);
+	} else {
+		dump(job->buf, job->size, job->filename);
+	}
+	job->time = elapsed_ms(&start);
+}
 
-			return ret;
-		default:
-			continue;
+/* A partial unpack keeps the entries of components it did not extract,
+ * stale ones are harmless as manifest_match also checks the compressed data */
+static void write_manifest(unpack_job *jobs, int num, int partial) {
+	char line[PATH_MAX + 128], name[PATH_MAX];
+	struct vector keep;
+	vec_init(&keep);
+	FILE *fp = partial ? fopen(MANIFEST_FILE, "r") : NULL;
+	if (fp) {
+		while (fgets(line, sizeof(line), fp)) {
+			int extracted = sscanf(line, "%255s", name) != 1;
+			for (int i = 0; i < num && !extracted; ++i)
+				extracted = strcmp(name, jobs[i].filename) == 0;
+			if (!extracted)
+				vec_push_back(&keep, strdup(line));
 		}
+		fclose(fp);
+	}
+	fp = xfopen(MANIFEST_FILE, "w");
+	char *entry;
+	vec_for_each(&keep, entry)
+		fputs(entry, fp);
+	for (int i = 0; i < num; ++i)
+		fputs(jobs[i].manifest, fp);
+	fclose(fp);
+	vec_deep_destroy(&keep);
+}
+
+/* Map an image, sparse images are expanded. Either way the result is
+ * freed with munmap */
+int map_image(const char *image, void **buf, size_t *size) {
+	void *file;
+	size_t file_size;
+	mmap_ro(image, &file, &file_size);
+	if (file_size < sizeof(sparse_header) || check_type(file) != SPARSE) {
+		*buf = file;
+		*size = file_size;
+		return BOOT_OK;
 	}
-	LOGE("No boot image magic found!\n");
-	return 1;
+	fprintf(stderr, "Expanding sparse image: [%s]\n", image);
+	int err = sparse_expand(file, file_size, buf, size);
+	munmap(file, file_size);
+	return err;
 }
 
-void unpack(const char* image) {
+void load_image(const char *image, void **buf, size_t *size) {
+	int err = map_image(image, buf, size);
+	if (err < 0)
+		LOGE("Cannot expand [%s]: %s\n", image, boot_strerror(err));
+}
+
+/* Rewrite file as a sparse image */
+static void sparse_file(const char *file) {
+	void *buf;
+	size_t size;
+	out_stream out;
+	mmap_ro(file, &buf, &size);
+	// The mapping keeps the data after the name is gone
+	unlink(file);
+	int fd = open_new(file);
+	fd_stream(&out, fd);
+	int err = sparse_build(&out, buf, size);
+	if (err < 0)
+		LOGE("Cannot write sparse image [%s]: %s\n", file, boot_strerror(err));
+	close(fd);
+	munmap(buf, size);
+}
+
+void unpack(const char* image, unsigned only) {
 	size_t size;
 	void *orig;
-	mmap_ro(image, &orig, &size);
-	int fd;
+	load_image(image, &orig, &size);
 	boot_img boot;
+	unpack_job jobs[5];
+	int num = 0;
 
 	// Parse image
 	fprintf(stderr, "Parsing boot image: [%s]\n\n", image);
 	int ret = parse_img(orig, size, &boot);
 
-	// Dump kernel
-	if (COMPRESSED(boot.kernel_type)) {
-		fd = open_new(KERNEL_FILE);
-		decomp(boot.kernel_type, fd, boot.kernel, boot.hdr.kernel_size);
-		close(fd);
-	} else {
-		dump(boot.kernel, boot.hdr.kernel_size, KERNEL_FILE);
+	memset(jobs, 0, sizeof(jobs));
+	if (only == 0)
+		only = UNPACK_ALL;
+
+	if (only & UNPACK_KERNEL) {
+		// Dump kernel
+		jobs[num++] = (unpack_job) { KERNEL_FILE, boot.kernel_type, boot.kernel, boot.hdr.kernel_size };
 	}
 
-	if (boot.dt_size) {
+	if (boot.dt_size && (only & UNPACK_DTB)) {
 		// Dump dtb
-		dump(boot.dtb, boot.dt_size, DTB_FILE);
+		jobs[num++] = (unpack_job) { DTB_FILE, UNKNOWN, boot.dtb, boot.dt_size };
 	}
 
-	// Dump ramdisk
-	if (COMPRESSED(boot.ramdisk_type)) {
-		fd = open_new(RAMDISK_FILE);
-		decomp(boot.ramdisk_type, fd, boot.ramdisk, boot.hdr.ramdisk_size);
-		close(fd);
-	} else {
-		dump(boot.ramdisk, boot.hdr.ramdisk_size, RAMDISK_FILE ".raw");
-		LOGE("Unknown ramdisk format! Dumped to %s\n", RAMDISK_FILE ".raw");
+	if (only & UNPACK_RAMDISK) {
+		// Dump ramdisk, raw if the format is unknown
+		jobs[num++] = (unpack_job) { COMPRESSED(boot.ramdisk_type) ? RAMDISK_FILE : RAMDISK_FILE ".raw",
+			boot.ramdisk_type, boot.ramdisk, boot.hdr.ramdisk_size };
 	}
 
-	if (boot.hdr.second_size) {
+	if (boot.hdr.second_size && (only & UNPACK_SECOND)) {
 		// Dump second
-		dump(boot.second, boot.hdr.second_size, SECOND_FILE);
+		jobs[num++] = (unpack_job) { SECOND_FILE, UNKNOWN, boot.second, boot.hdr.second_size };
 	}
 
-	if (boot.hdr.extra_size) {
+	if (boot.hdr.extra_size && (only & UNPACK_EXTRA)) {
 		// Dump extra
-		dump(boot.extra, boot.hdr.extra_size, EXTRA_FILE);
+		jobs[num++] = (unpack_job) { EXTRA_FILE, UNKNOWN, boot.extra, boot.hdr.extra_size };
 	}
 
+	// All components are independent regions of the image, process them concurrently
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	parallel_for(jobs, sizeof(*jobs), num, unpack_component);
+
+	for (int i = 0; i < num; ++i)
+		fprintf(stderr, "UNPACK [%s] [%.1f ms]\n", jobs[i].filename, jobs[i].time);
+	fprintf(stderr, "UNPACK_TOTAL [%.1f ms]\n", elapsed_ms(&start));
+	cache_report();
+	fprintf(stderr, "\n");
+	write_manifest(jobs, num, only != UNPACK_ALL);
+
+	if ((only & UNPACK_RAMDISK) && !COMPRESSED(boot.ramdisk_type))
+		LOGE("Unknown ramdisk format! Dumped to %s\n", RAMDISK_FILE ".raw");
+
 	munmap(orig, size);
 	exit(ret);
 }
 
-void repack(const char* orig_image, const char* out_image) {
+static void json_str(const char *key, const void *str, size_t max) {
+	const unsigned char *c = str;
+	printf("\"%s\": \"", key);
+	for (size_t i = 0; i < max && c[i]; ++i) {
+		if (c[i] == '"' || c[i] == '\\')
+			printf("\\%c", c[i]);
+		else if (c[i] < 0x20 || c[i] >= 0x7f)
+			printf("\\u%04x", c[i]);
+		else
+			putchar(c[i]);
+	}
+	printf("\"");
+}
+
+static void json_section(const char *key, uint32_t size, uint32_t addr, file_t type, int mtk) {
+	char fmt[16];
+	get_type_name(type, fmt);
+	printf("  \"%s\": { \"size\": %u, \"addr\": \"0x%08x\", \"format\": \"%s\", \"mtk\": %s },\n",
+		   key, size, addr, fmt, mtk ? "true" : "false");
+}
+
+/* Print the header and component formats as JSON to stdout without
+ * decompressing anything, exits with the same code as --unpack */
+void boot_info(const char *image) {
 	size_t size;
 	void *orig;
 	boot_img boot;
+	load_image(image, &orig, &size);
 
-	// There are possible two MTK headers
-	size_t mtk_kernel_off, mtk_ramdisk_off;
+	fprintf(stderr, "Parsing boot image: [%s]\n\n", image);
+	int ret = parse_img(orig, size, &boot);
+	const boot_img_hdr *hdr = &boot.hdr;
+
+	printf("{\n");
+	printf("  \"chromeos\": %s,\n", ret == 2 ? "true" : "false");
+	printf("  \"page_size\": %u,\n", hdr->page_size);
+	printf("  ");
+	json_str("name", hdr->name, sizeof(hdr->name));
+	printf(",\n  ");
+	json_str("cmdline", hdr->cmdline, sizeof(hdr->cmdline));
+	printf(",\n");
+	if (hdr->os_version) {
+		int os_version = hdr->os_version >> 11, os_patch_level = hdr->os_version & 0x7ff;
+		printf("  \"os_version\": \"%d.%d.%d\",\n", (os_version >> 14) & 0x7f,
+			   (os_version >> 7) & 0x7f, os_version & 0x7f);
+		printf("  \"patch_level\": \"%d-%02d\",\n", (os_patch_level >> 4) + 2000, os_patch_level & 0xf);
+	}
+	printf("  \"id\": \"");
+	for (int i = 0; i < SHA1_DIGEST_SIZE; ++i)
+		printf("%02x", ((const uint8_t *) hdr->id)[i]);
+	printf("\",\n");
+	json_section("kernel", hdr->kernel_size, hdr->kernel_addr, boot.kernel_type, boot.flags & MTK_KERNEL);
+	json_section("ramdisk", hdr->ramdisk_size, hdr->ramdisk_addr, boot.ramdisk_type, boot.flags & MTK_RAMDISK);
+	json_section("second", hdr->second_size, hdr->second_addr, UNKNOWN, 0);
+	json_section("extra", hdr->extra_size, hdr->tags_addr, UNKNOWN, 0);
+	printf("  \"dtb\": { \"size\": %u },\n", boot.dt_size);
+	printf("  ");
+	json_str("tail", boot.tail, boot.tail_size < 16 ? boot.tail_size : 16);
+	printf("\n}\n");
+
+	munmap(orig, size);
+	exit(ret);
+}
+
+typedef struct repack_job {
+	const char *filename;
+	file_t type;
+	const void *orig;
+	size_t orig_size;
+	int fd;
+	double time;
+} repack_job;
+
+static void repack_component(void *arg) {
+	repack_job *job = arg;
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	job->fd = tmp_file();
+	compress_or_reuse(job->type, job->fd, job->filename, job->orig, job->orig_size);
+	job->time = elapsed_ms(&start);
+}
+
+/* Replace component c of img with the content of fd, which is closed */
+static void set_component(boot_image *img, boot_component c, int fd) {
+	size_t size = fd_size(fd);
+	void *buf = size ? xmmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0) : NULL;
+	int err = boot_set(img, c, buf, size);
+	if (size)
+		munmap(buf, size);
+	close(fd);
+	if (err < 0)
+		LOGE("Cannot repack: %s\n", boot_strerror(err));
+}
+
+void repack(const char* orig_image, const char* out_image, int sparse) {
+	size_t size;
+	void *orig;
+	boot_img boot;
+	repack_job jobs[2];
+	int num = 0;
+	repack_job *kernel_job = NULL, *ramdisk_job = NULL;
+	char ramdisk_name[PATH_MAX];
 
 	// Load original image
-	mmap_ro(orig_image, &orig, &size);
+	load_image(orig_image, &orig, &size);
 
 	// Parse original image
 	fprintf(stderr, "Parsing boot image: [%s]\n\n", orig_image);
 	parse_img(orig, size, &boot);
 
-	fprintf(stderr, "Repack to boot image: [%s]\n\n", out_image);
-
-	// Create new image
-	int fd = open_new(out_image);
-
-	// Skip a page for header
-	write_zero(fd, boot.hdr.page_size);
-
-	if (boot.flags & MTK_KERNEL) {
-		// Record position and skip MTK header
-		mtk_kernel_off = lseek(fd, 0, SEEK_CUR);
-		write_zero(fd, 512);
-	}
 	if (COMPRESSED(boot.kernel_type)) {
-		size_t raw_size;
-		void *kernel_raw;
-		mmap_ro(KERNEL_FILE, &kernel_raw, &raw_size);
-		boot.hdr.kernel_size = comp(boot.kernel_type, fd, kernel_raw, raw_size);
-		munmap(kernel_raw, raw_size);
-	} else {
-		boot.hdr.kernel_size = restore(KERNEL_FILE, fd);
-	}
-	// Restore dtb
-	if (boot.dt_size && access(DTB_FILE, R_OK) == 0) {
-		boot.hdr.kernel_size += restore(DTB_FILE, fd);
-	}
-	file_align(fd, boot.hdr.page_size, 1);
-
-	if (boot.flags & MTK_RAMDISK) {
-		// Record position and skip MTK header
-		mtk_ramdisk_off = lseek(fd, 0, SEEK_CUR);
-		write_zero(fd, 512);
+		kernel_job = &jobs[num++];
+		*kernel_job = (repack_job) { KERNEL_FILE, boot.kernel_type, boot.kernel, boot.hdr.kernel_size };
 	}
 	if (access(RAMDISK_FILE, R_OK) == 0) {
 		// If we found raw cpio, compress to original format
-		size_t cpio_size;
-		void *cpio;
-		mmap_ro(RAMDISK_FILE, &cpio, &cpio_size);
-		boot.hdr.ramdisk_size = comp(boot.ramdisk_type, fd, cpio, cpio_size);
-		munmap(cpio, cpio_size);
+		ramdisk_job = &jobs[num++];
+		*ramdisk_job = (repack_job) { RAMDISK_FILE, boot.ramdisk_type, boot.ramdisk, boot.hdr.ramdisk_size };
 	} else {
 		// Find compressed ramdisk
-		char name[PATH_MAX];
 		int found = 0;
 		for (int i = 0; SUP_EXT_LIST[i]; ++i) {
-			sprintf(name, "%s.%s", RAMDISK_FILE, SUP_EXT_LIST[i]);
-			if (access(name, R_OK) == 0) {
+			sprintf(ramdisk_name, "%s.%s", RAMDISK_FILE, SUP_EXT_LIST[i]);
+			if (access(ramdisk_name, R_OK) == 0) {
 				found = 1;
 				break;
 			}
 		}
 		if (!found)
 			LOGE("No ramdisk exists!\n");
-		boot.hdr.ramdisk_size = restore(name, fd);
 	}
-	file_align(fd, boot.hdr.page_size, 1);
 
-	// Restore second
-	if (boot.hdr.second_size && access(SECOND_FILE, R_OK) == 0) {
-		boot.hdr.second_size = restore(SECOND_FILE, fd);
-		file_align(fd, boot.hdr.page_size, 1);
-	}
-
-	// Restore extra
-	if (boot.hdr.extra_size && access(EXTRA_FILE, R_OK) == 0) {
-		boot.hdr.extra_size = restore(EXTRA_FILE, fd);
-		file_align(fd, boot.hdr.page_size, 1);
-	}
+	// Compress kernel and ramdisk concurrently into temporary files
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	parallel_for(jobs, sizeof(*jobs), num, repack_component);
+	for (int i = 0; i < num; ++i)
+		fprintf(stderr, "REPACK [%s] [%.1f ms]\n", jobs[i].filename, jobs[i].time);
+	fprintf(stderr, "REPACK_TOTAL [%.1f ms]\n\n", elapsed_ms(&start));
 
-	// Check tail info, currently only for LG Bump and Samsung SEANDROIDENFORCE
-	if (boot.tail_size >= 16) {
-		if (memcmp(boot.tail, "SEANDROIDENFORCE", 16) == 0 ||
-			memcmp(boot.tail, LG_BUMP_MAGIC, 16) == 0 ) {
-			restore_buf(fd, boot.tail, 16);
-		}
-	}
+	fprintf(stderr, "Repack to boot image: [%s]\n\n", out_image);
 
-	// Write MTK headers back
-	if (boot.flags & MTK_KERNEL) {
-		lseek(fd, mtk_kernel_off, SEEK_SET);
-		boot.mtk_kernel_hdr.size = boot.hdr.kernel_size;
-		boot.hdr.kernel_size += 512;
-		restore_buf(fd, &boot.mtk_kernel_hdr, sizeof(mtk_hdr));
-	}
-	if (boot.flags & MTK_RAMDISK) {
-		lseek(fd, mtk_ramdisk_off, SEEK_SET);
-		boot.mtk_ramdisk_hdr.size = boot.hdr.ramdisk_size;
-		boot.hdr.ramdisk_size += 512;
-		restore_buf(fd, &boot.mtk_ramdisk_hdr, sizeof(mtk_hdr));
+	// Replace the components with the new files, boot_build does the layout
+	boot_image *img;
+	int err = boot_open(orig, size, &img);
+	if (err < 0)
+		LOGE("Cannot parse [%s]: %s\n", orig_image, boot_strerror(err));
+	set_component(img, BOOT_KERNEL, kernel_job ? kernel_job->fd : xopen(KERNEL_FILE, O_RDONLY));
+	if (boot.dt_size) {
+		if (access(DTB_FILE, R_OK) == 0)
+			set_component(img, BOOT_DTB, xopen(DTB_FILE, O_RDONLY));
+		else
+			boot_set(img, BOOT_DTB, NULL, 0);
 	}
-	// Main header
-	lseek(fd, 0, SEEK_SET);
-	restore_buf(fd, &boot.hdr, sizeof(boot.hdr));
+	set_component(img, BOOT_RAMDISK, ramdisk_job ? ramdisk_job->fd : xopen(ramdisk_name, O_RDONLY));
+	if (boot.hdr.second_size && access(SECOND_FILE, R_OK) == 0)
+		set_component(img, BOOT_SECOND, xopen(SECOND_FILE, O_RDONLY));
+	if (boot.hdr.extra_size && access(EXTRA_FILE, R_OK) == 0)
+		set_component(img, BOOT_EXTRA, xopen(EXTRA_FILE, O_RDONLY));
+
+	// Read back for the new header, which boot_build fills in
+	out_stream out;
+	int fd = xopen(out_image, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	fd_stream(&out, fd);
+	if ((err = boot_build(img, &out)) < 0)
+		LOGE("Cannot write [%s]: %s\n", out_image, boot_strerror(err));
+	boot_close(img);
 
 	// Print new image info
-	print_hdr(&boot.hdr);
+	boot_img_hdr hdr;
+	lseek(fd, 0, SEEK_SET);
+	xxread(fd, &hdr, sizeof(hdr));
+	print_hdr(&hdr);
 
 	munmap(orig, size);
 	close(fd);
+
+	if (sparse) {
+		fprintf(stderr, "\nWrite sparse image: [%s]\n", out_image);
+		sparse_file(out_image);
+	}
 }
 
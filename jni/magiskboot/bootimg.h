@@ -103,6 +103,7 @@ typedef struct mtk_hdr {
 // Flags
 #define MTK_KERNEL    0x1
 #define MTK_RAMDISK   0x2
+#define CHROMEOS_IMG  0x4
 
 typedef struct boot_img {
     boot_img_hdr hdr;
@@ -0,0 +1,155 @@
+/* cache.c - Cache of decompressed components
+ *
+ * When MAGISKBOOT_CACHE points to a directory, decompressed output is stored
+ * there named after the SHA256 of the compressed data and its format, and
+ * later decompressions of the same data clone the stored file instead.
+ * Files are reflinked when the filesystem supports it and copied otherwise;
+ * hardlinks are never used, since unpacked files are modified in place.
+ * The least recently used files are evicted once the cache grows over
+ * MAGISKBOOT_CACHE_SIZE MB.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+
+#include "magiskboot.h"
+#include "utils.h"
+#include "hash.h"
+
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+
+#define CACHE_ENV          "MAGISKBOOT_CACHE"
+#define CACHE_SIZE_ENV     "MAGISKBOOT_CACHE_SIZE"
+#define CACHE_DEFAULT_MB   512
+
+static int hits, misses;
+
+/* Reflink src to dst, or copy if that is not supported */
+static int clone_file(const char *src, const char *dst) {
+	struct stat st;
+	int ret = -1, ifd, ofd;
+	if ((ifd = open(src, O_RDONLY | O_CLOEXEC)) < 0)
+		return -1;
+	if ((ofd = open(dst, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0)
+		goto close_in;
+	if (ioctl(ofd, FICLONE, ifd) == 0) {
+		ret = 0;
+	} else if (fstat(ifd, &st) == 0) {
+		off_t off = 0;
+		while (off < st.st_size && sendfile(ofd, ifd, &off, st.st_size - off) > 0);
+		ret = off == st.st_size ? 0 : -1;
+	}
+	close(ofd);
+close_in:
+	close(ifd);
+	return ret;
+}
+
+typedef struct cache_file {
+	char name[NAME_MAX + 1];
+	off_t size;
+	time_t mtime;
+} cache_file;
+
+static int mtime_cmp(const void *a, const void *b) {
+	const cache_file *m = a, *n = b;
+	return (m->mtime > n->mtime) - (m->mtime < n->mtime);
+}
+
+/* Remove the least recently used files until the cache fits its limit */
+static void cache_evict(const char *dir) {
+	const char *env = getenv(CACHE_SIZE_ENV);
+	off_t limit = (off_t) (env ? atol(env) : CACHE_DEFAULT_MB) << 20, total = 0;
+	cache_file *files = NULL;
+	size_t num = 0;
+	char path[PATH_MAX];
+	struct dirent *entry;
+	struct stat st;
+
+	DIR *d = opendir(dir);
+	if (d == NULL)
+		return;
+	while ((entry = readdir(d))) {
+		// Skips . and .. as well as files still being written
+		if (entry->d_name[0] == '.')
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+		if (stat(path, &st) != 0 || !S_ISREG(st.st_mode))
+			continue;
+		files = xrealloc(files, (num + 1) * sizeof(*files));
+		strcpy(files[num].name, entry->d_name);
+		files[num].size = st.st_size;
+		files[num].mtime = st.st_mtime;
+		total += st.st_size;
+		++num;
+	}
+	closedir(d);
+
+	qsort(files, num, sizeof(*files), mtime_cmp);
+	for (size_t i = 0; i < num && total > limit; ++i) {
+		snprintf(path, sizeof(path), "%s/%s", dir, files[i].name);
+		if (unlink(path) == 0 || errno == ENOENT)
+			total -= files[i].size;
+	}
+	free(files);
+}
+
+static void cache_store(const char *dir, const char *path, const char *from) {
+	char tmp[PATH_MAX];
+	mkdir_p(dir, 0755);
+	snprintf(tmp, sizeof(tmp), "%s/.tmp-XXXXXX", dir);
+	int fd = mkstemp(tmp);
+	if (fd < 0)
+		return;
+	fchmod(fd, 0644);
+	close(fd);
+	// Rename so other processes never see a partial file
+	if (clone_file(from, tmp) != 0 || rename(tmp, path) != 0) {
+		unlink(tmp);
+		return;
+	}
+	cache_evict(dir);
+}
+
+/* Decompress buf to the file to, going through the cache when enabled */
+void cache_decomp(file_t type, const void *buf, size_t size, const char *to) {
+	const char *dir = getenv(CACHE_ENV);
+	char path[PATH_MAX], fmt[16];
+	unsigned char digest[SHA256_DIGEST_SIZE];
+
+	if (dir && dir[0]) {
+		hash_buf(buf, size, HASH_SHA256, digest);
+		get_type_name(type, fmt);
+		int len = snprintf(path, sizeof(path), "%s/", dir);
+		for (int i = 0; i < SHA256_DIGEST_SIZE; ++i)
+			len += sprintf(path + len, "%02x", digest[i]);
+		snprintf(path + len, sizeof(path) - len, ".%s", fmt);
+		if (clone_file(path, to) == 0) {
+			// Mark as recently used
+			utimensat(AT_FDCWD, path, NULL, 0);
+			__atomic_add_fetch(&hits, 1, __ATOMIC_RELAXED);
+			fprintf(stderr, "CACHE_HIT [%s]\n", to);
+			return;
+		}
+		__atomic_add_fetch(&misses, 1, __ATOMIC_RELAXED);
+	}
+
+	int fd = open_new(to);
+	decomp(type, fd, buf, size);
+	close(fd);
+
+	if (dir && dir[0])
+		cache_store(dir, path, to);
+}
+
+void cache_report() {
+	if (hits + misses)
+		fprintf(stderr, "CACHE [%d hit] [%d miss]\n", hits, misses);
+}
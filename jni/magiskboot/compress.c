@@ -1,5 +1,4 @@
 #include <unistd.h>
-#include <sys/mman.h>
 
 #include <zlib.h>
 #include <lzma.h>
@@ -9,8 +8,6 @@
 #include <bzlib.h>
 
 #include "magiskboot.h"
-#include "logging.h"
-#include "utils.h"
 
 #define windowBits 15
 #define ZLIB_GZIP 16
@@ -22,10 +19,11 @@
 #define LZ4_LEGACY_BLOCKSIZE  0x800000
 
 // Mode: 0 = decode; 1 = encode
-size_t gzip(int mode, int fd, const void *buf, size_t size) {
-	size_t ret = 0, flush, have, pos = 0, total = 0;
+long long gzip(int mode, out_stream *out, const void *buf, size_t size) {
+	size_t flush, have, pos = 0, total = 0;
+	int ret = 0, err = BOOT_OK;
 	z_stream strm;
-	unsigned char out[CHUNK];
+	unsigned char chunk[CHUNK];
 
 	strm.zalloc = Z_NULL;
 	strm.zfree = Z_NULL;
@@ -41,7 +39,7 @@ size_t gzip(int mode, int fd, const void *buf, size_t size) {
 	}
 
 	if (ret != Z_OK)
-		LOGE("Unable to init zlib stream\n");
+		return BOOT_ECODEC;
 
 	do {
 		strm.next_in = (void *) buf + pos;
@@ -56,7 +54,7 @@ size_t gzip(int mode, int fd, const void *buf, size_t size) {
 
 		do {
 			strm.avail_out = CHUNK;
-			strm.next_out = out;
+			strm.next_out = chunk;
 			switch(mode) {
 				case 0:
 					ret = inflate(&strm, flush);
@@ -65,16 +63,21 @@ size_t gzip(int mode, int fd, const void *buf, size_t size) {
 					ret = deflate(&strm, flush);
 					break;
 			}
-			if (ret == Z_STREAM_ERROR)
-				LOGE("Error when running gzip\n");
+			if (ret == Z_STREAM_ERROR) {
+				err = BOOT_ECODEC;
+				goto done;
+			}
 
 			have = CHUNK - strm.avail_out;
-			total += xwrite(fd, out, have);
+			if ((err = stream_write(out, chunk, have)) < 0)
+				goto done;
+			total += have;
 
 		} while (strm.avail_out == 0);
 
 	} while(pos < size);
 
+done:
 	switch(mode) {
 		case 0:
 			inflateEnd(&strm);
@@ -83,18 +86,19 @@ size_t gzip(int mode, int fd, const void *buf, size_t size) {
 			deflateEnd(&strm);
 			break;
 	}
-	return total;
+	return err < 0 ? err : (long long) total;
 }
 
 
 // Mode: 0 = decode xz/lzma; 1 = encode xz; 2 = encode lzma
-size_t lzma(int mode, int fd, const void *buf, size_t size) {
+long long lzma(int mode, out_stream *out, const void *buf, size_t size) {
 	size_t have, pos = 0, total = 0;
+	int err = BOOT_OK;
 	lzma_ret ret = 0;
 	lzma_stream strm = LZMA_STREAM_INIT;
 	lzma_options_lzma opt;
 	lzma_action action;
-	unsigned char out[BUFSIZ];
+	unsigned char chunk[BUFSIZ];
 
 	// Initialize preset
 	lzma_lzma_preset(&opt, 9);
@@ -117,7 +121,7 @@ size_t lzma(int mode, int fd, const void *buf, size_t size) {
 
 
 	if (ret != LZMA_OK)
-		LOGE("Unable to init lzma stream\n");
+		return BOOT_ECODEC;
 
 	do {
 		strm.next_in = buf + pos;
@@ -132,30 +136,36 @@ size_t lzma(int mode, int fd, const void *buf, size_t size) {
 
 		do {
 			strm.avail_out = BUFSIZ;
-			strm.next_out = out;
+			strm.next_out = chunk;
 			ret = lzma_code(&strm, action);
 			have = BUFSIZ - strm.avail_out;
-			total += xwrite(fd, out, have);
+			if ((err = stream_write(out, chunk, have)) < 0)
+				goto done;
+			total += have;
 		} while (strm.avail_out == 0 && ret == LZMA_OK);
 
-		if (ret != LZMA_OK && ret != LZMA_STREAM_END)
-			LOGE("LZMA error %d!\n", ret);
+		if (ret != LZMA_OK && ret != LZMA_STREAM_END) {
+			err = BOOT_ECODEC;
+			goto done;
+		}
 
 	} while (pos < size);
 
+done:
 	lzma_end(&strm);
-	return total;
+	return err < 0 ? err : (long long) total;
 }
 
 // Mode: 0 = decode; 1 = encode
-size_t lz4(int mode, int fd, const void *buf, size_t size) {
-	LZ4F_decompressionContext_t dctx;
-	LZ4F_compressionContext_t cctx;
+long long lz4(int mode, out_stream *out, const void *buf, size_t size) {
+	LZ4F_decompressionContext_t dctx = NULL;
+	LZ4F_compressionContext_t cctx = NULL;
 	LZ4F_frameInfo_t info;
 
-	size_t blockSize, outCapacity, avail_in, ret = 0, pos = 0, total = 0;
+	size_t blockSize, outCapacity = 0, avail_in, ret = 0, pos = 0, total = 0;
 	size_t have, read;
-	void *out = NULL;
+	int err = BOOT_ECODEC;
+	void *chunk = NULL;
 
 	// Initialize context
 	switch(mode) {
@@ -168,7 +178,7 @@ size_t lz4(int mode, int fd, const void *buf, size_t size) {
 	}
 
 	if (LZ4F_isError(ret))
-		LOGE("Context creation error: %s\n", LZ4F_getErrorName(ret));
+		return BOOT_ECODEC;
 
 	// Allocate out buffer
 	blockSize = 1 << 22;
@@ -178,7 +188,7 @@ size_t lz4(int mode, int fd, const void *buf, size_t size) {
 			read = blockSize;
 			ret = LZ4F_getFrameInfo(dctx, &info, buf, &read);
 			if (LZ4F_isError(ret))
-				LOGE("LZ4F_getFrameInfo error: %s\n", LZ4F_getErrorName(ret));
+				goto done;
 			switch (info.blockSizeID) {
 				case LZ4F_default:
 				case LZ4F_max64KB:  outCapacity = 1 << 16; break;
@@ -186,7 +196,8 @@ size_t lz4(int mode, int fd, const void *buf, size_t size) {
 				case LZ4F_max1MB:   outCapacity = 1 << 20; break;
 				case LZ4F_max4MB:   outCapacity = 1 << 22; break;
 				default:
-					LOGE("Impossible unless more block sizes are allowed\n");
+					// Impossible unless more block sizes are allowed
+					goto done;
 			}
 			pos += read;
 			break;
@@ -195,7 +206,10 @@ size_t lz4(int mode, int fd, const void *buf, size_t size) {
 			break;
 	}
 
-	out = xmalloc(outCapacity);
+	if ((chunk = malloc(outCapacity)) == NULL) {
+		err = BOOT_ENOMEM;
+		goto done;
+	}
 
 	// Write header
 	if (mode == 1) {
@@ -206,10 +220,12 @@ size_t lz4(int mode, int fd, const void *buf, size_t size) {
 		prefs.frameInfo.blockMode = 1;
 		prefs.frameInfo.blockSizeID = 7;
 		prefs.frameInfo.contentChecksumFlag = 1;
-		have = ret = LZ4F_compressBegin(cctx, out, size, &prefs);
+		have = ret = LZ4F_compressBegin(cctx, chunk, size, &prefs);
 		if (LZ4F_isError(ret))
-			LOGE("Failed to start compression: error %s\n", LZ4F_getErrorName(ret));
-		total += xwrite(fd, out, have);
+			goto done;
+		if ((err = stream_write(out, chunk, have)) < 0)
+			goto done;
+		total += have;
 	}
 
 	do {
@@ -224,17 +240,21 @@ size_t lz4(int mode, int fd, const void *buf, size_t size) {
 				case 0:
 					have = outCapacity;
 					read = avail_in;
-					ret = LZ4F_decompress(dctx, out, &have, buf + pos, &read, NULL);
+					ret = LZ4F_decompress(dctx, chunk, &have, buf + pos, &read, NULL);
 					break;
 				case 1:
 					read = avail_in;
-					have = ret = LZ4F_compressUpdate(cctx, out, outCapacity, buf + pos, avail_in, NULL);
+					have = ret = LZ4F_compressUpdate(cctx, chunk, outCapacity, buf + pos, avail_in, NULL);
 					break;
 			}
-			if (LZ4F_isError(ret))
-				LOGE("LZ4 coding error: %s\n", LZ4F_getErrorName(ret));
+			if (LZ4F_isError(ret)) {
+				err = BOOT_ECODEC;
+				goto done;
+			}
 
-			total += xwrite(fd, out, have);
+			if ((err = stream_write(out, chunk, have)) < 0)
+				goto done;
+			total += have;
 			// Update status
 			pos += read;
 			avail_in -= read;
@@ -242,30 +262,38 @@ size_t lz4(int mode, int fd, const void *buf, size_t size) {
 
 	} while(pos < size && ret != 0);
 
+	if (mode == 1) {
+		have = ret = LZ4F_compressEnd(cctx, chunk, outCapacity, NULL);
+		if (LZ4F_isError(ret)) {
+			err = BOOT_ECODEC;
+			goto done;
+		}
+		if ((err = stream_write(out, chunk, have)) < 0)
+			goto done;
+		total += have;
+	}
+	err = BOOT_OK;
+
+done:
 	switch(mode) {
 		case 0:
 			LZ4F_freeDecompressionContext(dctx);
 			break;
 		case 1:
-			have = ret = LZ4F_compressEnd(cctx, out, outCapacity, NULL);
-			if (LZ4F_isError(ret))
-				LOGE("Failed to end compression: error %s\n", LZ4F_getErrorName(ret));
-
-			total += xwrite(fd, out, have);
-
 			LZ4F_freeCompressionContext(cctx);
 			break;
 	}
 
-	free(out);
-	return total;
+	free(chunk);
+	return err < 0 ? err : (long long) total;
 }
 
 // Mode: 0 = decode; 1 = encode
-size_t bzip2(int mode, int fd, const void* buf, size_t size) {
+long long bzip2(int mode, out_stream *out, const void* buf, size_t size) {
 	size_t ret = 0, action, have, pos = 0, total = 0;
+	int err = BOOT_OK;
 	bz_stream strm;
-	char out[CHUNK];
+	char chunk[CHUNK];
 
 	strm.bzalloc = NULL;
 	strm.bzfree = NULL;
@@ -281,7 +309,7 @@ size_t bzip2(int mode, int fd, const void* buf, size_t size) {
 	}
 
 	if (ret != BZ_OK)
-		LOGE("Unable to init bzlib stream\n");
+		return BOOT_ECODEC;
 
 	do {
 		strm.next_in = (char *) buf + pos;
@@ -296,7 +324,7 @@ size_t bzip2(int mode, int fd, const void* buf, size_t size) {
 
 		do {
 			strm.avail_out = CHUNK;
-			strm.next_out = out;
+			strm.next_out = chunk;
 			switch(mode) {
 				case 0:
 					ret = BZ2_bzDecompress(&strm);
@@ -307,12 +335,15 @@ size_t bzip2(int mode, int fd, const void* buf, size_t size) {
 			}
 
 			have = CHUNK - strm.avail_out;
-			total += xwrite(fd, out, have);
+			if ((err = stream_write(out, chunk, have)) < 0)
+				goto done;
+			total += have;
 
 		} while (strm.avail_out == 0);
 
 	} while(pos < size);
 
+done:
 	switch(mode) {
 		case 0:
 			BZ2_bzDecompressEnd(&strm);
@@ -321,28 +352,34 @@ size_t bzip2(int mode, int fd, const void* buf, size_t size) {
 			BZ2_bzCompressEnd(&strm);
 			break;
 	}
-	return total;
+	return err < 0 ? err : (long long) total;
 }
 
 // Mode: 0 = decode; 1 = encode
-size_t lz4_legacy(int mode, int fd, const void* buf, size_t size) {
+long long lz4_legacy(int mode, out_stream *out, const void* buf, size_t size) {
 	size_t pos = 0;
-	int have;
-	char *out;
+	int have, err = BOOT_OK;
+	char *chunk = NULL;
 	unsigned block_size, insize, total = 0;
 
 	switch(mode) {
 		case 0:
-			out = xmalloc(LZ4_LEGACY_BLOCKSIZE);
+			chunk = malloc(LZ4_LEGACY_BLOCKSIZE);
 			// Skip magic
 			pos += 4;
 			break;
 		case 1:
-			out = xmalloc(LZ4_COMPRESSBOUND(LZ4_LEGACY_BLOCKSIZE));
-			// Write magic
-			total += xwrite(fd, "\x02\x21\x4c\x18", 4);
+			chunk = malloc(LZ4_COMPRESSBOUND(LZ4_LEGACY_BLOCKSIZE));
 			break;
 	}
+	if (chunk == NULL)
+		return BOOT_ENOMEM;
+	// Write magic
+	if (mode == 1) {
+		if ((err = stream_write(out, "\x02\x21\x4c\x18", 4)) < 0)
+			goto done;
+		total += 4;
+	}
 
 	do {
 		switch(mode) {
@@ -352,9 +389,11 @@ size_t lz4_legacy(int mode, int fd, const void* buf, size_t size) {
 				pos += 4;
 				if (block_size > LZ4_COMPRESSBOUND(LZ4_LEGACY_BLOCKSIZE))
 					goto done;
-				have = LZ4_decompress_safe(buf + pos, out, block_size, LZ4_LEGACY_BLOCKSIZE);
-				if (have < 0)
-					LOGE("Cannot decode lz4_legacy block\n");
+				have = LZ4_decompress_safe(buf + pos, chunk, block_size, LZ4_LEGACY_BLOCKSIZE);
+				if (have < 0) {
+					err = BOOT_ECODEC;
+					goto done;
+				}
 				pos += block_size;
 				break;
 			case 1:
@@ -362,171 +401,71 @@ size_t lz4_legacy(int mode, int fd, const void* buf, size_t size) {
 					insize = size - pos;
 				else
 					insize = LZ4_LEGACY_BLOCKSIZE;
-				have = LZ4_compress_HC(buf + pos, out, insize, LZ4_COMPRESSBOUND(LZ4_LEGACY_BLOCKSIZE), 9);
-				if (have == 0)
-					LOGE("lz4_legacy compression error\n");
+				have = LZ4_compress_HC(buf + pos, chunk, insize, LZ4_COMPRESSBOUND(LZ4_LEGACY_BLOCKSIZE), 9);
+				if (have == 0) {
+					err = BOOT_ECODEC;
+					goto done;
+				}
 				pos += insize;
 				// Write block size
-				total += xwrite(fd, &have, sizeof(have));
+				if ((err = stream_write(out, &have, sizeof(have))) < 0)
+					goto done;
+				total += sizeof(have);
 				break;
 		}
 		// Write main data
-		total += xwrite(fd, out, have);
+		if ((err = stream_write(out, chunk, have)) < 0)
+			goto done;
+		total += have;
 	} while(pos < size);
 
-done:
 	if (mode == 1) {
 		// Append original size to output
 		unsigned uncomp = size;
-		xwrite(fd, &uncomp, sizeof(uncomp));
+		err = stream_write(out, &uncomp, sizeof(uncomp));
 	}
-	free(out);
-	return total;
+
+done:
+	free(chunk);
+	return err < 0 ? err : (long long) total;
 }
 
-long long decomp(file_t type, int to, const void *from, size_t size) {
-	switch (type) {
+long long boot_decompress(int format, out_stream *out, const void *buf, size_t size) {
+	switch (format) {
 		case GZIP:
-			return gzip(0, to, from, size);
+			return gzip(0, out, buf, size);
 		case XZ:
-			return lzma(0, to, from, size);
+			return lzma(0, out, buf, size);
 		case LZMA:
-			return lzma(0, to, from, size);
+			return lzma(0, out, buf, size);
 		case BZIP2:
-			return bzip2(0, to, from, size);
+			return bzip2(0, out, buf, size);
 		case LZ4:
-			return lz4(0, to, from, size);
+			return lz4(0, out, buf, size);
 		case LZ4_LEGACY:
-			return lz4_legacy(0, to, from, size);
+			return lz4_legacy(0, out, buf, size);
 		default:
 			// Unsupported
-			return -1;
+			return BOOT_EFORMAT;
 	}
 }
 
-// Output will be to.ext
-long long comp(file_t type, int to, const void *from, size_t size) {
-	switch (type) {
+long long boot_compress(int format, out_stream *out, const void *buf, size_t size) {
+	switch (format) {
 		case GZIP:
-			return gzip(1, to, from, size);
+			return gzip(1, out, buf, size);
 		case XZ:
-			return lzma(1, to, from, size);
+			return lzma(1, out, buf, size);
 		case LZMA:
-			return lzma(2, to, from, size);
+			return lzma(2, out, buf, size);
 		case BZIP2:
-			return bzip2(1, to, from, size);
+			return bzip2(1, out, buf, size);
 		case LZ4:
-			return lz4(1, to, from, size);
+			return lz4(1, out, buf, size);
 		case LZ4_LEGACY:
-			return lz4_legacy(1, to, from, size);
+			return lz4_legacy(1, out, buf, size);
 		default:
 			// Unsupported
-			return -1;
+			return BOOT_EFORMAT;
 	}
 }
-
-/*
- * Below are utility functions for commandline
- */
-
-void decomp_file(char *from, const char *to) {
-	int ok = 1;
-	void *file;
-	size_t size;
-	mmap_ro(from, &file, &size);
-	file_t type = check_type(file);
-	char *ext;
-	ext = strrchr(from, '.');
-	if (ext == NULL)
-		LOGE("Bad filename extention\n");
-
-	// File type and extension should match
-	switch (type) {
-		case GZIP:
-			if (strcmp(ext, ".gz") != 0)
-				ok = 0;
-			break;
-		case XZ:
-			if (strcmp(ext, ".xz") != 0)
-				ok = 0;
-			break;
-		case LZMA:
-			if (strcmp(ext, ".lzma") != 0)
-				ok = 0;
-			break;
-		case BZIP2:
-			if (strcmp(ext, ".bz2") != 0)
-				ok = 0;
-			break;
-		case LZ4_LEGACY:
-		case LZ4:
-			if (strcmp(ext, ".lz4") != 0)
-				ok = 0;
-			break;
-		default:
-			LOGE("Provided file \'%s\' is not a supported archive format\n", from);
-	}
-	if (ok) {
-		// If all match, strip out the suffix
-		if (!to) {
-			*ext = '\0';
-			to = from;
-		}
-		int fd = open_new(to);
-		fprintf(stderr, "Decompressing to [%s]\n\n", to);
-		decomp(type, fd, file, size);
-		close(fd);
-		if (to == from) {
-			*ext = '.';
-			unlink(from);
-		}
-	} else {
-		LOGE("Bad filename extention \'%s\'\n", ext);
-	}
-	munmap(file, size);
-}
-
-void comp_file(const char *method, const char *from, const char *to) {
-	file_t type;
-	char *ext, dest[PATH_MAX];
-	if (strcmp(method, "gzip") == 0) {
-		type = GZIP;
-		ext = "gz";
-	} else if (strcmp(method, "xz") == 0) {
-		type = XZ;
-		ext = "xz";
-	} else if (strcmp(method, "lzma") == 0) {
-		type = LZMA;
-		ext = "lzma";
-	} else if (strcmp(method, "lz4") == 0) {
-		type = LZ4;
-		ext = "lz4";
-	} else if (strcmp(method, "lz4_legacy") == 0) {
-		type = LZ4_LEGACY;
-		ext = "lz4";
-	} else if (strcmp(method, "bzip2") == 0) {
-		type = BZIP2;
-		ext = "bz2";
-	} else {
-		fprintf(stderr, "Only support following methods: ");
-		for (int i = 0; SUP_LIST[i]; ++i)
-			fprintf(stderr, "%s ", SUP_LIST[i]);
-		fprintf(stderr, "\n");
-		exit(1);
-	}
-	void *file;
-	size_t size;
-	mmap_ro(from, &file, &size);
-	if (!to)
-		snprintf(dest, sizeof(dest), "%s.%s", from, ext);
-	else
-		strcpy(dest, to);
-	fprintf(stderr, "Compressing to [%s]\n\n", dest);
-	int fd = open_new(dest);
-	comp(type, fd, file, size);
-	close(fd);
-	munmap(file, size);
-	if (!to)
-		unlink(from);
-}
-
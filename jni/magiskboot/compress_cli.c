@@ -0,0 +1,132 @@
+/* compress_cli.c - Compression commands of magiskboot
+ *
+ * Wrappers of the libmagiskboot codecs that work on files and exit on errors
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "magiskboot.h"
+#include "logging.h"
+#include "utils.h"
+
+long long decomp(file_t type, int to, const void *from, size_t size) {
+	out_stream out;
+	fd_stream(&out, to);
+	long long ret = boot_decompress(type, &out, from, size);
+	if (ret < 0)
+		LOGE("Decompression failed: %s\n", boot_strerror(ret));
+	return ret;
+}
+
+long long comp(file_t type, int to, const void *from, size_t size) {
+	out_stream out;
+	fd_stream(&out, to);
+	long long ret = boot_compress(type, &out, from, size);
+	if (ret < 0)
+		LOGE("Compression failed: %s\n", boot_strerror(ret));
+	return ret;
+}
+
+void decomp_file(char *from, const char *to) {
+	int ok = 1;
+	void *file;
+	size_t size;
+	mmap_ro(from, &file, &size);
+	file_t type = check_type(file);
+	char *ext;
+	ext = strrchr(from, '.');
+	if (ext == NULL)
+		LOGE("Bad filename extention\n");
+
+	// File type and extension should match
+	switch (type) {
+		case GZIP:
+			if (strcmp(ext, ".gz") != 0)
+				ok = 0;
+			break;
+		case XZ:
+			if (strcmp(ext, ".xz") != 0)
+				ok = 0;
+			break;
+		case LZMA:
+			if (strcmp(ext, ".lzma") != 0)
+				ok = 0;
+			break;
+		case BZIP2:
+			if (strcmp(ext, ".bz2") != 0)
+				ok = 0;
+			break;
+		case LZ4_LEGACY:
+		case LZ4:
+			if (strcmp(ext, ".lz4") != 0)
+				ok = 0;
+			break;
+		default:
+			LOGE("Provided file \'%s\' is not a supported archive format\n", from);
+	}
+	if (ok) {
+		// If all match, strip out the suffix
+		if (!to) {
+			*ext = '\0';
+			to = from;
+		}
+		fprintf(stderr, "Decompressing to [%s]\n\n", to);
+		cache_decomp(type, file, size, to);
+		cache_report();
+		if (to == from) {
+			*ext = '.';
+			unlink(from);
+		}
+	} else {
+		LOGE("Bad filename extention \'%s\'\n", ext);
+	}
+	munmap(file, size);
+}
+
+void comp_file(const char *method, const char *from, const char *to) {
+	file_t type;
+	char *ext, dest[PATH_MAX];
+	if (strcmp(method, "gzip") == 0) {
+		type = GZIP;
+		ext = "gz";
+	} else if (strcmp(method, "xz") == 0) {
+		type = XZ;
+		ext = "xz";
+	} else if (strcmp(method, "lzma") == 0) {
+		type = LZMA;
+		ext = "lzma";
+	} else if (strcmp(method, "lz4") == 0) {
+		type = LZ4;
+		ext = "lz4";
+	} else if (strcmp(method, "lz4_legacy") == 0) {
+		type = LZ4_LEGACY;
+		ext = "lz4";
+	} else if (strcmp(method, "bzip2") == 0) {
+		type = BZIP2;
+		ext = "bz2";
+	} else {
+		fprintf(stderr, "Only support following methods: ");
+		for (int i = 0; SUP_LIST[i]; ++i)
+			fprintf(stderr, "%s ", SUP_LIST[i]);
+		fprintf(stderr, "\n");
+		exit(1);
+	}
+	void *file;
+	size_t size;
+	mmap_ro(from, &file, &size);
+	if (!to)
+		snprintf(dest, sizeof(dest), "%s.%s", from, ext);
+	else
+		strcpy(dest, to);
+	fprintf(stderr, "Compressing to [%s]\n\n", dest);
+	int fd = open_new(dest);
+	comp(type, fd, file, size);
+	close(fd);
+	munmap(file, size);
+	if (!to)
+		unlink(from);
+}
+
@@ -1,198 +1,71 @@
 #include <stdio.h>
 #include <unistd.h>
+#include <sys/mman.h>
 
 #include "magiskboot.h"
 #include "cpio.h"
 #include "logging.h"
 #include "utils.h"
 
-static uint32_t x8u(char *hex) {
-  uint32_t val, inpos = 8, outpos;
-  char pattern[6];
-
-  while (*hex == '0') {
-    hex++;
-    if (!--inpos) return 0;
-  }
-  // Because scanf gratuitously treats %*X differently than printf does.
-  sprintf(pattern, "%%%dx%%n", inpos);
-  sscanf(hex, pattern, &val, &outpos);
-  if (inpos != outpos) LOGE("bad cpio header\n");
-
-  return val;
-}
-
-static void cpio_free(cpio_entry *f) {
-	if (f) {
-		free(f->filename);
-		free(f->data);
-		free(f);
-	}
-}
-
-static void cpio_vec_insert(struct vector *v, cpio_entry *n) {
-	cpio_entry *f;
-	vec_for_each(v, f) {
-		if (strcmp(f->filename, n->filename) == 0) {
-			// Replace, then all is done
-			cpio_free(f);
-			vec_cur(v) = n;
-			return;
-		}
-	}
-	vec_push_back(v, n);
-}
-
-static int cpio_cmp(const void *a, const void *b) {
-	return strcmp((*(cpio_entry **) a)->filename, (*(cpio_entry **) b)->filename);
-}
-
 // Parse cpio file to a vector of cpio_entry
 static void parse_cpio(const char *filename, struct vector *v) {
 	fprintf(stderr, "Loading cpio: [%s]\n\n", filename);
-	int fd = xopen(filename, O_RDONLY);
-	cpio_newc_header header;
-	cpio_entry *f;
-	while(xxread(fd, &header, 110) != -1) {
-		f = xcalloc(sizeof(*f), 1);
-		// f->ino = x8u(header.ino);
-		f->mode = x8u(header.mode);
-		f->uid = x8u(header.uid);
-		f->gid = x8u(header.gid);
-		// f->nlink = x8u(header.nlink);
-		// f->mtime = x8u(header.mtime);
-		f->filesize = x8u(header.filesize);
-		// f->devmajor = x8u(header.devmajor);
-		// f->devminor = x8u(header.devminor);
-		// f->rdevmajor = x8u(header.rdevmajor);
-		// f->rdevminor = x8u(header.rdevminor);
-		f->namesize = x8u(header.namesize);
-		// f->check = x8u(header.check);
-		f->filename = xmalloc(f->namesize);
-		xxread(fd, f->filename, f->namesize);
-		file_align(fd, 4, 0);
-		if (strcmp(f->filename, ".") == 0 || strcmp(f->filename, "..") == 0) {
-			cpio_free(f);
-			continue;
-		}
-		if (strcmp(f->filename, "TRAILER!!!") == 0) {
-			cpio_free(f);
-			break;
-		}
-		if (f->filesize) {
-			f->data = malloc(f->filesize);
-			xxread(fd, f->data, f->filesize);
-			file_align(fd, 4, 0);
-		}
-		vec_push_back(v, f);
-	}
-	close(fd);
+	void *buf;
+	size_t size;
+	mmap_ro(filename, &buf, &size);
+	int err = cpio_vec_parse(buf, size, v);
+	munmap(buf, size);
+	if (err < 0)
+		LOGE("Cannot parse cpio [%s]: %s\n", filename, boot_strerror(err));
 }
 
-static void dump_cpio(const char *filename, struct vector *v) {
+static void dump_cpio(const char *filename, struct vector *v, int dedup) {
 	fprintf(stderr, "\nDump cpio: [%s]\n\n", filename);
+	out_stream out;
 	int fd = open_new(filename);
-	unsigned inode = 300000;
-	char header[111];
-	// Sort by name
-	vec_sort(v, cpio_cmp);
-	cpio_entry *f;
-	vec_for_each(v, f) {
-		if (f->remove) continue;
-		sprintf(header, "070701%08x%08x%08x%08x%08x%08x%08x%08x%08x%08x%08x%08x%08x",
-			inode++,	// f->ino
-			f->mode,
-			f->uid,
-			f->gid,
-			1,			// f->nlink
-			0,			// f->mtime
-			f->filesize,
-			0,			// f->devmajor
-			0,			// f->devminor
-			0,			// f->rdevmajor
-			0,			// f->rdevminor
-			f->namesize,
-			0			// f->check
-		);
-		xwrite(fd, header, 110);
-		xwrite(fd, f->filename, f->namesize);
-		file_align(fd, 4, 1);
-		if (f->filesize) {
-			xwrite(fd, f->data, f->filesize);
-			file_align(fd, 4, 1);
-		}
-	}
-	// Write trailer
-	sprintf(header, "070701%08x%08x%08x%08x%08x%08x%08x%08x%08x%08x%08x%08x%08x", inode++, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 11, 0);
-	xwrite(fd, header, 110);
-	xwrite(fd, "TRAILER!!!\0", 11);
-	file_align(fd, 4, 1);
+	fd_stream(&out, fd);
+	long long saved = cpio_vec_dump(v, &out, dedup);
+	if (saved < 0)
+		LOGE("Cannot dump cpio [%s]: %s\n", filename, boot_strerror(saved));
+	if (saved)
+		fprintf(stderr, "Deduplicated [%lld] bytes\n", saved);
 	close(fd);
 }
 
-static void cpio_vec_destroy(struct vector *v) {
-	// Free each cpio_entry
-	cpio_entry *f;
-	vec_for_each(v, f) {
-		cpio_free(f);
-	}
-	vec_destroy(v);
-}
-
 static void cpio_rm(int recursive, const char *entry, struct vector *v) {
-	cpio_entry *f;
-	vec_for_each(v, f) {
-		if (strncmp(f->filename, entry, strlen(entry)) == 0) {
-			char next = f->filename[strlen(entry)];
-			if ((recursive && next == '/') || next == '\0') {
-				if (!f->remove) {
-					fprintf(stderr, "Remove [%s]\n", f->filename);
-					f->remove = 1;
-				}
-				if (!recursive) return;
-			}
-		}
-	}
+	if (cpio_vec_rm(v, entry, recursive))
+		fprintf(stderr, "Remove [%s]\n", entry);
 }
 
 static void cpio_mkdir(mode_t mode, const char *entry, struct vector *v) {
-	cpio_entry *f = xcalloc(sizeof(*f), 1);
-	f->mode = S_IFDIR | mode;
-	f->namesize = strlen(entry) + 1;
-	f->filename = strdup(entry);
-	cpio_vec_insert(v, f);
+	if (cpio_vec_mkdir(v, mode, entry) < 0)
+		LOGE("Cannot create directory [%s]\n", entry);
 	fprintf(stderr, "Create directory [%s] (%04o)\n",entry, mode);
 }
 
 static void cpio_add(mode_t mode, const char *entry, const char *filename, struct vector *v) {
-	int fd = xopen(filename, O_RDONLY);
-	cpio_entry *f = xcalloc(sizeof(*f), 1);
-	f->mode = S_IFREG | mode;
-	f->namesize = strlen(entry) + 1;
-	f->filename = strdup(entry);
-	f->filesize = lseek(fd, 0, SEEK_END);
-	lseek(fd, 0, SEEK_SET);
-	f->data = xmalloc(f->filesize);
-	xxread(fd, f->data, f->filesize);
-	close(fd);
-	cpio_vec_insert(v, f);
+	void *buf;
+	size_t size;
+	mmap_ro(filename, &buf, &size);
+	int err = cpio_vec_add(v, mode, entry, buf, size);
+	munmap(buf, size);
+	if (err < 0)
+		LOGE("Cannot add entry [%s]: %s\n", entry, boot_strerror(err));
 	fprintf(stderr, "Add entry [%s] (%04o)\n", entry, mode);
 }
 
-static void cpio_test(struct vector *v) {
-	#define STOCK_BOOT      0x0
-	#define MAGISK_PATCH    0x1
-	#define OTHER_PATCH     0x2
+/* Return value: 0/stock 1/Magisk 2/other (e.g. phh, SuperSU) */
+int cpio_status(struct vector *v) {
 	int ret = STOCK_BOOT;
 	cpio_entry *f;
 	const char *OTHER_LIST[] = { "sbin/launch_daemonsu.sh", "sbin/su", "init.xposed.rc", "boot/sbin/launch_daemonsu.sh", NULL };
 	const char *MAGISK_LIST[] = { ".backup/.magisk", "init.magisk.rc", "overlay/init.magisk.rc", NULL };
 	vec_for_each(v, f) {
+		if (f->remove) continue;
 		for (int i = 0; OTHER_LIST[i]; ++i) {
 			if (strcmp(f->filename, OTHER_LIST[i]) == 0) {
-				ret |= OTHER_PATCH;
 				// Already find other files, abort
-				exit(OTHER_PATCH);
+				return OTHER_PATCH;
 			}
 		}
 		for (int i = 0; MAGISK_LIST[i]; ++i) {
@@ -200,14 +73,20 @@ static void cpio_test(struct vector *v) {
 				ret = MAGISK_PATCH;
 		}
 	}
+	return ret;
+}
+
+static void cpio_test(struct vector *v) {
+	int ret = cpio_status(v);
 	cpio_vec_destroy(v);
 	exit(ret);
 }
 
-static void cpio_patch(struct vector *v, int keepverity, int keepforceencrypt) {
+void cpio_patch(struct vector *v, int keepverity, int keepforceencrypt) {
 	cpio_entry *f;
 	int skip, write;
 	vec_for_each(v, f) {
+		if (f->remove) continue;
 		if (!keepverity) {
 			if (strstr(f->filename, "fstab") != NULL && S_ISREG(f->mode)) {
 				write = 0;
@@ -244,29 +123,29 @@ static void cpio_patch(struct vector *v, int keepverity, int keepforceencrypt) {
 }
 
 static void cpio_extract(const char *entry, const char *filename, struct vector *v) {
-	cpio_entry *f;
-	vec_for_each(v, f) {
-		if (strcmp(f->filename, entry) == 0 && S_ISREG(f->mode)) {
-			fprintf(stderr, "Extracting [%s] to [%s]\n\n", entry, filename);
-			int fd = open_new(filename);
-			xwrite(fd, f->data, f->filesize);
-			fchmod(fd, f->mode);
-			fchown(fd, f->uid, f->gid);
-			close(fd);
-			exit(0);
-		}
+	cpio_entry *f = cpio_vec_find(v, entry);
+	if (f && S_ISREG(f->mode)) {
+		fprintf(stderr, "Extracting [%s] to [%s]\n\n", entry, filename);
+		int fd = open_new(filename);
+		xwrite(fd, f->data, f->filesize);
+		fchmod(fd, f->mode);
+		fchown(fd, f->uid, f->gid);
+		close(fd);
+		exit(0);
 	}
 	LOGE("Cannot find the file entry [%s]\n", entry);
 }
 
-static void cpio_backup(const char *orig, const char *sha1, struct vector *v) {
-	struct vector o_body, *o = &o_body, bak;
+/* Back up entries of the original ramdisk o that are missing or modified in v,
+ * and record new entries in .backup/.rmlist. Entries are moved out of o,
+ * which is destroyed afterwards */
+void cpio_backup(struct vector *o, const char *sha1, struct vector *v) {
+	struct vector bak;
 	cpio_entry *m, *n, *rem, *cksm;
 	char buf[PATH_MAX];
 	int res, doBak;
 
 	if (sha1) cksm = xcalloc(sizeof(*cksm), 1);
-	vec_init(o);
 	vec_init(&bak);
 
 	m = xcalloc(sizeof(*m), 1);
@@ -288,7 +167,6 @@ static void cpio_backup(const char *orig, const char *sha1, struct vector *v) {
 	vec_push_back(&bak, rem);
 
 	if (sha1) vec_push_back(&bak, cksm);
-	parse_cpio(orig, o);
 	// Remove possible backups in original ramdisk
 	cpio_rm(1, ".backup", o);
 	cpio_rm(1, ".backup", v);
@@ -329,7 +207,7 @@ static void cpio_backup(const char *orig, const char *sha1, struct vector *v) {
 			fprintf(stderr, "Backup missing entry: ");
 		} else if (res == 0) {
 			++i; ++j;
-			if (m->filesize == n->filesize && memcmp(m->data, n->data, m->filesize) == 0)
+			if (!n->remove && m->filesize == n->filesize && memcmp(m->data, n->data, m->filesize) == 0)
 				continue;
 			// Not the same!
 			doBak = 1;
@@ -367,7 +245,7 @@ static void cpio_backup(const char *orig, const char *sha1, struct vector *v) {
 	cpio_vec_destroy(o);
 }
 
-static int cpio_restore(struct vector *v) {
+int cpio_restore(struct vector *v) {
 	cpio_entry *f, *n;
 	int ret = 1;
 	vec_for_each(v, f) {
@@ -390,7 +268,8 @@ static int cpio_restore(struct vector *v) {
 				f->data = NULL;
 				n->remove = 0;
 				fprintf(stderr, "Restore [%s] -> [%s]\n", f->filename, n->filename);
-				cpio_vec_insert(v, n);
+				if (cpio_vec_insert(v, n) < 0)
+					LOGE("Cannot restore [%s]\n", f->filename);
 			}
 		}
 	}
@@ -401,10 +280,11 @@ static int cpio_restore(struct vector *v) {
 	return ret;
 }
 
-static void cpio_stocksha1(struct vector *v) {
+/* Find the SHA1 of the stock boot image recorded in the ramdisk */
+int cpio_stocksha1(struct vector *v, char sha1[41]) {
 	cpio_entry *f;
-	char sha1[41];
 	vec_for_each(v, f) {
+		if (f->remove) continue;
 		if (strcmp(f->filename, "init.magisk.rc") == 0
 			|| strcmp(f->filename, "overlay/init.magisk.rc") == 0) {
 			for (char *pos = f->data; pos < f->data + f->filesize; pos = strchr(pos + 1, '\n') + 1) {
@@ -412,35 +292,23 @@ static void cpio_stocksha1(struct vector *v) {
 					pos += 12;
 					memcpy(sha1, pos, 40);
 					sha1[40] = '\0';
-					printf("%s\n", sha1);
-					return;
+					return 0;
 				}
 			}
 		} else if (strcmp(f->filename, ".backup/.sha1") == 0) {
-			printf("%s\n", f->data);
+			snprintf(sha1, 41, "%.*s", f->filesize, f->data);
+			return 0;
 		}
 	}
+	return 1;
 }
 
 static void cpio_mv(struct vector *v, const char *from, const char *to) {
-	struct cpio_entry *f, *t;
-	vec_for_each(v, f) {
-		if (strcmp(f->filename, from) == 0) {
-			fprintf(stderr, "Move [%s] -> [%s]\n", from, to);
-			vec_for_each(v, t) {
-				if (strcmp(t->filename, to) == 0) {
-					t->remove = 1;
-					break;
-				}
-			}
-			free(f->filename);
-			f->namesize = strlen(to) + 1;
-			f->filename = strdup(to);
-			return;
-		}
+	if (cpio_vec_mv(v, from, to) < 0) {
+		fprintf(stderr, "Cannot find entry %s\n", from);
+		exit(1);
 	}
-	fprintf(stderr, "Cannot find entry %s\n", from);
-	exit(1);
+	fprintf(stderr, "Move [%s] -> [%s]\n", from, to);
 }
 
 int cpio_commands(const char *command, int argc, char *argv[]) {
@@ -455,6 +323,8 @@ int cpio_commands(const char *command, int argc, char *argv[]) {
 		cmd = RESTORE;
 	} else if (strcmp(command, "stocksha1") == 0) {
 		cmd = STOCKSHA1;
+	} else if (strcmp(command, "dedup") == 0) {
+		cmd = DEDUP;
 	} else if (argc >= 1 && strcmp(command, "backup") == 0) {
 		cmd = BACKUP;
 	} else if (argc > 0 && strcmp(command, "rm") == 0) {
@@ -487,11 +357,18 @@ int cpio_commands(const char *command, int argc, char *argv[]) {
 	case RESTORE:
 		ret = cpio_restore(&v);
 		break;
-	case STOCKSHA1:
-		cpio_stocksha1(&v);
+	case STOCKSHA1: {
+		char sha1[41];
+		if (cpio_stocksha1(&v, sha1) == 0)
+			printf("%s\n", sha1);
 		return 0;
-	case BACKUP:
-		cpio_backup(argv[0], argc > 1 ? argv[1] : NULL, &v);
+	}
+	case BACKUP: {
+		struct vector o;
+		vec_init(&o);
+		parse_cpio(argv[0], &o);
+		cpio_backup(&o, argc > 1 ? argv[1] : NULL, &v);
+	}
 	case RM:
 		cpio_rm(recursive, argv[0], &v);
 		break;
@@ -510,10 +387,12 @@ int cpio_commands(const char *command, int argc, char *argv[]) {
 	case MV:
 		cpio_mv(&v, argv[0], argv[1]);
 		break;
+	case DEDUP:
+		break;
 	case NONE:
 		return 1;
 	}
-	dump_cpio(incpio, &v);
+	dump_cpio(incpio, &v, cmd == DEDUP);
 	cpio_vec_destroy(&v);
 	exit(ret);
 }
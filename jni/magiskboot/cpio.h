@@ -3,12 +3,14 @@
 
 #include <stdint.h>
 
+#include "vector.h"
+
 typedef struct cpio_entry {
-	// uint32_t ino;
+	uint32_t ino;
 	uint32_t mode;
 	uint32_t uid;
 	uint32_t gid;
-	// uint32_t nlink;
+	uint32_t nlink;
 	// uint32_t mtime;
 	uint32_t filesize;
 	// uint32_t devmajor;
@@ -50,7 +52,24 @@ typedef enum {
     PATCH,
     BACKUP,
     RESTORE,
-    STOCKSHA1
+    STOCKSHA1,
+    DEDUP
 } command_t;
 
+// Ramdisk status
+#define STOCK_BOOT      0x0
+#define MAGISK_PATCH    0x1
+#define OTHER_PATCH     0x2
+
+// cpio_vec.c
+void cpio_free(cpio_entry *f);
+int cpio_cmp(const void *a, const void *b);
+
+// cpio.c
+int cpio_status(struct vector *v);
+void cpio_patch(struct vector *v, int keepverity, int keepforceencrypt);
+void cpio_backup(struct vector *o, const char *sha1, struct vector *v);
+int cpio_restore(struct vector *v);
+int cpio_stocksha1(struct vector *v, char sha1[41]);
+
 #endif
@@ -0,0 +1,369 @@
+/* cpio_vec.c - Parse, modify and serialize newc cpio archives in memory
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "libmagiskboot.h"
+#include "cpio.h"
+
+static int x8u(const char *hex, uint32_t *val) {
+	char buf[9];
+	char *end;
+	memcpy(buf, hex, 8);
+	buf[8] = '\0';
+	*val = strtoul(buf, &end, 16);
+	return *end == '\0' ? BOOT_OK : BOOT_EFORMAT;
+}
+
+void cpio_free(cpio_entry *f) {
+	if (f) {
+		free(f->filename);
+		free(f->data);
+		free(f);
+	}
+}
+
+int cpio_cmp(const void *a, const void *b) {
+	return strcmp((*(cpio_entry **) a)->filename, (*(cpio_entry **) b)->filename);
+}
+
+/* Takes the ownership of n, which is freed if it cannot be added */
+int cpio_vec_insert(struct vector *v, cpio_entry *n) {
+	cpio_entry *f;
+	vec_for_each(v, f) {
+		if (strcmp(f->filename, n->filename) == 0) {
+			// Replace, then all is done
+			cpio_free(f);
+			vec_cur(v) = n;
+			return BOOT_OK;
+		}
+	}
+	if (vec_push_back(v, n)) {
+		cpio_free(n);
+		return BOOT_ENOMEM;
+	}
+	return BOOT_OK;
+}
+
+void cpio_vec_destroy(struct vector *v) {
+	// Free each cpio_entry
+	cpio_entry *f;
+	vec_for_each(v, f) {
+		cpio_free(f);
+	}
+	vec_destroy(v);
+}
+
+// Hardlinked files only carry data in the last member of each group,
+// give every member its own copy so entries can be modified independently
+static int cpio_unlink(struct vector *v) {
+	cpio_entry *f, *t;
+	vec_for_each(v, f) {
+		if (f->nlink < 2 || !S_ISREG(f->mode) || f->filesize)
+			continue;
+		vec_for_each(v, t) {
+			if (t->ino == f->ino && S_ISREG(t->mode) && t->filesize) {
+				if ((f->data = malloc(t->filesize)) == NULL)
+					return BOOT_ENOMEM;
+				f->filesize = t->filesize;
+				memcpy(f->data, t->data, f->filesize);
+				break;
+			}
+		}
+	}
+	return BOOT_OK;
+}
+
+static inline size_t align4(size_t pos) {
+	return (pos + 3) & ~(size_t) 3;
+}
+
+/* Parse a cpio archive in buf and append its entries to v */
+int cpio_vec_parse(const void *buf, size_t size, struct vector *v) {
+	const cpio_newc_header *header;
+	cpio_entry *f;
+	size_t pos = 0;
+	int err = BOOT_OK;
+	while (pos + sizeof(*header) <= size) {
+		header = buf + pos;
+		pos += sizeof(*header);
+		if ((f = calloc(sizeof(*f), 1)) == NULL)
+			return BOOT_ENOMEM;
+		if (x8u(header->ino, &f->ino) || x8u(header->mode, &f->mode) ||
+			x8u(header->uid, &f->uid) || x8u(header->gid, &f->gid) ||
+			x8u(header->nlink, &f->nlink) || x8u(header->filesize, &f->filesize) ||
+			x8u(header->namesize, &f->namesize) || memcmp(header->magic, "07070", 5) ||
+			f->namesize == 0 || pos + f->namesize > size) {
+			err = BOOT_EFORMAT;
+			goto error;
+		}
+		if ((f->filename = malloc(f->namesize)) == NULL) {
+			err = BOOT_ENOMEM;
+			goto error;
+		}
+		memcpy(f->filename, buf + pos, f->namesize);
+		f->filename[f->namesize - 1] = '\0';
+		pos = align4(pos + f->namesize);
+		if (strcmp(f->filename, ".") == 0 || strcmp(f->filename, "..") == 0) {
+			cpio_free(f);
+			continue;
+		}
+		if (strcmp(f->filename, "TRAILER!!!") == 0) {
+			cpio_free(f);
+			break;
+		}
+		if (f->filesize) {
+			if (pos + f->filesize > size) {
+				err = BOOT_EFORMAT;
+				goto error;
+			}
+			if ((f->data = malloc(f->filesize)) == NULL) {
+				err = BOOT_ENOMEM;
+				goto error;
+			}
+			memcpy(f->data, buf + pos, f->filesize);
+			pos = align4(pos + f->filesize);
+		}
+		if (vec_push_back(v, f)) {
+			err = BOOT_ENOMEM;
+			goto error;
+		}
+	}
+	return cpio_unlink(v);
+
+error:
+	cpio_free(f);
+	return err;
+}
+
+typedef struct dedup_node {
+	uint64_t hash;
+	size_t idx;
+	cpio_entry *f;
+} dedup_node;
+
+// FNV-1a, only used to bucket candidates; contents are always compared
+static uint64_t cpio_hash(const void *buf, size_t size) {
+	const unsigned char *p = buf;
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for (size_t i = 0; i < size; ++i) {
+		hash ^= p[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+static int dedup_cmp(const void *a, const void *b) {
+	const dedup_node *m = a, *n = b;
+	if (m->f->filesize != n->f->filesize)
+		return m->f->filesize < n->f->filesize ? -1 : 1;
+	if (m->hash != n->hash)
+		return m->hash < n->hash ? -1 : 1;
+	return m->idx < n->idx ? -1 : (m->idx > n->idx);
+}
+
+/* Group identical regular files into newc hardlink groups: all members share
+ * the inode of the first member, and only the last member (in archive order)
+ * carries the data. Entries in v must already be in dump order with inodes
+ * assigned. Set nodata[i] for members that should be written without data.
+ * Returns the bytes saved. */
+static long long cpio_dedup(struct vector *v, char *nodata) {
+	dedup_node *nodes = malloc(vec_size(v) * sizeof(*nodes) + 1);
+	size_t num = 0, saved = 0;
+	cpio_entry *f;
+	if (nodes == NULL)
+		return BOOT_ENOMEM;
+	vec_for_each(v, f) {
+		if (f->remove || !S_ISREG(f->mode) || f->filesize == 0)
+			continue;
+		nodes[num].hash = cpio_hash(f->data, f->filesize);
+		nodes[num].idx = _;
+		nodes[num].f = f;
+		++num;
+	}
+	qsort(nodes, num, sizeof(*nodes), dedup_cmp);
+
+	for (size_t i = 0, j; i < num; i = j) {
+		// Find the end of the bucket with the same size and hash
+		for (j = i + 1; j < num && nodes[j].hash == nodes[i].hash
+			&& nodes[j].f->filesize == nodes[i].f->filesize; ++j);
+		for (size_t k = i; k < j; ++k) {
+			cpio_entry *head = nodes[k].f;
+			if (head->nlink != 1)
+				continue;
+			size_t last = k;
+			for (size_t l = k + 1; l < j; ++l) {
+				f = nodes[l].f;
+				if (f->nlink == 1 && memcmp(head->data, f->data, f->filesize) == 0) {
+					f->ino = head->ino;
+					++head->nlink;
+					saved += f->filesize;
+					nodata[nodes[last].idx] = 1;
+					last = l;
+				}
+			}
+			// Bucket is sorted by index, so the last member is the last in archive
+			for (size_t l = k + 1; l <= last; ++l) {
+				if (nodes[l].f->ino == head->ino)
+					nodes[l].f->nlink = head->nlink;
+			}
+		}
+	}
+	free(nodes);
+	return saved;
+}
+
+static int write_header(out_stream *out, uint32_t ino, uint32_t mode, uint32_t uid, uint32_t gid,
+						uint32_t nlink, uint32_t filesize, uint32_t namesize) {
+	char header[111];
+	sprintf(header, "070701%08x%08x%08x%08x%08x%08x%08x%08x%08x%08x%08x%08x%08x",
+		ino,
+		mode,
+		uid,
+		gid,
+		nlink,
+		0,			// mtime
+		filesize,
+		0,			// devmajor
+		0,			// devminor
+		0,			// rdevmajor
+		0,			// rdevminor
+		namesize,
+		0			// check
+	);
+	return stream_write(out, header, 110);
+}
+
+static int write_align4(out_stream *out) {
+	static const char zeros[4];
+	return stream_write(out, zeros, align4(out->size) - out->size);
+}
+
+/* Sort v by name and serialize it. The stream has to start at the beginning
+ * of the archive for the padding to be correct. With dedup, identical files
+ * are stored as hardlinks. Returns the bytes saved by dedup, or an error. */
+long long cpio_vec_dump(struct vector *v, out_stream *out, int dedup) {
+	unsigned inode = 300000;
+	long long saved = 0;
+	int err = BOOT_OK;
+	char *nodata = calloc(vec_size(v) + 1, 1);
+	if (nodata == NULL)
+		return BOOT_ENOMEM;
+	// Sort by name
+	vec_sort(v, cpio_cmp);
+	cpio_entry *f;
+	vec_for_each(v, f) {
+		if (f->remove) continue;
+		f->ino = inode++;
+		f->nlink = 1;
+	}
+	if (dedup && (saved = cpio_dedup(v, nodata)) < 0) {
+		err = saved;
+		goto done;
+	}
+	vec_for_each(v, f) {
+		if (f->remove) continue;
+		uint32_t filesize = nodata[_] ? 0 : f->filesize;
+		if ((err = write_header(out, f->ino, f->mode, f->uid, f->gid, f->nlink, filesize, f->namesize)) ||
+			(err = stream_write(out, f->filename, f->namesize)) ||
+			(err = write_align4(out)))
+			goto done;
+		if (filesize) {
+			if ((err = stream_write(out, f->data, filesize)) || (err = write_align4(out)))
+				goto done;
+		}
+	}
+	// Write trailer
+	if ((err = write_header(out, inode++, 0, 0, 0, 1, 0, 11)) ||
+		(err = stream_write(out, "TRAILER!!!\0", 11)) ||
+		(err = write_align4(out)))
+		goto done;
+
+done:
+	free(nodata);
+	return err < 0 ? err : saved;
+}
+
+cpio_entry *cpio_vec_find(struct vector *v, const char *entry) {
+	cpio_entry *f;
+	vec_for_each(v, f) {
+		if (!f->remove && strcmp(f->filename, entry) == 0)
+			return f;
+	}
+	return NULL;
+}
+
+static cpio_entry *cpio_new(mode_t mode, const char *entry) {
+	cpio_entry *f = calloc(sizeof(*f), 1);
+	if (f == NULL)
+		return NULL;
+	f->mode = mode;
+	f->namesize = strlen(entry) + 1;
+	if ((f->filename = strdup(entry)) == NULL) {
+		free(f);
+		return NULL;
+	}
+	return f;
+}
+
+/* Add a regular file with a copy of data, replacing any existing entry */
+int cpio_vec_add(struct vector *v, mode_t mode, const char *entry, const void *data, size_t size) {
+	cpio_entry *f = cpio_new(S_IFREG | mode, entry);
+	if (f == NULL)
+		return BOOT_ENOMEM;
+	if (size) {
+		if ((f->data = malloc(size)) == NULL) {
+			cpio_free(f);
+			return BOOT_ENOMEM;
+		}
+		memcpy(f->data, data, size);
+	}
+	f->filesize = size;
+	return cpio_vec_insert(v, f);
+}
+
+int cpio_vec_mkdir(struct vector *v, mode_t mode, const char *entry) {
+	cpio_entry *f = cpio_new(S_IFDIR | mode, entry);
+	if (f == NULL)
+		return BOOT_ENOMEM;
+	return cpio_vec_insert(v, f);
+}
+
+/* Mark entry (and everything under it if recursive) as removed,
+ * returns the number of entries removed */
+int cpio_vec_rm(struct vector *v, const char *entry, int recursive) {
+	size_t len = strlen(entry);
+	int num = 0;
+	cpio_entry *f;
+	vec_for_each(v, f) {
+		if (strncmp(f->filename, entry, len) == 0) {
+			char next = f->filename[len];
+			if ((recursive && next == '/') || next == '\0') {
+				if (!f->remove) {
+					f->remove = 1;
+					++num;
+				}
+				if (!recursive) break;
+			}
+		}
+	}
+	return num;
+}
+
+int cpio_vec_mv(struct vector *v, const char *from, const char *to) {
+	cpio_entry *f, *t;
+	char *name;
+	if ((f = cpio_vec_find(v, from)) == NULL)
+		return BOOT_ENOENT;
+	if ((name = strdup(to)) == NULL)
+		return BOOT_ENOMEM;
+	if ((t = cpio_vec_find(v, to)) != NULL)
+		t->remove = 1;
+	free(f->filename);
+	f->namesize = strlen(to) + 1;
+	f->filename = name;
+	return BOOT_OK;
+}
@@ -1,4 +1,5 @@
 #include <libfdt.h>
+#include <stdarg.h>
 #include <unistd.h>
 #include <sys/mman.h>
 
@@ -26,58 +27,104 @@ static int find_fstab(const void *fdt, int parent) {
 	return -1;
 }
 
+static void index_file(const void *dtb, size_t size, dtb_table *table) {
+	if (dtb_index(dtb, size, table) < 0)
+		LOGE("Invalid dtb table\n");
+	if (table->qcdt)
+		fprintf(stderr, "QCDT version [%d] with [%d] dtbs\n", table->qcdt, table->num);
+}
+
 void dtb_print(const char *file) {
 	size_t size ;
-	void *dtb, *fdt;
+	void *dtb;
+	dtb_table table;
 	fprintf(stderr, "Loading dtbs from [%s]\n", file);
 	mmap_ro(file, &dtb, &size);
-	// Loop through all the dtbs
-	int dtb_num = 0;
-	for (int i = 0; i < size; ++i) {
-		if (memcmp(dtb + i, DTB_MAGIC, 4) == 0) {
-			fdt = dtb + i;
-			fprintf(stderr, "\nPrinting dtb.%04d\n\n", dtb_num++);
-			print_subnode(fdt, 0, 0);
-		}
+	index_file(dtb, size, &table);
+	for (int i = 0; i < table.num; ++i) {
+		fprintf(stderr, "\nPrinting dtb.%04d\n\n", i);
+		print_subnode(table.blobs[i].fdt, 0, 0);
 	}
 	fprintf(stderr, "\n");
+	dtb_table_free(&table);
 	munmap(dtb, size);
 	exit(0);
 }
 
-void dtb_patch(const char *file) {
-	size_t size ;
-	void *dtb, *fdt;
-	fprintf(stderr, "Loading dtbs from [%s]\n\n", file);
-	mmap_rw(file, &dtb, &size);
-	// Loop through all the dtbs
-	int dtb_num = 0, patched = 0;
-	for (int i = 0; i < size; ++i) {
-		if (memcmp(dtb + i, DTB_MAGIC, 4) == 0) {
-			fdt = dtb + i;
-			int fstab = find_fstab(fdt, 0);
-			if (fstab > 0) {
-				fprintf(stderr, "Found fstab in dtb.%04d\n", dtb_num++);
-				int block;
-				fdt_for_each_subnode(block, fdt, fstab) {
-					fprintf(stderr, "Found block [%s] in fstab\n", fdt_get_name(fdt, block, NULL));
-					int skip, value_size;
-					char *value = (char *) fdt_getprop(fdt, block, "fsmgr_flags", &value_size);
-					for (int i = 0; i < value_size; ++i) {
-						if ((skip = check_verity_pattern(value + i)) > 0) {
-							fprintf(stderr, "Remove pattern [%.*s] in [fsmgr_flags]\n", skip, value + i);
-							memcpy(value + i, value + i + skip, value_size - i - skip);
-							memset(value + value_size - skip, '\0', skip);
-							patched = 1;
-						}
-					}
-				}
+typedef struct fstab_job {
+	int idx;
+	void *fdt;
+	int patched;
+	// Messages are kept until all jobs are done to print them in order
+	out_stream log;
+} fstab_job;
+
+static void job_log(fstab_job *job, const char *fmt, ...) {
+	char buf[256];
+	va_list args;
+	va_start(args, fmt);
+	int len = vsnprintf(buf, sizeof(buf), fmt, args);
+	va_end(args);
+	stream_write(&job->log, buf, len < (int) sizeof(buf) ? len : sizeof(buf) - 1);
+}
+
+static void patch_fstab(void *arg) {
+	fstab_job *job = arg;
+	void *fdt = job->fdt;
+	// The fstab is almost always at its standard path
+	int fstab = fdt_path_offset(fdt, "/firmware/android/fstab");
+	if (fstab < 0)
+		fstab = find_fstab(fdt, 0);
+	if (fstab < 0)
+		return;
+	job_log(job, "Found fstab in dtb.%04d\n", job->idx);
+	int block;
+	fdt_for_each_subnode(block, fdt, fstab) {
+		job_log(job, "Found block [%s] in fstab\n", fdt_get_name(fdt, block, NULL));
+		int skip, value_size;
+		char *value = (char *) fdt_getprop(fdt, block, "fsmgr_flags", &value_size);
+		for (int i = 0; i < value_size; ++i) {
+			if ((skip = check_verity_pattern(value + i)) > 0) {
+				job_log(job, "Remove pattern [%.*s] in [fsmgr_flags]\n", skip, value + i);
+				memcpy(value + i, value + i + skip, value_size - i - skip);
+				memset(value + value_size - skip, '\0', skip);
+				job->patched = 1;
 			}
 		}
 	}
+}
+
+/* Remove verity flags from the fstab in every dtb, returns 1 if anything was patched.
+ * Every dtb is patched in place on its own, so they are all done concurrently */
+int dtb_patch_mem(void *dtb, size_t size) {
+	dtb_table table;
+	int patched = 0;
+	if (dtb_index(dtb, size, &table) < 0 || table.num == 0)
+		return 0;
+	fstab_job *jobs = xcalloc(table.num, sizeof(*jobs));
+	for (int i = 0; i < table.num; ++i) {
+		jobs[i].idx = i;
+		jobs[i].fdt = table.blobs[i].fdt;
+		mem_stream(&jobs[i].log);
+	}
+	parallel_for(jobs, sizeof(*jobs), table.num, patch_fstab);
+	for (int i = 0; i < table.num; ++i) {
+		fwrite(jobs[i].log.buf, 1, jobs[i].log.size, stderr);
+		free(jobs[i].log.buf);
+		patched |= jobs[i].patched;
+	}
 	fprintf(stderr, "\n");
+	free(jobs);
+	dtb_table_free(&table);
+	return patched;
+}
+
+void dtb_patch(const char *file) {
+	size_t size ;
+	void *dtb;
+	fprintf(stderr, "Loading dtbs from [%s]\n\n", file);
+	mmap_rw(file, &dtb, &size);
+	int patched = dtb_patch_mem(dtb, size);
 	munmap(dtb, size);
 	exit(!patched);
 }
-
-
@@ -0,0 +1,109 @@
+/* dtb_index.c - Locate the device tree blobs in a dtb table
+ *
+ * A table is either a plain concatenation of blobs, as in appended-dtb
+ * kernels and dtb files, or a QCDT (dt.img) with a header and entries
+ * pointing to the blobs. Blobs are walked by their totalsize, so the data
+ * inside a blob is never searched for the magic.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "magiskboot.h"
+#include "utils.h"
+
+#define FDT_HEADER_SIZE   40
+
+#define QCDT_MAGIC        "QCDT"
+#define QCDT_HEADER_SIZE  12
+
+static uint32_t be32(const void *p) {
+	const uint8_t *b = p;
+	return (uint32_t) b[0] << 24 | b[1] << 16 | b[2] << 8 | b[3];
+}
+
+static uint32_t le32(const void *p) {
+	const uint8_t *b = p;
+	return (uint32_t) b[3] << 24 | b[2] << 16 | b[1] << 8 | b[0];
+}
+
+/* Returns the totalsize of the blob at buf, or 0 if it is not a valid blob */
+static uint32_t fdt_valid(const void *buf, size_t size) {
+	if (size < FDT_HEADER_SIZE || memcmp(buf, DTB_MAGIC, 4) != 0)
+		return 0;
+	uint32_t total = be32(buf + 4), dt_struct = be32(buf + 8), dt_strings = be32(buf + 12),
+			 rsvmap = be32(buf + 16);
+	if (total < FDT_HEADER_SIZE || total > size || dt_struct >= total ||
+		dt_strings > total || rsvmap >= total)
+		return 0;
+	return total;
+}
+
+static int add_blob(dtb_table *table, const void *fdt, uint32_t size) {
+	struct dtb_blob *blobs = realloc(table->blobs, (table->num + 1) * sizeof(*blobs));
+	if (blobs == NULL)
+		return BOOT_ENOMEM;
+	table->blobs = blobs;
+	blobs[table->num].fdt = (void *) fdt;
+	blobs[table->num].size = size;
+	++table->num;
+	return BOOT_OK;
+}
+
+/* Entries are 5, 6 or 10 words for versions 1 to 3, the last two are the
+ * offset and size of the blob. Boards sharing a blob have the same offset */
+static int index_qcdt(const void *buf, size_t size, dtb_table *table) {
+	static const size_t entry_size[] = { 0, 20, 24, 40 };
+	uint32_t version = le32(buf + 4), num = le32(buf + 8);
+	if (version < 1 || version > 3 || QCDT_HEADER_SIZE + (size_t) num * entry_size[version] > size)
+		return BOOT_EFORMAT;
+	table->qcdt = version;
+	for (uint32_t i = 0; i < num; ++i) {
+		const void *entry = buf + QCDT_HEADER_SIZE + i * entry_size[version];
+		uint32_t off = le32(entry + entry_size[version] - 8), len = le32(entry + entry_size[version] - 4);
+		if (off >= size || len > size - off || fdt_valid(buf + off, len) == 0)
+			return BOOT_EFORMAT;
+		int dup = 0;
+		for (int j = 0; j < table->num && !dup; ++j)
+			dup = table->blobs[j].fdt == buf + off;
+		if (!dup && add_blob(table, buf + off, fdt_valid(buf + off, len)) < 0)
+			return BOOT_ENOMEM;
+	}
+	return BOOT_OK;
+}
+
+int dtb_index(const void *buf, size_t size, dtb_table *table) {
+	int err = BOOT_OK;
+	memset(table, 0, sizeof(*table));
+	if (size >= QCDT_HEADER_SIZE && memcmp(buf, QCDT_MAGIC, 4) == 0) {
+		err = index_qcdt(buf, size, table);
+	} else {
+		// Only the padding between blobs is searched
+		for (size_t pos = 0; pos < size;) {
+			const void *fdt = memfind(buf + pos, size - pos, DTB_MAGIC, 4);
+			if (fdt == NULL)
+				break;
+			uint32_t total = fdt_valid(fdt, buf + size - fdt);
+			pos = fdt - buf + (total ? total : 1);
+			if (total && (err = add_blob(table, fdt, total)) < 0)
+				break;
+		}
+	}
+	if (err < 0)
+		dtb_table_free(table);
+	return err;
+}
+
+void dtb_table_free(dtb_table *table) {
+	free(table->blobs);
+	table->blobs = NULL;
+	table->num = 0;
+}
+
+void *dtb_find(const void *buf, size_t size) {
+	for (const void *fdt = buf; (fdt = memfind(fdt, buf + size - fdt, DTB_MAGIC, 4)); ++fdt) {
+		if (fdt_valid(fdt, buf + size - fdt))
+			return (void *) fdt;
+	}
+	return NULL;
+}
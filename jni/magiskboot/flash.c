@@ -0,0 +1,142 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+#include "magiskboot.h"
+#include "utils.h"
+#include "hash.h"
+
+// Read the partition in large blocks, compare and write in chunks
+#define FLASH_BUF_SIZE  (1 << 20)
+#define FLASH_ALIGN     4096
+#define DEFAULT_CHUNK   4096
+
+/* Compare in page_size chunks for boot images, anything else in 4K chunks */
+static size_t chunk_size(const void *image, size_t size) {
+	const boot_img_hdr *hdr = image;
+	if (size >= sizeof(*hdr) && memcmp(hdr->magic, BOOT_MAGIC, BOOT_MAGIC_SIZE) == 0
+		&& hdr->page_size >= 512 && (hdr->page_size & (hdr->page_size - 1)) == 0
+		&& FLASH_BUF_SIZE % hdr->page_size == 0)
+		return hdr->page_size;
+	return DEFAULT_CHUNK;
+}
+
+static inline size_t min_size(size_t a, size_t b) {
+	return a < b ? a : b;
+}
+
+/* Read size bytes at off. O_DIRECT needs an aligned length, reads
+ * at the end of the device simply return less than requested. */
+static void xxread_at(int fd, void *buf, size_t size, size_t off, const char *name) {
+	size_t aligned = (size + FLASH_ALIGN - 1) & ~(size_t) (FLASH_ALIGN - 1);
+	ssize_t len = pread(fd, buf, aligned, off);
+	if (len < (ssize_t) size)
+		PLOGE("read %s", name);
+}
+
+/* Expected content at off: the image, then zeros till the end of the partition */
+static void expected(const void *image, size_t size, size_t off, void *buf, size_t len) {
+	size_t copy = off < size ? size - off : 0;
+	if (copy > len)
+		copy = len;
+	memcpy(buf, image + off, copy);
+	memset(buf + copy, 0, len - copy);
+}
+
+/* Write image to blockdev, skipping chunks that already have the same content.
+ * The rest of the partition is cleared like flashing with dd from /dev/zero,
+ * and the image is read back and verified by its SHA1 afterwards. */
+void flash(const char *image, const char *blockdev) {
+	void *img, *buf, *want;
+	size_t img_size, dev_size, chunk, changed = 0, total = 0, written = 0;
+	struct timespec start;
+
+	load_image(image, &img, &img_size);
+	chunk = chunk_size(img, img_size);
+
+	// Bypass the page cache on block devices so verification reads the flash
+	struct stat st;
+	xstat(blockdev, &st);
+	int is_blk = S_ISBLK(st.st_mode);
+	int fd = xopen(blockdev, O_RDWR | O_CLOEXEC | (is_blk ? O_DIRECT : 0));
+	if (is_blk) {
+		dev_size = lseek(fd, 0, SEEK_END);
+		// O_DIRECT writes must cover whole logical blocks, e.g. 4K on UFS
+		int lbs;
+		if (ioctl(fd, BLKSSZGET, &lbs) == 0 && lbs > 0 && (size_t) lbs > chunk) {
+			if ((lbs & (lbs - 1)) || lbs > FLASH_ALIGN)
+				LOGE("Unsupported logical block size [%d] of %s\n", lbs, blockdev);
+			chunk = lbs;
+		}
+	} else {
+		// Regular files are simply made identical to the image
+		dev_size = img_size;
+		if (ftruncate(fd, img_size))
+			PLOGE("ftruncate %s", blockdev);
+	}
+	if (img_size > dev_size)
+		LOGE("Image [%zu] is larger than %s [%zu]\n", img_size, blockdev, dev_size);
+
+	if (posix_memalign(&buf, FLASH_ALIGN, FLASH_BUF_SIZE) ||
+		posix_memalign(&want, FLASH_ALIGN, FLASH_BUF_SIZE))
+		LOGE("Cannot allocate flash buffer\n");
+
+	fprintf(stderr, "Flashing [%s] to [%s] in %zu bytes chunks\n\n", image, blockdev, chunk);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (size_t off = 0; off < dev_size; off += FLASH_BUF_SIZE) {
+		size_t block = min_size(dev_size - off, FLASH_BUF_SIZE);
+		xxread_at(fd, buf, block, off, blockdev);
+		expected(img, img_size, off, want, block);
+
+		// Write runs of consecutive differing chunks at once
+		for (size_t pos = 0, end, n; pos < block; pos = end) {
+			n = min_size(block - pos, chunk);
+			if (memcmp(buf + pos, want + pos, n) == 0) {
+				end = pos + n;
+				continue;
+			}
+			end = pos;
+			do {
+				++changed;
+				end += n;
+				n = min_size(block - end, chunk);
+			} while (end < block && memcmp(buf + end, want + end, n));
+			if (pwrite(fd, want + pos, end - pos, off + pos) != (ssize_t) (end - pos))
+				PLOGE("write %s", blockdev);
+			written += end - pos;
+		}
+		total += (block + chunk - 1) / chunk;
+	}
+
+	if (fsync(fd) < 0)
+		PLOGE("fsync %s", blockdev);
+
+	fprintf(stderr, "FLASH [%zu/%zu chunks] [%zu bytes] [%.1f ms]\n",
+			changed, total, written, elapsed_ms(&start));
+
+	// Read back the image region and verify
+	unsigned char digest[SHA1_DIGEST_SIZE], verify[SHA1_DIGEST_SIZE];
+	hash_ctx ctx;
+	hash_buf(img, img_size, HASH_SHA1, digest);
+	hash_init(&ctx, HASH_SHA1);
+	for (size_t off = 0; off < img_size; off += FLASH_BUF_SIZE) {
+		size_t block = min_size(img_size - off, FLASH_BUF_SIZE);
+		xxread_at(fd, buf, block, off, blockdev);
+		hash_update(&ctx, HASH_SHA1, buf, block);
+	}
+	hash_final(&ctx, HASH_SHA1, verify);
+	if (memcmp(digest, verify, sizeof(digest)))
+		LOGE("Verification failed: %s does not match [%s]\n", blockdev, image);
+	fprintf(stderr, "VERIFY [OK]\n");
+
+	free(buf);
+	free(want);
+	munmap(img, img_size);
+	close(fd);
+}
@@ -0,0 +1,193 @@
+/* hash.c - SHA1/SHA256 dispatching and streaming file hashing
+ *
+ * The block functions are resolved once to the hardware accelerated
+ * implementations in sha_accel.c (SHA-NI on x86, Crypto Extensions on arm64)
+ * when the CPU reports support, or the portable C transforms otherwise.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+
+#if defined(__i386__) || defined(__x86_64__)
+#include <cpuid.h>
+#define HAVE_SHA_ACCEL
+#elif defined(__aarch64__)
+#include <sys/auxv.h>
+#define HAVE_SHA_ACCEL
+#ifndef HWCAP_SHA1
+#define HWCAP_SHA1  (1 << 5)
+#endif
+#ifndef HWCAP_SHA2
+#define HWCAP_SHA2  (1 << 6)
+#endif
+#endif
+
+#include "magiskboot.h"
+#include "hash.h"
+
+// Large reads keep syscall overhead negligible on block devices
+#define HASH_BUF_SIZE  (4 << 20)
+#define HASH_BUF_ALIGN 4096
+
+typedef void (*blocks_fn)(uint32_t *state, const unsigned char *data, size_t blocks);
+
+static void sha1_blocks_c(uint32_t *state, const unsigned char *data, size_t blocks) {
+	for (; blocks; --blocks, data += 64)
+		SHA1Transform(state, data);
+}
+
+static void sha256_blocks_c(uint32_t *state, const unsigned char *data, size_t blocks) {
+	for (; blocks; --blocks, data += 64)
+		SHA256Transform(state, data);
+}
+
+#ifdef HAVE_SHA_ACCEL
+
+#if defined(__i386__) || defined(__x86_64__)
+static int cpu_has_sha1() {
+	unsigned a, b, c, d;
+	if (__get_cpuid_max(0, NULL) < 7)
+		return 0;
+	__cpuid_count(7, 0, a, b, c, d);
+	// SHA extensions
+	if (!(b & (1 << 29)))
+		return 0;
+	__cpuid(1, a, b, c, d);
+	// SSSE3 and SSE4.1 are also used
+	return (c & (1 << 9)) && (c & (1 << 19));
+}
+#define cpu_has_sha256 cpu_has_sha1
+#else
+static int cpu_has_sha1() {
+	return (getauxval(AT_HWCAP) & HWCAP_SHA1) != 0;
+}
+static int cpu_has_sha256() {
+	return (getauxval(AT_HWCAP) & HWCAP_SHA2) != 0;
+}
+#endif
+
+static blocks_fn resolve_sha1() {
+	return cpu_has_sha1() ? (blocks_fn) sha1_blocks_accel : sha1_blocks_c;
+}
+
+static blocks_fn resolve_sha256() {
+	return cpu_has_sha256() ? (blocks_fn) sha256_blocks_accel : sha256_blocks_c;
+}
+
+#else
+
+#define resolve_sha1()   sha1_blocks_c
+#define resolve_sha256() sha256_blocks_c
+
+#endif
+
+// Resolved once, hashing may start from several parallel_for workers at a time
+static blocks_fn sha1_impl, sha256_impl;
+static pthread_once_t impl_once = PTHREAD_ONCE_INIT;
+
+static void resolve_impl() {
+	sha1_impl = resolve_sha1();
+	sha256_impl = resolve_sha256();
+}
+
+void sha1_blocks(uint32_t state[5], const unsigned char *data, size_t blocks) {
+	if (blocks == 0)
+		return;
+	pthread_once(&impl_once, resolve_impl);
+	sha1_impl(state, data, blocks);
+}
+
+void sha256_blocks(uint32_t state[8], const unsigned char *data, size_t blocks) {
+	if (blocks == 0)
+		return;
+	pthread_once(&impl_once, resolve_impl);
+	sha256_impl(state, data, blocks);
+}
+
+void hash_init(hash_ctx *ctx, hash_t type) {
+	if (type == HASH_SHA1)
+		SHA1Init(&ctx->sha1);
+	else
+		SHA256Init(&ctx->sha256);
+}
+
+void hash_update(hash_ctx *ctx, hash_t type, const void *buf, size_t size) {
+	// The contexts take 32-bit lengths
+	for (size_t len; size; size -= len, buf = (const char *) buf + len) {
+		len = size > HASH_BUF_SIZE ? HASH_BUF_SIZE : size;
+		if (type == HASH_SHA1)
+			SHA1Update(&ctx->sha1, buf, len);
+		else
+			SHA256Update(&ctx->sha256, buf, len);
+	}
+}
+
+void hash_final(hash_ctx *ctx, hash_t type, unsigned char *digest) {
+	if (type == HASH_SHA1)
+		SHA1Final(digest, &ctx->sha1);
+	else
+		SHA256Final(digest, &ctx->sha256);
+}
+
+size_t digest_size(hash_t type) {
+	return type == HASH_SHA1 ? SHA1_DIGEST_SIZE : SHA256_DIGEST_SIZE;
+}
+
+void hash_buf(const void *buf, size_t size, hash_t type, unsigned char *digest) {
+	hash_ctx ctx;
+	hash_init(&ctx, type);
+	hash_update(&ctx, type, buf, size);
+	hash_final(&ctx, type, digest);
+}
+
+/* Hash a file or block device by streaming it through an aligned buffer */
+int hash_file(const char *filename, hash_t type, unsigned char *digest) {
+	hash_ctx ctx;
+	ssize_t len;
+	void *buf;
+	int fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return BOOT_EIO;
+	if (posix_memalign(&buf, HASH_BUF_ALIGN, HASH_BUF_SIZE)) {
+		close(fd);
+		return BOOT_ENOMEM;
+	}
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	hash_init(&ctx, type);
+	while ((len = read(fd, buf, HASH_BUF_SIZE)) != 0) {
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len < 0)
+			break;
+		hash_update(&ctx, type, buf, len);
+	}
+	hash_final(&ctx, type, digest);
+	free(buf);
+	close(fd);
+	return len < 0 ? BOOT_EIO : BOOT_OK;
+}
+
+void print_digest(const unsigned char *digest, size_t size) {
+	for (size_t i = 0; i < size; ++i)
+		printf("%02x", digest[i]);
+	printf("\n");
+}
+
+void sink_init(hash_sink *sink, out_stream *out, hash_t type) {
+	sink->out = out;
+	sink->type = type;
+	hash_init(&sink->ctx, type);
+}
+
+int sink_write(hash_sink *sink, const void *buf, size_t size) {
+	hash_update(&sink->ctx, sink->type, buf, size);
+	return stream_write(sink->out, buf, size);
+}
+
+void sink_final(hash_sink *sink, unsigned char *digest) {
+	hash_final(&sink->ctx, sink->type, digest);
+}
@@ -0,0 +1,55 @@
+#ifndef _HASH_H_
+#define _HASH_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "libmagiskboot.h"
+#include "sha1.h"
+#include "sha256.h"
+
+typedef enum {
+	HASH_SHA1,
+	HASH_SHA256
+} hash_t;
+
+#define SHA1_DIGEST_SIZE    20
+#define SHA256_DIGEST_SIZE  32
+#define MAX_DIGEST_SIZE     SHA256_DIGEST_SIZE
+
+extern const uint32_t SHA256_K[64];
+
+// Process whole 64 byte blocks, using CPU instructions when available
+void sha1_blocks(uint32_t state[5], const unsigned char *data, size_t blocks);
+void sha256_blocks(uint32_t state[8], const unsigned char *data, size_t blocks);
+
+// sha_accel.c, only call when the CPU supports it
+void sha1_blocks_accel(uint32_t state[5], const unsigned char *data, size_t blocks);
+void sha256_blocks_accel(uint32_t state[8], const unsigned char *data, size_t blocks);
+
+typedef union hash_ctx {
+	SHA1_CTX sha1;
+	SHA256_CTX sha256;
+} hash_ctx;
+
+/* A hashing sink writes everything to out while feeding it to ctx,
+ * so the digest is ready once the last byte is written */
+typedef struct hash_sink {
+	out_stream *out;
+	hash_t type;
+	hash_ctx ctx;
+} hash_sink;
+
+size_t digest_size(hash_t type);
+void hash_init(hash_ctx *ctx, hash_t type);
+void hash_update(hash_ctx *ctx, hash_t type, const void *buf, size_t size);
+void hash_final(hash_ctx *ctx, hash_t type, unsigned char *digest);
+int hash_file(const char *filename, hash_t type, unsigned char *digest);
+void hash_buf(const void *buf, size_t size, hash_t type, unsigned char *digest);
+void print_digest(const unsigned char *digest, size_t size);
+
+void sink_init(hash_sink *sink, out_stream *out, hash_t type);
+int sink_write(hash_sink *sink, const void *buf, size_t size);
+void sink_final(hash_sink *sink, unsigned char *digest);
+
+#endif
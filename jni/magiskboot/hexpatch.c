@@ -1,4 +1,5 @@
 #include <stdlib.h>
+#include <stdint.h>
 #include <ctype.h>
 #include <string.h>
 #include <sys/mman.h>
@@ -6,33 +7,122 @@
 #include "magiskboot.h"
 #include "utils.h"
 
-static void hex2byte(const char *hex, unsigned char *str) {
-	char high, low;
-	for (int i = 0, length = strlen(hex); i < length; i += 2) {
-		high = toupper(hex[i]) - '0';
-		low = toupper(hex[i + 1]) - '0';
-		str[i / 2] = ((high > 9 ? high - 7 : high) << 4) + (low > 9 ? low - 7 : low);
+#define MAX_PATCHES 32
+
+typedef struct hex_patch {
+	const char *from, *to;
+	unsigned char *pattern, *patch;
+	size_t pattern_size, patch_size;
+	int count;
+} hex_patch;
+
+static int hexval(char c) {
+	if (c >= '0' && c <= '9') return c - '0';
+	c = toupper(c);
+	if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+	return -1;
+}
+
+static unsigned char *hex2byte(const char *hex, size_t *size) {
+	size_t length = strlen(hex);
+	if (length == 0 || length % 2)
+		LOGE("Invalid hex pattern [%s]: odd or empty length\n", hex);
+	unsigned char *str = xmalloc(length / 2);
+	for (size_t i = 0; i < length; i += 2) {
+		int high = hexval(hex[i]), low = hexval(hex[i + 1]);
+		if (high < 0 || low < 0)
+			LOGE("Invalid hex pattern [%s]: bad character at %zu\n", hex, high < 0 ? i : i + 1);
+		str[i / 2] = (high << 4) | low;
 	}
+	*size = length / 2;
+	return str;
 }
 
-void hexpatch(const char *image, const char *from, const char *to) {
-	int patternsize = strlen(from) / 2, patchsize = strlen(to) / 2;
-	size_t filesize;
-	void *file, *pattern, *patch;
-	mmap_rw(image, &file, &filesize);
-	pattern = xmalloc(patternsize);
-	patch = xmalloc(patchsize);
-	hex2byte(from, pattern);
-	hex2byte(to, patch);
-	for (size_t i = 0; filesize > 0 && i < filesize - patternsize; ++i) {
-		if (memcmp(file + i, pattern, patternsize) == 0) {
-			fprintf(stderr, "Pattern %s found!\nPatching to %s\n", from, to);
-			memset(file + i, 0, patternsize);
-			memcpy(file + i, patch, patchsize);
-			i += patternsize - 1;
+/* Search all patterns in a single pass with a set-Horspool scan: the window is
+ * as long as the shortest pattern, and it is shifted based on the last byte of
+ * the window. Patterns are matched against the original content, and matches
+ * never overlap; when several patterns match at the same offset, the first one
+ * in the list wins. Returns the number of matches. */
+int hexpatch_mem(void *file, size_t filesize, int dry_run, int num, char *pairs[]) {
+	hex_patch patches[MAX_PATCHES];
+	size_t shift[256], min_size = SIZE_MAX;
+	uint32_t last[256] = { 0 };
+	int total = 0;
+
+	num /= 2;
+	if (num > MAX_PATCHES)
+		LOGE("Too many patterns, at most %d are supported\n", MAX_PATCHES);
+
+	for (int i = 0; i < num; ++i) {
+		hex_patch *p = &patches[i];
+		p->from = pairs[i * 2];
+		p->to = pairs[i * 2 + 1];
+		p->pattern = hex2byte(p->from, &p->pattern_size);
+		p->patch = hex2byte(p->to, &p->patch_size);
+		p->count = 0;
+		if (p->patch_size > p->pattern_size)
+			LOGE("Replacement [%s] is longer than pattern [%s]\n", p->to, p->from);
+		if (p->pattern_size < min_size)
+			min_size = p->pattern_size;
+	}
+
+	// Build the shift table and the candidates for each window end byte
+	for (int c = 0; c < 256; ++c)
+		shift[c] = min_size;
+	for (int i = 0; i < num; ++i) {
+		for (size_t j = 0; j < min_size - 1; ++j) {
+			unsigned char c = patches[i].pattern[j];
+			if (min_size - 1 - j < shift[c])
+				shift[c] = min_size - 1 - j;
 		}
+		last[patches[i].pattern[min_size - 1]] |= 1U << i;
 	}
-	munmap(file, filesize);
-	free(pattern);
-	free(patch);
+
+	unsigned char *buf = file;
+	for (size_t pos = 0; file && pos + min_size <= filesize;) {
+		unsigned char c = buf[pos + min_size - 1];
+		hex_patch *p = NULL;
+		for (uint32_t cand = last[c]; cand; cand &= cand - 1) {
+			hex_patch *t = &patches[__builtin_ctz(cand)];
+			if (pos + t->pattern_size <= filesize
+				&& memcmp(buf + pos, t->pattern, t->pattern_size) == 0) {
+				p = t;
+				break;
+			}
+		}
+		if (p == NULL) {
+			pos += shift[c];
+			continue;
+		}
+		fprintf(stderr, "Pattern %s found at 0x%08zx!\n", p->from, pos);
+		if (!dry_run) {
+			fprintf(stderr, "Patching to %s\n", p->to);
+			memset(buf + pos, 0, p->pattern_size);
+			memcpy(buf + pos, p->patch, p->patch_size);
+		}
+		++p->count;
+		++total;
+		pos += p->pattern_size;
+	}
+
+	for (int i = 0; i < num; ++i) {
+		if (patches[i].count == 0)
+			fprintf(stderr, "Pattern %s not found\n", patches[i].from);
+		free(patches[i].pattern);
+		free(patches[i].patch);
+	}
+	return total;
+}
+
+void hexpatch(const char *image, int dry_run, int num, char *pairs[]) {
+	void *file;
+	size_t filesize;
+	if (dry_run)
+		mmap_ro(image, &file, &filesize);
+	else
+		mmap_rw(image, &file, &filesize);
+	int total = hexpatch_mem(file, filesize, dry_run, num, pairs);
+	fprintf(stderr, "%s [%d] patterns in [%s]\n", dry_run ? "Found" : "Patched", total, image);
+	if (file)
+		munmap(file, filesize);
 }
@@ -2,9 +2,11 @@
 #define _MAGISKBOOT_H_
 
 #include <sys/types.h>
+#include <time.h>
 
 #include "logging.h"
 #include "bootimg.h"
+#include "libmagiskboot.h"
 
 #define KERNEL_FILE     "kernel"
 #define RAMDISK_FILE    "ramdisk.cpio"
@@ -12,33 +14,82 @@
 #define EXTRA_FILE      "extra"
 #define DTB_FILE        "dtb"
 #define NEW_BOOT        "new-boot.img"
+#define MANIFEST_FILE   "manifest"
+
+// Components for unpack, 0 means all
+#define UNPACK_KERNEL   (1 << BOOT_KERNEL)
+#define UNPACK_RAMDISK  (1 << BOOT_RAMDISK)
+#define UNPACK_SECOND   (1 << BOOT_SECOND)
+#define UNPACK_DTB      (1 << BOOT_DTB)
+#define UNPACK_EXTRA    (1 << BOOT_EXTRA)
+#define UNPACK_ALL      ((1 << BOOT_COMPONENT_NUM) - 1)
+
+// Return values of patch_boot, the same as unpack where they overlap
+#define PATCH_FAILED    1
+#define PATCH_CHROMEOS  2
+#define PATCH_ELF32     3
+#define PATCH_ELF64     4
+#define PATCH_OTHER     5
+#define PATCH_NORESTORE 6
+
+typedef struct patch_opts {
+	int keepverity;
+	int keepforceencrypt;
+	// Continue if a Magisk patched ramdisk cannot be restored
+	int force;
+	// <mode> <entry> <file> triplets to add to the ramdisk
+	int num_add;
+	char **adds;
+} patch_opts;
+
+typedef struct patch_result {
+	// stock, magisk, other or unknown
+	const char *status;
+	// SHA1 of the stock boot image, if known
+	char sha1[41];
+	double time;
+} patch_result;
 
 // Main entries
-void unpack(const char *image);
-void repack(const char* orig_image, const char* out_image);
-void hexpatch(const char *image, const char *from, const char *to);
+int map_image(const char *image, void **buf, size_t *size);
+void load_image(const char *image, void **buf, size_t *size);
+void unpack(const char *image, unsigned only);
+void boot_info(const char *image);
+void repack(const char* orig_image, const char* out_image, int sparse);
+void hexpatch(const char *image, int dry_run, int num, char *pairs[]);
+int hexpatch_mem(void *buf, size_t size, int dry_run, int num, char *pairs[]);
+int patch_parse_opts(int argc, char *argv[], patch_opts *opts);
+int patch_boot(const char *image, const char *out_image, const patch_opts *opts, patch_result *res);
+void batch(const char *manifest);
+void flash(const char *image, const char *blockdev);
 int parse_img(void *orig, size_t size, boot_img *boot);
 int cpio_commands(const char *command, int argc, char *argv[]);
 void comp_file(const char *method, const char *from, const char *to);
 void decomp_file(char *from, const char *to);
 void dtb_print(const char *file);
 void dtb_patch(const char *file);
+int dtb_patch_mem(void *dtb, size_t size);
 
 // Compressions
-size_t gzip(int mode, int fd, const void *buf, size_t size);
-size_t lzma(int mode, int fd, const void *buf, size_t size);
-size_t lz4(int mode, int fd, const void *buf, size_t size);
-size_t bzip2(int mode, int fd, const void *buf, size_t size);
-size_t lz4_legacy(int mode, int fd, const void *buf, size_t size);
+long long gzip(int mode, out_stream *out, const void *buf, size_t size);
+long long lzma(int mode, out_stream *out, const void *buf, size_t size);
+long long lz4(int mode, out_stream *out, const void *buf, size_t size);
+long long bzip2(int mode, out_stream *out, const void *buf, size_t size);
+long long lz4_legacy(int mode, out_stream *out, const void *buf, size_t size);
+// Same as boot_(de)compress to a fd, but exit on errors
 long long comp(file_t type, int to, const void *from, size_t size);
 long long decomp(file_t type, int to, const void *from, size_t size);
 
+// Cache of decompressed components
+void cache_decomp(file_t type, const void *buf, size_t size, const char *to);
+void cache_report();
+
 // Utils
-extern void write_zero(int fd, size_t size);
 extern void mem_align(size_t *pos, size_t align);
-extern void file_align(int fd, size_t align, int out);
 extern int open_new(const char *filename);
 extern int check_verity_pattern(const char *s);
 extern int check_encryption_pattern(const char *s);
+extern void parallel_for(void *jobs, size_t job_size, int num, void (*func)(void *));
+extern double elapsed_ms(const struct timespec *start);
 
 #endif
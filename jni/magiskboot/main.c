@@ -6,30 +6,92 @@
 
 #include "magiskboot.h"
 #include "utils.h"
-#include "sha1.h"
+#include "hash.h"
 
 /********************
   Patch Boot Image
 *********************/
 
+static unsigned parse_components(char *list) {
+	static const char *names[] = { "kernel", "ramdisk", "second", "dtb", "extra", NULL };
+	unsigned only = 0;
+	for (char *tok = strtok(list, ","); tok; tok = strtok(NULL, ",")) {
+		int i;
+		for (i = 0; names[i] && strcmp(tok, names[i]) != 0; ++i);
+		if (names[i] == NULL)
+			LOGE("Unknown component [%s]\n", tok);
+		only |= 1 << i;
+	}
+	return only;
+}
+
+static void patch_cmd(int argc, char *argv[]) {
+	patch_opts opts;
+	patch_result res;
+	if (patch_parse_opts(argc - 2, argv + 2, &opts))
+		exit(1);
+	fprintf(stderr, "Patching boot image: [%s] -> [%s]\n\n", argv[0], argv[1]);
+	int ret = patch_boot(argv[0], argv[1], &opts, &res);
+	if (strcmp(res.status, "unknown") != 0)
+		printf("%s %s\n", res.status, res.sha1);
+	fprintf(stderr, "\nPATCH_TOTAL [%.1f ms]\n", res.time);
+	free(opts.adds);
+	exit(ret);
+}
+
 static void usage(char *arg0) {
 	fprintf(stderr,
 		"Usage: %s <action> [args...]\n"
 		"\n"
 		"Supported actions:\n"
-		" --unpack <bootimg>\n"
+		" --unpack [--only=<list>] <bootimg>\n"
 		"  Unpack <bootimg> to kernel, ramdisk.cpio, (second), (dtb) into the\n"
-		"  current directory\n"
+		"  current directory, and record checksums of the decompressed files\n"
+		"  in manifest\n"
+		"  --only takes a comma separated list of components to extract:\n"
+		"  kernel, ramdisk, second, dtb, extra\n"
+		"  Android sparse images are expanded in memory first, the same goes for\n"
+		"  the images taken by --info, --repack, --patch and --flash\n"
 		"\n"
-		" --repack <origbootimg> [outbootimg]\n"
+		" --info <bootimg>\n"
+		"  Print the header and component formats of <bootimg> as JSON to stdout\n"
+		"  without extracting anything. Return value is the same as --unpack\n"
+		"\n"
+		" --repack [--sparse] <origbootimg> [outbootimg]\n"
 		"  Repack kernel, ramdisk.cpio[.ext], second, dtb... from current directory\n"
 		"  to [outbootimg], or new-boot.img if not specified.\n"
 		"  It will compress ramdisk.cpio with the same method used in <origbootimg>\n"
 		"  if exists, or attempt to find ramdisk.cpio.[ext], and repack\n"
 		"  directly with the compressed ramdisk file\n"
+		"  Kernel and ramdisk.cpio unchanged since --unpack (according to manifest)\n"
+		"  are not recompressed, the original data in <origbootimg> is reused\n"
+		"  With --sparse, [outbootimg] is written as an Android sparse image, runs\n"
+		"  of zero blocks become zero FILL chunks\n"
+		"\n"
+		" --patch <bootimg> <outbootimg> [--keepverity] [--keepforceencrypt] [--force]\n"
+		"         [--add <mode> <entry> <infile>]...\n"
+		"  Apply the Magisk ramdisk, dtb and kernel patches to <bootimg> in memory\n"
+		"  and write the result to <outbootimg>, the same as boot_patch.sh does\n"
+		"  with unpack, cpio commands, dtb-patch, hexpatch and repack\n"
+		"  Prints <stock|magisk> <stock SHA1> to stdout\n"
+		"  Return value: 0/OK 1/error 2/ChromeOS 3/ELF32 4/ELF64\n"
+		"  5/patched by other programs 6/cannot restore ramdisk (unless --force)\n"
+		"\n"
+		" --batch <manifest>\n"
+		"  Run --patch for every line of <manifest> concurrently. Each line is\n"
+		"  <bootimg> <outdir> [patch options...], the result is <outdir>/new-boot.img\n"
+		"  Empty lines and lines starting with # are ignored\n"
+		"  Return value: 0 if all images were patched, 1 otherwise\n"
 		"\n"
-		" --hexpatch <file> <hexpattern1> <hexpattern2>\n"
-		"  Search <hexpattern1> in <file>, and replace with <hexpattern2>\n"
+		" --flash <image> <blockdev>\n"
+		"  Write <image> to <blockdev>, only writing chunks (page_size for boot images)\n"
+		"  that differ from the current content. The rest of <blockdev> is zeroed,\n"
+		"  and the written data is read back and verified with SHA1\n"
+		"\n"
+		" --hexpatch <file> [-n] <hexpattern1> <hexpattern2> [<hexpattern1> <hexpattern2>...]\n"
+		"  Search each <hexpattern1> in <file>, and replace with its <hexpattern2>\n"
+		"  All patterns are matched in a single pass over the original content\n"
+		"  Flag -n to only report the offsets of matches without patching\n"
 		"\n"
 		" --cpio-<cmd> <incpio> [flags...] [args...]\n"
 		"  Do cpio related cmds to <incpio> (modifications are done directly)\n"
@@ -55,12 +117,16 @@ static void usage(char *arg0) {
 		"      Restore ramdisk from ramdisk backup within <incpio>\n"
 		"    -stocksha1\n"
 		"      Get stock boot SHA1 recorded within <incpio>\n"
+		"    -dedup\n"
+		"      Store identical files in <incpio> as hardlinks to save space\n"
 		"\n"
 		" --dtb-print <dtb>\n"
 		"  Print all nodes in <dtb>, for debugging\n"
 		"\n"
 		" --dtb-patch <dtb>\n"
 		"  Search for fstab in <dtb> and remove verity checks\n"
+		"  <dtb> can be concatenated dtbs or a QCDT dt.img, every dtb in it is\n"
+		"  patched concurrently\n"
 		"\n"
 		" --compress[=method] <infile> [outfile]\n"
 		"  Compress <infile> with [method] (default: gzip), optionally to [outfile]\n"
@@ -77,10 +143,16 @@ static void usage(char *arg0) {
 		fprintf(stderr, "%s ", SUP_LIST[i]);
 	fprintf(stderr,
 		"\n"
+		"  --unpack and --decompress reuse earlier results from the directory in\n"
+		"  MAGISKBOOT_CACHE if set, which is limited to MAGISKBOOT_CACHE_SIZE MB\n"
+		"  (default: 512)\n"
 		"\n"
 		" --sha1 <file>\n"
 		"  Print the SHA1 checksum for <file>\n"
 		"\n"
+		" --sha256 <file>\n"
+		"  Print the SHA256 checksum for <file>\n"
+		"\n"
 		" --cleanup\n"
 		"  Cleanup the current working directory\n"
 		"\n");
@@ -100,23 +172,34 @@ int main(int argc, char *argv[]) {
 		unlink(SECOND_FILE);
 		unlink(DTB_FILE);
 		unlink(EXTRA_FILE);
+		unlink(MANIFEST_FILE);
 		for (int i = 0; SUP_EXT_LIST[i]; ++i) {
 			sprintf(name, "%s.%s", RAMDISK_FILE, SUP_EXT_LIST[i]);
 			unlink(name);
 		}
-	} else if (argc > 2 && strcmp(argv[1], "--sha1") == 0) {
-		char sha1[21], *buf;
-		size_t size;
-		mmap_ro(argv[2], (void **) &buf, &size);
-		SHA1(sha1, buf, size);
-		for (int i = 0; i < 20; ++i)
-			printf("%02x", sha1[i]);
-		printf("\n");
-		munmap(buf, size);
+	} else if (argc > 2 && (strcmp(argv[1], "--sha1") == 0 || strcmp(argv[1], "--sha256") == 0)) {
+		unsigned char digest[MAX_DIGEST_SIZE];
+		hash_t type = strcmp(argv[1], "--sha1") == 0 ? HASH_SHA1 : HASH_SHA256;
+		int err = hash_file(argv[2], type, digest);
+		if (err < 0)
+			LOGE("Cannot hash [%s]: %s\n", argv[2], boot_strerror(err));
+		print_digest(digest, digest_size(type));
+	} else if (argc > 3 && strcmp(argv[1], "--unpack") == 0 && strncmp(argv[2], "--only=", 7) == 0) {
+		unpack(argv[3], parse_components(argv[2] + 7));
 	} else if (argc > 2 && strcmp(argv[1], "--unpack") == 0) {
-		unpack(argv[2]);
+		unpack(argv[2], UNPACK_ALL);
+	} else if (argc > 2 && strcmp(argv[1], "--info") == 0) {
+		boot_info(argv[2]);
+	} else if (argc > 3 && strcmp(argv[1], "--repack") == 0 && strcmp(argv[2], "--sparse") == 0) {
+		repack(argv[3], argc > 4 ? argv[4] : NEW_BOOT, 1);
 	} else if (argc > 2 && strcmp(argv[1], "--repack") == 0) {
-		repack(argv[2], argc > 3 ? argv[3] : NEW_BOOT);
+		repack(argv[2], argc > 3 ? argv[3] : NEW_BOOT, 0);
+	} else if (argc > 3 && strcmp(argv[1], "--patch") == 0) {
+		patch_cmd(argc - 2, argv + 2);
+	} else if (argc > 2 && strcmp(argv[1], "--batch") == 0) {
+		batch(argv[2]);
+	} else if (argc > 3 && strcmp(argv[1], "--flash") == 0) {
+		flash(argv[2], argv[3]);
 	} else if (argc > 2 && strcmp(argv[1], "--decompress") == 0) {
 		decomp_file(argv[2], argc > 3 ? argv[3] : NULL);
 	} else if (argc > 2 && strcmp(argv[1], "--dtb-print") == 0) {
@@ -130,7 +213,11 @@ int main(int argc, char *argv[]) {
 		else method++;
 		comp_file(method, argv[2], argc > 3 ? argv[3] : NULL);
 	} else if (argc > 4 && strcmp(argv[1], "--hexpatch") == 0) {
-		hexpatch(argv[2], argv[3], argv[4]);
+		int dry_run = strcmp(argv[3], "-n") == 0;
+		int num = argc - 3 - dry_run;
+		if (num < 2 || num % 2)
+			usage(argv[0]);
+		hexpatch(argv[2], dry_run, num, argv + 3 + dry_run);
 	} else if (argc > 2 && strncmp(argv[1], "--cpio", 6) == 0) {
 		char *command;
 		command = strchr(argv[1] + 2, '-');
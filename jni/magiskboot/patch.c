@@ -0,0 +1,277 @@
+/* patch.c - Apply the Magisk patches to a boot image in memory
+ *
+ * This does the same as the unpack, cpio, dtb-patch, hexpatch and repack
+ * steps of boot_patch.sh, without any intermediate files.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "magiskboot.h"
+#include "cpio.h"
+#include "utils.h"
+#include "hash.h"
+
+// 1. Remove Samsung RKP in stock kernel
+// 2. skip_initramfs -> want_initramfs
+static char *kernel_patches[] = {
+	"49010054011440B93FA00F71E9000054010840B93FA00F7189000054001840B91FA00F7188010054",
+	"A1020054011440B93FA00F7140020054010840B93FA00F71E0010054001840B91FA00F7181010054",
+	"736B69705F696E697472616D6673",
+	"77616E745F696E697472616D6673"
+};
+
+/* Parse the options after <bootimg> <outbootimg>, opts->adds points into argv
+ * and has to be freed. Returns 0 on success */
+int patch_parse_opts(int argc, char *argv[], patch_opts *opts) {
+	memset(opts, 0, sizeof(*opts));
+	opts->adds = xmalloc((argc + 1) * sizeof(char *));
+	for (int i = 0; i < argc; ++i) {
+		if (strcmp(argv[i], "--keepverity") == 0) {
+			opts->keepverity = 1;
+		} else if (strcmp(argv[i], "--keepforceencrypt") == 0) {
+			opts->keepforceencrypt = 1;
+		} else if (strcmp(argv[i], "--force") == 0) {
+			opts->force = 1;
+		} else if (strcmp(argv[i], "--add") == 0 && i + 3 < argc) {
+			memcpy(opts->adds + opts->num_add * 3, argv + i + 1, 3 * sizeof(char *));
+			++opts->num_add;
+			i += 3;
+		} else {
+			fprintf(stderr, "Unknown patch option [%s]\n", argv[i]);
+			free(opts->adds);
+			opts->adds = NULL;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int add_files(struct vector *v, const patch_opts *opts) {
+	for (int i = 0; i < opts->num_add; ++i) {
+		mode_t mode = strtoul(opts->adds[i * 3], NULL, 8);
+		const char *entry = opts->adds[i * 3 + 1], *filename = opts->adds[i * 3 + 2];
+		void *buf;
+		size_t size;
+		if (access(filename, R_OK) != 0) {
+			fprintf(stderr, "! Cannot read [%s]\n", filename);
+			return 1;
+		}
+		mmap_ro(filename, &buf, &size);
+		int err = cpio_vec_add(v, mode, entry, buf, size);
+		munmap(buf, size);
+		if (err < 0) {
+			fprintf(stderr, "! Cannot add entry [%s]: %s\n", entry, boot_strerror(err));
+			return 1;
+		}
+		fprintf(stderr, "Add entry [%s] (%04o)\n", entry, mode);
+	}
+	return 0;
+}
+
+/* Decompress, patch and recompress the ramdisk */
+static int patch_ramdisk(boot_image *img, const char *image, const void *orig, size_t size,
+						 const patch_opts *opts, patch_result *res) {
+	struct vector v, o;
+	out_stream raw, cpio, comp;
+	const void *data;
+	size_t len;
+	int ret = PATCH_FAILED, err;
+	file_t type = boot_format(img, BOOT_RAMDISK);
+
+	vec_init(&v);
+	vec_init(&o);
+	mem_stream(&raw);
+	mem_stream(&cpio);
+	mem_stream(&comp);
+
+	if (!COMPRESSED(type)) {
+		fprintf(stderr, "! Unknown ramdisk format\n");
+		return PATCH_FAILED;
+	}
+	boot_get(img, BOOT_RAMDISK, &data, &len);
+	if ((err = boot_decompress(type, &raw, data, len)) < 0 ||
+		(err = cpio_vec_parse(raw.buf, raw.size, &v)) < 0)
+		goto error;
+
+	switch (cpio_status(&v)) {
+	case STOCK_BOOT: {
+		unsigned char digest[SHA1_DIGEST_SIZE];
+		fprintf(stderr, "Stock boot image detected\n");
+		hash_buf(orig, size, HASH_SHA1, digest);
+		for (int i = 0; i < SHA1_DIGEST_SIZE; ++i)
+			sprintf(res->sha1 + i * 2, "%02x", digest[i]);
+		res->status = "stock";
+		break;
+	}
+	case MAGISK_PATCH:
+		fprintf(stderr, "Magisk patched image detected\n");
+		cpio_stocksha1(&v, res->sha1);
+		res->status = "magisk";
+		if (cpio_restore(&v)) {
+			fprintf(stderr, "! Cannot restore from internal backup\n");
+			if (!opts->force) {
+				ret = PATCH_NORESTORE;
+				goto done;
+			}
+		}
+		break;
+	default:
+		fprintf(stderr, "! Boot image patched by other programs\n");
+		res->status = "other";
+		ret = PATCH_OTHER;
+		goto done;
+	}
+
+	// The restored ramdisk is what gets backed up, take a copy through a round trip
+	if ((err = cpio_vec_dump(&v, &cpio, 0)) < 0 ||
+		(err = cpio_vec_parse(cpio.buf, cpio.size, &o)) < 0)
+		goto error;
+	cpio.size = 0;
+
+	if (add_files(&v, opts))
+		goto done;
+	cpio_patch(&v, opts->keepverity, opts->keepforceencrypt);
+	cpio_backup(&o, res->sha1[0] ? res->sha1 : NULL, &v);
+	// o is destroyed by cpio_backup
+	vec_init(&o);
+
+	if ((err = cpio_vec_dump(&v, &cpio, 0)) < 0 ||
+		(err = boot_compress(type, &comp, cpio.buf, cpio.size)) < 0 ||
+		(err = boot_set(img, BOOT_RAMDISK, comp.buf, comp.size)) < 0)
+		goto error;
+	ret = 0;
+	goto done;
+
+error:
+	fprintf(stderr, "! Cannot patch ramdisk of [%s]: %s\n", image, boot_strerror(err));
+done:
+	cpio_vec_destroy(&v);
+	cpio_vec_destroy(&o);
+	free(raw.buf);
+	free(cpio.buf);
+	free(comp.buf);
+	return ret;
+}
+
+/* Hexpatch the decompressed kernel, only recompress if anything matched */
+static int patch_kernel(boot_image *img) {
+	const void *data;
+	size_t len;
+	out_stream raw, comp;
+	int err = BOOT_OK;
+	file_t type = boot_format(img, BOOT_KERNEL);
+
+	if (boot_get(img, BOOT_KERNEL, &data, &len) < 0)
+		return BOOT_OK;
+	mem_stream(&raw);
+	mem_stream(&comp);
+	if (COMPRESSED(type))
+		err = boot_decompress(type, &raw, data, len);
+	else
+		err = stream_write(&raw, data, len);
+	if (err < 0)
+		goto done;
+
+	int num = sizeof(kernel_patches) / sizeof(*kernel_patches);
+	if (hexpatch_mem(raw.buf, raw.size, 0, num, kernel_patches) == 0)
+		goto done;
+	if (COMPRESSED(type)) {
+		if ((err = boot_compress(type, &comp, raw.buf, raw.size)) >= 0)
+			err = boot_set(img, BOOT_KERNEL, comp.buf, comp.size);
+	} else {
+		err = boot_set(img, BOOT_KERNEL, raw.buf, raw.size);
+	}
+
+done:
+	free(raw.buf);
+	free(comp.buf);
+	return err < 0 ? err : BOOT_OK;
+}
+
+static int patch_dtb(boot_image *img) {
+	const void *data;
+	size_t len;
+	int err = BOOT_OK;
+	if (boot_get(img, BOOT_DTB, &data, &len) < 0)
+		return BOOT_OK;
+	void *dtb = malloc(len);
+	if (dtb == NULL)
+		return BOOT_ENOMEM;
+	memcpy(dtb, data, len);
+	if (dtb_patch_mem(dtb, len)) {
+		fprintf(stderr, "Patching fstab in dtb to remove dm-verity\n");
+		err = boot_set(img, BOOT_DTB, dtb, len);
+	}
+	free(dtb);
+	return err;
+}
+
+/* Returns 0 on success, 2 if the result still has to be signed for ChromeOS,
+ * and the other PATCH_* codes on failure */
+int patch_boot(const char *image, const char *out_image, const patch_opts *opts, patch_result *res) {
+	struct timespec start;
+	boot_image *img = NULL;
+	void *orig = NULL;
+	size_t size = 0;
+	int ret = PATCH_FAILED, err, fd;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	memset(res, 0, sizeof(*res));
+	res->status = "unknown";
+
+	struct stat in, out;
+	if (stat(image, &in) != 0 || access(image, R_OK) != 0) {
+		fprintf(stderr, "! Cannot read [%s]\n", image);
+		return PATCH_FAILED;
+	}
+	// The input is mapped while the output is written
+	if (stat(out_image, &out) == 0 && in.st_dev == out.st_dev && in.st_ino == out.st_ino) {
+		fprintf(stderr, "! Cannot patch [%s] in place\n", image);
+		return PATCH_FAILED;
+	}
+	// Expand sparse images here so the stock SHA1 is of what gets flashed
+	if ((err = map_image(image, &orig, &size)) < 0 ||
+		(err = boot_open(orig, size, &img)) < 0) {
+		fprintf(stderr, "! Cannot parse [%s]: %s\n", image, boot_strerror(err));
+		if (err == BOOT_EELF32)
+			ret = PATCH_ELF32;
+		else if (err == BOOT_EELF64)
+			ret = PATCH_ELF64;
+		goto done;
+	}
+
+	if ((ret = patch_ramdisk(img, image, orig, size, opts, res)))
+		goto done;
+	ret = PATCH_FAILED;
+	if (!opts->keepverity && (err = patch_dtb(img)) < 0)
+		goto error;
+	if ((err = patch_kernel(img)) < 0)
+		goto error;
+
+	if ((fd = open(out_image, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0) {
+		fprintf(stderr, "! Cannot create [%s]\n", out_image);
+		goto done;
+	}
+	out_stream stream;
+	fd_stream(&stream, fd);
+	err = boot_build(img, &stream);
+	close(fd);
+	if (err < 0)
+		goto error;
+
+	ret = boot_is_chromeos(img) ? PATCH_CHROMEOS : 0;
+	goto done;
+
+error:
+	fprintf(stderr, "! Cannot patch [%s]: %s\n", image, boot_strerror(err));
+done:
+	boot_close(img);
+	if (size)
+		munmap(orig, size);
+	res->time = elapsed_ms(&start);
+	return ret;
+}
@@ -24,6 +24,7 @@ A million repetitions of "a"
 #include <stdint.h>
 
 #include "sha1.h"
+#include "hash.h"
 
 
 #define rol(value, bits) (((value) << (bits)) | ((value) >> (32 - (bits))))
@@ -213,11 +214,9 @@ void SHA1Update(
     if ((j + len) > 63)
     {
         memcpy(&context->buffer[j], data, (i = 64 - j));
-        SHA1Transform(context->state, context->buffer);
-        for (; i + 63 < len; i += 64)
-        {
-            SHA1Transform(context->state, &data[i]);
-        }
+        sha1_blocks(context->state, context->buffer, 1);
+        sha1_blocks(context->state, &data[i], (len - i) / 64);
+        i += (len - i) & ~63U;
         j = 0;
     }
     else
@@ -285,11 +284,9 @@ void SHA1(
     int len)
 {
     SHA1_CTX ctx;
-    unsigned int ii;
 
     SHA1Init(&ctx);
-    for (ii=0; ii<len; ii+=1)
-        SHA1Update(&ctx, (const unsigned char*)str + ii, 1);
+    SHA1Update(&ctx, (const unsigned char*)str, len);
     SHA1Final((unsigned char *)hash_out, &ctx);
     hash_out[20] = '\0';
 }
@@ -0,0 +1,38 @@
+#ifndef SHA256_H
+#define SHA256_H
+
+/*
+   SHA-256 in C
+   Same interface as sha1.h
+ */
+
+#include <stdint.h>
+
+typedef struct
+{
+    uint32_t state[8];
+    uint32_t count[2];
+    unsigned char buffer[64];
+} SHA256_CTX;
+
+void SHA256Transform(
+    uint32_t state[8],
+    const unsigned char buffer[64]
+    );
+
+void SHA256Init(
+    SHA256_CTX * context
+    );
+
+void SHA256Update(
+    SHA256_CTX * context,
+    const unsigned char *data,
+    uint32_t len
+    );
+
+void SHA256Final(
+    unsigned char digest[32],
+    SHA256_CTX * context
+    );
+
+#endif /* SHA256_H */
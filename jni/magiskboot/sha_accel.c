@@ -0,0 +1,180 @@
+/* sha_accel.c - SHA1/SHA256 block functions using CPU instructions
+ *
+ * This file is built as a separate module with the instruction set enabled
+ * (-msha on x86, +crypto on arm64). Nothing else may live here, as the
+ * compiler is free to use these instructions anywhere in this file.
+ * The functions must only be called after hash.c verified CPU support.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "hash.h"
+
+#if defined(__i386__) || defined(__x86_64__)
+
+#if !defined(__SHA__) || !defined(__SSE4_1__)
+#error "sha_accel.c has to be built with -msha -msse4.1"
+#endif
+
+#include <immintrin.h>
+
+/* Rounds 4g to 4g+3 with function f. W holds the last 4 message words groups,
+ * SAVE is the ABCD before the previous group which becomes the next E. */
+#define SHA1_NI_ROUNDS(g, f) do { \
+	if (g >= 4) \
+		W[g % 4] = _mm_sha1msg2_epu32(_mm_xor_si128(_mm_sha1msg1_epu32( \
+			W[g % 4], W[(g + 1) % 4]), W[(g + 2) % 4]), W[(g + 3) % 4]); \
+	E = g ? _mm_sha1nexte_epu32(SAVE, W[g % 4]) : _mm_add_epi32(E0, W[0]); \
+	SAVE = ABCD; \
+	ABCD = _mm_sha1rnds4_epu32(ABCD, E, f); \
+} while (0)
+
+void sha1_blocks_accel(uint32_t state[5], const unsigned char *data, size_t blocks) {
+	const __m128i MASK = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+	__m128i ABCD, ABCD_SAVE, E0, E, SAVE, W[4];
+
+	ABCD = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) state), 0x1B);
+	E0 = _mm_set_epi32(state[4], 0, 0, 0);
+
+	for (; blocks; --blocks, data += 64) {
+		ABCD_SAVE = ABCD;
+		for (int i = 0; i < 4; ++i)
+			W[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (data + i * 16)), MASK);
+
+		SHA1_NI_ROUNDS(0, 0);  SHA1_NI_ROUNDS(1, 0);  SHA1_NI_ROUNDS(2, 0);
+		SHA1_NI_ROUNDS(3, 0);  SHA1_NI_ROUNDS(4, 0);  SHA1_NI_ROUNDS(5, 1);
+		SHA1_NI_ROUNDS(6, 1);  SHA1_NI_ROUNDS(7, 1);  SHA1_NI_ROUNDS(8, 1);
+		SHA1_NI_ROUNDS(9, 1);  SHA1_NI_ROUNDS(10, 2); SHA1_NI_ROUNDS(11, 2);
+		SHA1_NI_ROUNDS(12, 2); SHA1_NI_ROUNDS(13, 2); SHA1_NI_ROUNDS(14, 2);
+		SHA1_NI_ROUNDS(15, 3); SHA1_NI_ROUNDS(16, 3); SHA1_NI_ROUNDS(17, 3);
+		SHA1_NI_ROUNDS(18, 3); SHA1_NI_ROUNDS(19, 3);
+
+		E0 = _mm_sha1nexte_epu32(SAVE, E0);
+		ABCD = _mm_add_epi32(ABCD, ABCD_SAVE);
+	}
+
+	_mm_storeu_si128((__m128i *) state, _mm_shuffle_epi32(ABCD, 0x1B));
+	state[4] = _mm_extract_epi32(E0, 3);
+}
+
+void sha256_blocks_accel(uint32_t state[8], const unsigned char *data, size_t blocks) {
+	const __m128i MASK = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+	__m128i STATE0, STATE1, SAVE0, SAVE1, TMP, MSG, W[4];
+
+	// Rearrange state to ABEF / CDGH as required by sha256rnds2
+	TMP = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) &state[0]), 0xB1);
+	STATE1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) &state[4]), 0x1B);
+	STATE0 = _mm_alignr_epi8(TMP, STATE1, 8);
+	STATE1 = _mm_blend_epi16(STATE1, TMP, 0xF0);
+
+	for (; blocks; --blocks, data += 64) {
+		SAVE0 = STATE0;
+		SAVE1 = STATE1;
+		for (int i = 0; i < 4; ++i)
+			W[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (data + i * 16)), MASK);
+
+		for (int g = 0; g < 16; ++g) {
+			if (g >= 4) {
+				TMP = _mm_add_epi32(_mm_sha256msg1_epu32(W[g % 4], W[(g + 1) % 4]),
+				                    _mm_alignr_epi8(W[(g + 3) % 4], W[(g + 2) % 4], 4));
+				W[g % 4] = _mm_sha256msg2_epu32(TMP, W[(g + 3) % 4]);
+			}
+			MSG = _mm_add_epi32(W[g % 4], _mm_loadu_si128((const __m128i *) &SHA256_K[g * 4]));
+			STATE1 = _mm_sha256rnds2_epu32(STATE1, STATE0, MSG);
+			STATE0 = _mm_sha256rnds2_epu32(STATE0, STATE1, _mm_shuffle_epi32(MSG, 0x0E));
+		}
+
+		STATE0 = _mm_add_epi32(STATE0, SAVE0);
+		STATE1 = _mm_add_epi32(STATE1, SAVE1);
+	}
+
+	TMP = _mm_shuffle_epi32(STATE0, 0x1B);
+	STATE1 = _mm_shuffle_epi32(STATE1, 0xB1);
+	_mm_storeu_si128((__m128i *) &state[0], _mm_blend_epi16(TMP, STATE1, 0xF0));
+	_mm_storeu_si128((__m128i *) &state[4], _mm_alignr_epi8(STATE1, TMP, 8));
+}
+
+#elif defined(__aarch64__)
+
+#if !defined(__ARM_FEATURE_CRYPTO)
+#error "sha_accel.c has to be built with -march=armv8-a+crypto"
+#endif
+
+#include <arm_neon.h>
+
+#define LOAD_BE32(p) vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(p)))
+
+void sha1_blocks_accel(uint32_t state[5], const unsigned char *data, size_t blocks) {
+	static const uint32_t K[4] = { 0x5A827999, 0x6ED9EBA1, 0x8F1BBCDC, 0xCA62C1D6 };
+	uint32x4_t ABCD, ABCD_SAVE, TMP, W[4];
+	uint32_t E0, E1, E0_SAVE;
+
+	ABCD = vld1q_u32(state);
+	E0 = state[4];
+
+	for (; blocks; --blocks, data += 64) {
+		ABCD_SAVE = ABCD;
+		E0_SAVE = E0;
+		for (int i = 0; i < 4; ++i)
+			W[i] = LOAD_BE32(data + i * 16);
+
+		for (int g = 0; g < 20; ++g) {
+			if (g >= 4)
+				W[g % 4] = vsha1su1q_u32(vsha1su0q_u32(W[g % 4], W[(g + 1) % 4], W[(g + 2) % 4]),
+				                         W[(g + 3) % 4]);
+			TMP = vaddq_u32(W[g % 4], vdupq_n_u32(K[g / 5]));
+			E1 = vsha1h_u32(vgetq_lane_u32(ABCD, 0));
+			switch (g / 5) {
+			case 0:
+				ABCD = vsha1cq_u32(ABCD, E0, TMP);
+				break;
+			case 2:
+				ABCD = vsha1mq_u32(ABCD, E0, TMP);
+				break;
+			default:
+				ABCD = vsha1pq_u32(ABCD, E0, TMP);
+				break;
+			}
+			E0 = E1;
+		}
+
+		E0 += E0_SAVE;
+		ABCD = vaddq_u32(ABCD_SAVE, ABCD);
+	}
+
+	vst1q_u32(state, ABCD);
+	state[4] = E0;
+}
+
+void sha256_blocks_accel(uint32_t state[8], const unsigned char *data, size_t blocks) {
+	uint32x4_t STATE0, STATE1, SAVE0, SAVE1, TMP, W[4];
+
+	STATE0 = vld1q_u32(&state[0]);
+	STATE1 = vld1q_u32(&state[4]);
+
+	for (; blocks; --blocks, data += 64) {
+		SAVE0 = STATE0;
+		SAVE1 = STATE1;
+		for (int i = 0; i < 4; ++i)
+			W[i] = LOAD_BE32(data + i * 16);
+
+		for (int g = 0; g < 16; ++g) {
+			if (g >= 4)
+				W[g % 4] = vsha256su1q_u32(vsha256su0q_u32(W[g % 4], W[(g + 1) % 4]),
+				                           W[(g + 2) % 4], W[(g + 3) % 4]);
+			TMP = vaddq_u32(W[g % 4], vld1q_u32(&SHA256_K[g * 4]));
+			uint32x4_t prev = STATE0;
+			STATE0 = vsha256hq_u32(STATE0, STATE1, TMP);
+			STATE1 = vsha256h2q_u32(STATE1, prev, TMP);
+		}
+
+		STATE0 = vaddq_u32(STATE0, SAVE0);
+		STATE1 = vaddq_u32(STATE1, SAVE1);
+	}
+
+	vst1q_u32(&state[0], STATE0);
+	vst1q_u32(&state[4], STATE1);
+}
+
+#endif
@@ -0,0 +1,166 @@
+/* sparse.c - Android sparse image format
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "libmagiskboot.h"
+#include "sparse.h"
+
+/* Map the sparse image in buf to an anonymous mapping of the full image.
+ * Untouched pages of the mapping read as zero without using any memory,
+ * so DONT_CARE chunks and zero fills cost nothing. Free with munmap. */
+int sparse_expand(const void *buf, size_t size, void **out, size_t *out_size) {
+	const sparse_header *hdr = buf;
+	size_t pos, off = 0;
+	if (size < sizeof(*hdr) || hdr->magic != SPARSE_HEADER_MAGIC || hdr->major_version != 1 ||
+		hdr->file_hdr_sz < sizeof(*hdr) || hdr->file_hdr_sz > size || hdr->chunk_hdr_sz < sizeof(chunk_header) ||
+		hdr->blk_sz == 0 || hdr->blk_sz % 4)
+		return BOOT_EFORMAT;
+
+	// Block counts and sizes are 32 bit each, the product can exceed size_t
+	uint64_t total64 = (uint64_t) hdr->total_blks * hdr->blk_sz;
+	if (total64 > SIZE_MAX)
+		return BOOT_ENOMEM;
+	size_t total = total64;
+	void *img = mmap(NULL, total ? total : 1, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (img == MAP_FAILED)
+		return BOOT_ENOMEM;
+
+	pos = hdr->file_hdr_sz;
+	for (uint32_t i = 0; i < hdr->total_chunks; ++i) {
+		const chunk_header *chunk = buf + pos;
+		if (hdr->chunk_hdr_sz > size - pos || chunk->total_sz < hdr->chunk_hdr_sz ||
+			chunk->total_sz > size - pos)
+			goto error;
+		const void *data = buf + pos + hdr->chunk_hdr_sz;
+		size_t data_sz = chunk->total_sz - hdr->chunk_hdr_sz;
+		uint64_t len64 = (uint64_t) chunk->chunk_sz * hdr->blk_sz;
+		if (chunk->chunk_type != CHUNK_TYPE_CRC32 && len64 > total - off)
+			goto error;
+		size_t len = len64;
+		switch (chunk->chunk_type) {
+		case CHUNK_TYPE_RAW:
+			if (data_sz != len)
+				goto error;
+			memcpy(img + off, data, len);
+			off += len;
+			break;
+		case CHUNK_TYPE_FILL: {
+			uint32_t fill;
+			if (data_sz != sizeof(fill))
+				goto error;
+			memcpy(&fill, data, sizeof(fill));
+			if (fill) {
+				for (size_t j = 0; j < len; j += sizeof(fill))
+					memcpy(img + off + j, &fill, sizeof(fill));
+			}
+			off += len;
+			break;
+		}
+		case CHUNK_TYPE_DONT_CARE:
+			off += len;
+			break;
+		case CHUNK_TYPE_CRC32:
+			break;
+		default:
+			goto error;
+		}
+		pos += chunk->total_sz;
+	}
+
+	*out = img;
+	*out_size = total;
+	return BOOT_OK;
+
+error:
+	munmap(img, total ? total : 1);
+	return BOOT_EFORMAT;
+}
+
+static int write_chunk(out_stream *out, uint16_t type, uint32_t blocks, const void *data, size_t size) {
+	chunk_header chunk = {
+		.chunk_type = type,
+		.chunk_sz = blocks,
+		.total_sz = sizeof(chunk) + size
+	};
+	int err = stream_write(out, &chunk, sizeof(chunk));
+	if (err == BOOT_OK && size)
+		err = stream_write(out, data, size);
+	return err;
+}
+
+static int is_zero(const void *buf, size_t size) {
+	const uint64_t *p = buf;
+	for (size_t i = 0; i < size / sizeof(*p); ++i) {
+		if (p[i])
+			return 0;
+	}
+	return 1;
+}
+
+/* Find the end of the run of zero or non-zero blocks starting at block i,
+ * a partial last block always counts as data */
+static size_t run_end(const void *buf, size_t i, size_t blocks, size_t full, int *zero) {
+	const size_t blk_sz = SPARSE_BLOCK_SIZE;
+	size_t j;
+	*zero = i < full && is_zero(buf + i * blk_sz, blk_sz);
+	for (j = i + 1; j < blocks && *zero == (j < full && is_zero(buf + j * blk_sz, blk_sz)); ++j);
+	return j;
+}
+
+/* Write buf as a sparse image, runs of zero blocks become FILL chunks of 0
+ * like img2simg does. DONT_CARE is never used, fastboot would leave the old
+ * partition contents in those blocks. The image is padded with zeros to a
+ * whole number of blocks. */
+int sparse_build(out_stream *out, const void *buf, size_t size) {
+	const size_t blk_sz = SPARSE_BLOCK_SIZE;
+	size_t blocks = (size + blk_sz - 1) / blk_sz, full = size / blk_sz;
+	char last[SPARSE_BLOCK_SIZE];
+	uint32_t chunks = 0, zero_fill = 0;
+	int err, zero;
+
+	// Count chunks first, the header comes before them
+	for (size_t i = 0; i < blocks; i = run_end(buf, i, blocks, full, &zero))
+		++chunks;
+
+	sparse_header hdr = {
+		.magic = SPARSE_HEADER_MAGIC,
+		.major_version = 1,
+		.minor_version = 0,
+		.file_hdr_sz = sizeof(hdr),
+		.chunk_hdr_sz = sizeof(chunk_header),
+		.blk_sz = blk_sz,
+		.total_blks = blocks,
+		.total_chunks = chunks,
+		.image_checksum = 0
+	};
+	if ((err = stream_write(out, &hdr, sizeof(hdr))) < 0)
+		return err;
+
+	for (size_t i = 0, j; i < blocks; i = j) {
+		j = run_end(buf, i, blocks, full, &zero);
+		if (zero) {
+			err = write_chunk(out, CHUNK_TYPE_FILL, j - i, &zero_fill, sizeof(zero_fill));
+		} else if (j > full) {
+			// The partial last block is written from a padded copy
+			chunk_header chunk = {
+				.chunk_type = CHUNK_TYPE_RAW,
+				.chunk_sz = j - i,
+				.total_sz = sizeof(chunk) + (j - i) * blk_sz
+			};
+			memset(last, 0, sizeof(last));
+			memcpy(last, buf + full * blk_sz, size - full * blk_sz);
+			if ((err = stream_write(out, &chunk, sizeof(chunk))) == BOOT_OK &&
+				(err = stream_write(out, buf + i * blk_sz, (full - i) * blk_sz)) == BOOT_OK)
+				err = stream_write(out, last, blk_sz);
+		} else {
+			err = write_chunk(out, CHUNK_TYPE_RAW, j - i, buf + i * blk_sz, (j - i) * blk_sz);
+		}
+		if (err < 0)
+			return err;
+	}
+	return BOOT_OK;
+}
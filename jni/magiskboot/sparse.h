@@ -0,0 +1,36 @@
+/* sparse.h - Android sparse image format, as in system/core/libsparse
+ */
+
+#ifndef _SPARSE_H_
+#define _SPARSE_H_
+
+#include <stdint.h>
+
+#define SPARSE_HEADER_MAGIC     0xed26ff3a
+#define SPARSE_BLOCK_SIZE       4096
+
+#define CHUNK_TYPE_RAW          0xCAC1
+#define CHUNK_TYPE_FILL         0xCAC2
+#define CHUNK_TYPE_DONT_CARE    0xCAC3
+#define CHUNK_TYPE_CRC32        0xCAC4
+
+typedef struct sparse_header {
+	uint32_t magic;
+	uint16_t major_version;
+	uint16_t minor_version;
+	uint16_t file_hdr_sz;     /* 28 bytes for the first revision */
+	uint16_t chunk_hdr_sz;    /* 12 bytes for the first revision */
+	uint32_t blk_sz;          /* block size in bytes, must be a multiple of 4 */
+	uint32_t total_blks;      /* total blocks in the non-sparse output image */
+	uint32_t total_chunks;    /* total chunks in the sparse input image */
+	uint32_t image_checksum;  /* CRC32 checksum of the original data, 0 if unused */
+} sparse_header;
+
+typedef struct chunk_header {
+	uint16_t chunk_type;
+	uint16_t reserved1;
+	uint32_t chunk_sz;        /* in blocks in the output image */
+	uint32_t total_sz;        /* in bytes of the chunk input file including header and data */
+} chunk_header;
+
+#endif
@@ -0,0 +1,91 @@
+/* stream.c - Output streams and error strings for libmagiskboot
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "libmagiskboot.h"
+
+const char *boot_strerror(int err) {
+	switch (err) {
+	case BOOT_OK:
+		return "Success";
+	case BOOT_ENOMEM:
+		return "Out of memory";
+	case BOOT_EIO:
+		return "I/O error";
+	case BOOT_EFORMAT:
+		return "Unsupported format";
+	case BOOT_ECODEC:
+		return "Compression error";
+	case BOOT_ENOENT:
+		return "Entry not found";
+	case BOOT_EINVAL:
+		return "Invalid argument";
+	case BOOT_EELF32:
+		return "Sony ELF32 image";
+	case BOOT_EELF64:
+		return "Sony ELF64 image";
+	default:
+		return "Unknown error";
+	}
+}
+
+void fd_stream(out_stream *out, int fd) {
+	memset(out, 0, sizeof(*out));
+	out->fd = fd;
+	out->base = lseek(fd, 0, SEEK_CUR);
+}
+
+void mem_stream(out_stream *out) {
+	memset(out, 0, sizeof(*out));
+	out->fd = -1;
+}
+
+int stream_write(out_stream *out, const void *buf, size_t size) {
+	if (out->fd >= 0) {
+		for (ssize_t len; size; size -= len, buf += len) {
+			len = write(out->fd, buf, size);
+			if (len < 0 && errno == EINTR)
+				len = 0;
+			else if (len <= 0)
+				return BOOT_EIO;
+			out->size += len;
+		}
+		return BOOT_OK;
+	}
+	if (out->size + size > out->cap) {
+		size_t cap = out->cap ? out->cap : 4096;
+		while (cap < out->size + size)
+			cap *= 2;
+		void *p = realloc(out->buf, cap);
+		if (p == NULL)
+			return BOOT_ENOMEM;
+		out->buf = p;
+		out->cap = cap;
+	}
+	memcpy(out->buf + out->size, buf, size);
+	out->size += size;
+	return BOOT_OK;
+}
+
+int stream_patch(out_stream *out, size_t pos, const void *buf, size_t size) {
+	if (pos > out->size || size > out->size - pos)
+		return BOOT_EINVAL;
+	if (out->fd < 0) {
+		memcpy(out->buf + pos, buf, size);
+		return BOOT_OK;
+	}
+	if (out->base < 0)
+		return BOOT_EIO;
+	for (ssize_t len; size; size -= len, buf += len, pos += len) {
+		len = pwrite(out->fd, buf, size, out->base + pos);
+		if (len < 0 && errno == EINTR)
+			len = 0;
+		else if (len <= 0)
+			return BOOT_EIO;
+	}
+	return BOOT_OK;
+}
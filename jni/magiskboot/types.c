@@ -35,6 +35,8 @@ file_t check_type(const void *buf) {
 		return MTK;
 	} else if (memcmp(buf, DTB_MAGIC, 4) == 0) {
 		return DTB;
+	} else if (memcmp(buf, SPARSE_MAGIC, 4) == 0) {
+		return SPARSE;
 	} else {
 		return UNKNOWN;
 	}
@@ -76,6 +78,9 @@ void get_type_name(file_t type, char *name) {
 		case DTB:
 			s = "dtb";
 			break;
+		case SPARSE:
+			s = "sparse";
+			break;
 		default:
 			s = "raw";
 	}
@@ -15,7 +15,8 @@ typedef enum {
     LZ4,
     LZ4_LEGACY,
     MTK,
-    DTB
+    DTB,
+    SPARSE
 } file_t;
 
 #define COMPRESSED(type)  (type >= GZIP && type <= LZ4_LEGACY)
@@ -31,6 +32,7 @@ typedef enum {
 #define LZ4_LEG_MAGIC   "\x02\x21\x4c\x18"
 #define MTK_MAGIC       "\x88\x16\x88\x58"
 #define DTB_MAGIC       "\xd0\x0d\xfe\xed"
+#define SPARSE_MAGIC    "\x3a\xff\x26\xed"
 #define LG_BUMP_MAGIC   "\x41\xa9\xe4\x67\x74\x4d\x1d\x1b\xa4\x29\xf2\xec\xea\x65\x52\x79"
 
 extern char *SUP_LIST[];
@@ -101,6 +101,7 @@ int add_list(char *proc) {
 	vec_destroy(hide_list);
 	free(hide_list);
 	hide_list = new_list;
+	status_hide(1, hide_list);
 	pthread_mutex_unlock(&hide_lock);
 
 	pthread_mutex_lock(&file_lock);
@@ -141,6 +142,7 @@ int rm_list(char *proc) {
 		vec_destroy(hide_list);
 		free(hide_list);
 		hide_list = new_list;
+		status_hide(1, hide_list);
 		pthread_mutex_unlock(&hide_lock);
 
 		ret = DAEMON_SUCCESS;
@@ -203,6 +205,7 @@ void rm_hide_list(int client) {
 void ls_hide_list(int client) {
 	if (!hideEnabled) {
 		write_int(client, HIDE_NOT_ENABLED);
+		close(client);
 		return;
 	}
 	write_int(client, DAEMON_SUCCESS);
@@ -66,6 +66,9 @@ void launch_magiskhide(int client) {
 
 	// Add SafetyNet by default
 	add_list(strdup("com.google.android.gms.unstable"));
+	pthread_mutex_lock(&hide_lock);
+	status_hide(1, hide_list);
+	pthread_mutex_unlock(&hide_lock);
 
 	if (client > 0) {
 		write_int(client, DAEMON_SUCCESS);
@@ -97,6 +100,7 @@ void stop_magiskhide(int client) {
 	LOGI("* Stopping MagiskHide\n");
 
 	hideEnabled = 0;
+	status_hide(0, NULL);
 	setprop(MAGISKHIDE_PROP, "0");
 	// Remove without actually removing persist props
 	deleteprop2(MAGISKHIDE_PROP, 0);
@@ -106,6 +110,25 @@ void stop_magiskhide(int client) {
 	close(client);
 }
 
+/* Print the hide list from the status page without asking the daemon,
+ * returns -1 if the daemon has to be asked instead */
+static int ls_status_page() {
+	status_page *st = xmalloc(sizeof(*st));
+	int ret = -1;
+	if (status_read(st) == 0 && (!st->hide_enabled || st->hide_num >= 0)) {
+		if (st->hide_enabled) {
+			for (char *s = st->hide_list; s < st->hide_list + st->hide_size; s += strlen(s) + 1)
+				printf("%s\n", s);
+			ret = DAEMON_SUCCESS;
+		} else {
+			fprintf(stderr, "Magisk hide is not enabled yet\n");
+			ret = HIDE_NOT_ENABLED;
+		}
+	}
+	free(st);
+	return ret;
+}
+
 int magiskhide_main(int argc, char *argv[]) {
 	if (argc < 2) {
 		usage(argv[0]);
@@ -124,6 +147,9 @@ int magiskhide_main(int argc, char *argv[]) {
 	} else {
 		usage(argv[0]);
 	}
+	int ret;
+	if (req == LS_HIDELIST && (ret = ls_status_page()) >= 0)
+		return ret;
 	int fd = connect_daemon();
 	write_int(fd, req);
 	if (req == ADD_HIDELIST || req == RM_HIDELIST) {
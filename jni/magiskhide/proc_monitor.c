@@ -17,6 +17,7 @@
 
 #include "magisk.h"
 #include "utils.h"
+#include "daemon.h"
 #include "magiskhide.h"
 
 static char init_ns[32], zygote_ns[2][32], cache_block[256];
@@ -47,13 +48,16 @@ static int read_namespace(const int pid, char* target, const size_t size) {
 	return 0;
 }
 
+// Zygote unshares its mount namespace right after it starts
+static int zygote_ns_ready(int pid) {
+	return read_namespace(pid, zygote_ns[zygote_num], 32) == 0 &&
+		strcmp(zygote_ns[zygote_num], init_ns) != 0;
+}
+
 static void store_zygote_ns(int pid) {
 	if (zygote_num == 2) return;
-	do {
-		usleep(500);
-		read_namespace(pid, zygote_ns[zygote_num], 32);
-	} while (strcmp(zygote_ns[zygote_num], init_ns) == 0);
-	++zygote_num;
+	if (wait_for_proc(pid, zygote_ns_ready, -1) == 0)
+		++zygote_num;
 }
 
 static void lazy_unmount(const char* mountpoint) {
@@ -151,6 +155,8 @@ void proc_monitor() {
 	// Get the mount namespace of init
 	if (read_namespace(1, init_ns, 32)) {
 		LOGE("proc_monitor: Your kernel doesn't support mount namespace :(\n");
+		// Not stopped by stop_magiskhide, so publish it here
+		status_hide(0, NULL);
 		quit_pthread(SIGUSR1);
 	}
 	LOGI("proc_monitor: init ns=%s\n", init_ns);
@@ -158,9 +164,12 @@ void proc_monitor() {
 	// Get the mount namespace of zygote
 	zygote_num = 0;
 	while(!zygote_num) {
-		// Check zygote every 2 secs
-		sleep(2);
+		// Init creates the zygote socket right before starting zygote
+		wait_for_path("/dev/socket/zygote", F_OK, -1);
 		ps_filter_proc_name("zygote", store_zygote_ns);
+		// The socket stays while zygote restarts
+		if (!zygote_num)
+			usleep(100000);
 	}
 	ps_filter_proc_name("zygote64", store_zygote_ns);
 
@@ -199,6 +208,7 @@ void proc_monitor() {
 			if(ret != 2)
 				continue;
 
+			stats_hide_event();
 			ret = 0;
 
 			// Critical region
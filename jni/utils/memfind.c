@@ -0,0 +1,95 @@
+/* memfind.c - Fast pattern search in memory buffers
+ *
+ * Candidates are filtered by comparing the first and the last byte of the
+ * pattern against a whole vector of positions at once (SSE2 / NEON), and only
+ * the positions where both bytes match are verified with memcmp.
+ * Without SIMD support, memchr on the first byte is used as the filter.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+#include "utils.h"
+
+static const uint8_t *memfind_scalar(const uint8_t *s, const uint8_t *end,
+                                     const uint8_t *p, size_t len) {
+	// Last position a match can start at
+	const uint8_t *last = end - len;
+	while (s <= last) {
+		s = memchr(s, p[0], last - s + 1);
+		if (s == NULL)
+			return NULL;
+		if (memcmp(s + 1, p + 1, len - 1) == 0)
+			return s;
+		++s;
+	}
+	return NULL;
+}
+
+#if defined(__SSE2__)
+
+static const uint8_t *memfind_simd(const uint8_t *s, const uint8_t *end,
+                                   const uint8_t *p, size_t len) {
+	const __m128i first = _mm_set1_epi8(p[0]);
+	const __m128i lastb = _mm_set1_epi8(p[len - 1]);
+	// Need 16 candidate positions plus the rest of the pattern in range
+	for (; s + 16 + len - 1 <= end; s += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i *) s);
+		__m128i b = _mm_loadu_si128((const __m128i *) (s + len - 1));
+		unsigned mask = _mm_movemask_epi8(
+				_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, lastb)));
+		while (mask) {
+			unsigned bit = __builtin_ctz(mask);
+			if (memcmp(s + bit + 1, p + 1, len - 2) == 0)
+				return s + bit;
+			mask &= mask - 1;
+		}
+	}
+	return memfind_scalar(s, end, p, len);
+}
+
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+
+static const uint8_t *memfind_simd(const uint8_t *s, const uint8_t *end,
+                                   const uint8_t *p, size_t len) {
+	const uint8x16_t first = vdupq_n_u8(p[0]);
+	const uint8x16_t lastb = vdupq_n_u8(p[len - 1]);
+	uint8_t lanes[16];
+	for (; s + 16 + len - 1 <= end; s += 16) {
+		uint8x16_t eq = vandq_u8(vceqq_u8(vld1q_u8(s), first),
+		                         vceqq_u8(vld1q_u8(s + len - 1), lastb));
+		// Skip the block quickly if there are no candidates at all
+		uint64x2_t any = vreinterpretq_u64_u8(eq);
+		if ((vgetq_lane_u64(any, 0) | vgetq_lane_u64(any, 1)) == 0)
+			continue;
+		vst1q_u8(lanes, eq);
+		for (int i = 0; i < 16; ++i) {
+			if (lanes[i] && memcmp(s + i + 1, p + 1, len - 2) == 0)
+				return s + i;
+		}
+	}
+	return memfind_scalar(s, end, p, len);
+}
+
+#else
+
+#define memfind_simd memfind_scalar
+
+#endif
+
+/* Return the first occurrence of pattern in buf, or NULL if not found.
+ * An empty pattern never matches, so memfind_for_each always terminates */
+void *memfind(const void *buf, size_t size, const void *pattern, size_t len) {
+	const uint8_t *s = buf, *p = pattern;
+	if (buf == NULL || len == 0 || size < len)
+		return NULL;
+	if (len == 1)
+		return memchr(buf, p[0], size);
+	return (void *) memfind_simd(s, s + size, p, len);
+}
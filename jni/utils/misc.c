@@ -11,6 +11,8 @@
 #include <signal.h>
 #include <sched.h>
 #include <sys/types.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 #include <sys/mount.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
@@ -248,6 +250,8 @@ static int v_exec_command(int err, int *fd, void (*setupenv)(struct vector*), co
 		if (err) xdup2(writeEnd, STDERR_FILENO);
 	}
 
+	// Commands don't inherit the priority of the daemon thread
+	set_priority(0, IOPRIO_DEFAULT);
 	execvpe(argv0, (char **) vec_entry(&args), envp);
 	PLOGE("execvpe");
 	return -1;
@@ -307,6 +311,14 @@ int switch_mnt_ns(int pid) {
 	return ret;
 }
 
+/* Set the nice value and the best effort I/O priority level (0 - 7, lower is
+ * more urgent) of the calling thread */
+void set_priority(int nice, int io_level) {
+	int tid = syscall(__NR_gettid);
+	setpriority(PRIO_PROCESS, tid, nice);
+	syscall(__NR_ioprio_set, IOPRIO_WHO_PROCESS, tid, IOPRIO_CLASS_BE << IOPRIO_CLASS_SHIFT | io_level);
+}
+
 int fork_dont_care() {
 	int pid = xfork();
 	if (pid) {
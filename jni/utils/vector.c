@@ -13,14 +13,19 @@ void vec_init(struct vector *v) {
 	vec_entry(v) = malloc(sizeof(void*));
 }
 
-void vec_push_back(struct vector *v, void *p) {
-	if (v == NULL) return;
-	if (vec_size(v) == vec_cap(v)) {
-		vec_cap(v) *= 2;
-		vec_entry(v) = realloc(vec_entry(v), sizeof(void*) * vec_cap(v));
+/* Returns 0, or -1 if out of memory, the vector is unchanged then */
+int vec_push_back(struct vector *v, void *p) {
+	if (v == NULL) return -1;
+	if (vec_size(v) == vec_cap(v) || vec_entry(v) == NULL) {
+		size_t cap = vec_cap(v) ? vec_cap(v) * 2 : 1;
+		void **data = realloc(vec_entry(v), sizeof(void*) * cap);
+		if (data == NULL) return -1;
+		vec_entry(v) = data;
+		vec_cap(v) = cap;
 	}
 	vec_entry(v)[vec_size(v)] = p;
 	++vec_size(v);
+	return 0;
 }
 
 void *vec_pop_back(struct vector *v) {
@@ -0,0 +1,125 @@
+/* wait.c - Sleep until a file or a process changes instead of polling
+ *
+ * A path is waited for with inotify on its closest existing parent, plus
+ * POLLPRI on /proc/self/mounts for paths that show up by a mount. A process
+ * is rechecked with a growing delay, and a pidfd ends the wait early if it
+ * exits. Without these, both fall back to polling.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+
+#include "utils.h"
+
+#ifndef __NR_pidfd_open
+#define __NR_pidfd_open 434
+#endif
+
+#define POLL_MIN_US   500
+#define POLL_MAX_US   (32 * 1000)
+
+/* Milliseconds left until the deadline, -1 for none */
+static int time_left(const struct timespec *start, int timeout_ms) {
+	struct timespec now;
+	if (timeout_ms < 0)
+		return -1;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	long spent = (now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000;
+	return spent >= timeout_ms ? 0 : timeout_ms - spent;
+}
+
+/* Watch the closest existing parent of path for new or changed entries */
+static int watch_parent(const char *path) {
+	char dir[PATH_MAX];
+	int fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+	if (fd < 0)
+		return -1;
+	strncpy(dir, path, sizeof(dir) - 1);
+	dir[sizeof(dir) - 1] = '\0';
+	for (char *slash; (slash = strrchr(dir, '/'));) {
+		if (slash == dir)
+			slash[1] = '\0';
+		else
+			*slash = '\0';
+		if (inotify_add_watch(fd, dir, IN_CREATE | IN_MOVED_TO | IN_ATTRIB) >= 0)
+			return fd;
+		if (slash == dir)
+			break;
+	}
+	close(fd);
+	return -1;
+}
+
+/* Wait until access(path, mode) succeeds, or timeout_ms passed if it is not
+ * negative. Returns 0 when the path is accessible and -1 on timeout */
+int wait_for_path(const char *path, int mode, int timeout_ms) {
+	struct timespec start;
+	int delay_us = POLL_MIN_US;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while (1) {
+		int left = -1;
+		// Watch first, so no change between the check and poll is missed
+		struct pollfd pfd[2] = {
+			{ .fd = watch_parent(path), .events = POLLIN },
+			{ .fd = open("/proc/self/mounts", O_RDONLY | O_CLOEXEC), .events = POLLPRI }
+		};
+		int ready = access(path, mode) == 0;
+		if (!ready && (left = time_left(&start, timeout_ms))) {
+			if (pfd[0].fd >= 0 && pfd[1].fd >= 0) {
+				poll(pfd, 2, left);
+			} else {
+				// The watches are set up again next round, e.g. once /proc is mounted
+				usleep(left >= 0 && left * 1000L < delay_us ? left * 1000L : delay_us);
+				delay_us = delay_us * 2 > POLL_MAX_US ? POLL_MAX_US : delay_us * 2;
+			}
+		}
+		if (pfd[0].fd >= 0) close(pfd[0].fd);
+		if (pfd[1].fd >= 0) close(pfd[1].fd);
+		if (ready)
+			return 0;
+		if (left == 0)
+			return -1;
+	}
+}
+
+/* Wait until check(pid) returns nonzero. Returns 0 once it did, and -1 if the
+ * process exited or timeout_ms passed if it is not negative */
+int wait_for_proc(int pid, int (*check)(int), int timeout_ms) {
+	struct timespec start, delay;
+	int pidfd = syscall(__NR_pidfd_open, pid, 0), delay_us = POLL_MIN_US, left, ret = -1;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while (1) {
+		if (check(pid)) {
+			ret = 0;
+			break;
+		}
+		if ((left = time_left(&start, timeout_ms)) == 0)
+			break;
+		if (left > 0 && left * 1000L < delay_us)
+			delay_us = left * 1000;
+		delay = (struct timespec) { .tv_sec = delay_us / 1000000, .tv_nsec = delay_us % 1000000 * 1000 };
+		if (pidfd >= 0) {
+			// The pidfd is readable once the process exits
+			struct pollfd pfd = { .fd = pidfd, .events = POLLIN };
+			if (ppoll(&pfd, 1, &delay, NULL) > 0)
+				break;
+		} else {
+			nanosleep(&delay, NULL);
+			if (kill(pid, 0) && errno == ESRCH)
+				break;
+		}
+		delay_us = delay_us * 2 > POLL_MAX_US ? POLL_MAX_US : delay_us * 2;
+	}
+	if (pidfd >= 0)
+		close(pidfd);
+	return ret;
+}
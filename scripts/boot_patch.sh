@@ -71,19 +71,49 @@ chmod -R 755 .
 [ -e magisk ] || ./monogisk -x magisk magisk
 
 ##########################################################################################
-# Unpack
+# Patch
 ##########################################################################################
 
 migrate_boot_backup
 
 CHROMEOS=false
 
-ui_print "- Unpacking boot image"
-./magiskboot --unpack "$BOOTIMAGE"
+# Unpack, restore, ramdisk/dtb/kernel patches and repack are all done in memory
+PATCHARGS="--add 750 init monogisk"
+$KEEPVERITY && PATCHARGS="$PATCHARGS --keepverity"
+$KEEPFORCEENCRYPT && PATCHARGS="$PATCHARGS --keepforceencrypt"
+
+ui_print "- Patching boot image"
+RESULT=`./magiskboot --patch "$BOOTIMAGE" new-boot.img $PATCHARGS`
+RET=$?
+# Output is <stock|magisk> <SHA1 of stock boot image>
+STATUS=${RESULT%% *}
+SHA1=${RESULT#* }
+
+if [ $RET -eq 6 ]; then
+  # Magisk patched, but the ramdisk cannot be restored from internal backup
+  ui_print "! Cannot restore from internal backup"
+  # If we are root and SHA1 known, we try to find the stock backup
+  STOCKDUMP=/data/stock_boot_${SHA1}.img
+  if [ ! -z $SHA1 ] && [ -f ${STOCKDUMP}.gz ]; then
+    ui_print "- Stock boot image backup found"
+    ./magiskboot --decompress ${STOCKDUMP}.gz stock_boot.img
+    ./magiskboot --patch stock_boot.img new-boot.img $PATCHARGS >/dev/null
+    RET=$?
+    rm -f stock_boot.img
+  else
+    ui_print "! Ramdisk restoration incomplete"
+    ui_print "! Will still try to continue installation"
+    ./magiskboot --patch "$BOOTIMAGE" new-boot.img $PATCHARGS --force >/dev/null
+    RET=$?
+  fi
+elif [ "$STATUS" = "magisk" ]; then
+  ui_print "- Ramdisk restored from internal backup"
+fi
 
-case $? in
+case $RET in
   1 )
-    abort "! Unable to unpack boot image"
+    abort "! Unable to patch boot image"
     ;;
   2 )
     ui_print "- ChromeOS boot image detected"
@@ -96,98 +126,20 @@ case $? in
   4 )
     ui_print "! Sony ELF64 format detected"
     abort "! Stock kernel cannot be patched, please use a custom kernel"
-esac
-
-##########################################################################################
-# Ramdisk restores
-##########################################################################################
-
-# Test patch status and do restore, after this section, ramdisk.cpio.orig is guaranteed to exist
-ui_print "- Checking ramdisk status"
-./magiskboot --cpio-test ramdisk.cpio
-case $? in
-  0 )  # Stock boot
-    ui_print "- Stock boot image detected!"
-    ui_print "- Backing up stock boot image"
-    SHA1=`./magiskboot --sha1 "$BOOTIMAGE" 2>/dev/null`
-    STOCKDUMP=stock_boot_${SHA1}.img
-    dd if="$BOOTIMAGE" of=$STOCKDUMP
-    ./magiskboot --compress $STOCKDUMP
-    cp -af ramdisk.cpio ramdisk.cpio.orig
     ;;
-  1 )  # Magisk patched
-    ui_print "- Magisk patched image detected!"
-    # Find SHA1 of stock boot image
-    [ -z $SHA1 ] && SHA1=`./magiskboot --cpio-stocksha1 ramdisk.cpio 2>/dev/null`
-    OK=false
-    ./magiskboot --cpio-restore ramdisk.cpio
-    if [ $? -eq 0 ]; then
-      ui_print "- Ramdisk restored from internal backup"
-      OK=true
-    else
-      # Restore failed
-      ui_print "! Cannot restore from internal backup"
-      # If we are root and SHA1 known, we try to find the stock backup
-      if [ ! -z $SHA1 ]; then
-        STOCKDUMP=/data/stock_boot_${SHA1}.img
-        if [ -f ${STOCKDUMP}.gz ]; then
-          ui_print "- Stock boot image backup found"
-          ./magiskboot --decompress ${STOCKDUMP}.gz stock_boot.img
-          ./magiskboot --unpack stock_boot.img
-          rm -f stock_boot.img
-          OK=true
-        fi
-      fi
-    fi
-    if ! $OK; then
-      ui_print "! Ramdisk restoration incomplete"
-      ui_print "! Will still try to continue installation"
-    fi
-    cp -af ramdisk.cpio ramdisk.cpio.orig
-    ;;
-  2 ) # Other patched
+  5 )
     ui_print "! Boot image patched by other programs!"
     abort "! Please restore stock boot image"
     ;;
 esac
 
-##########################################################################################
-# Ramdisk patches
-##########################################################################################
-
-ui_print "- Patching ramdisk"
-
-./magiskboot --cpio-add ramdisk.cpio 750 init monogisk
-./magiskboot --cpio-patch ramdisk.cpio $KEEPVERITY $KEEPFORCEENCRYPT
-
-# Create ramdisk backups
-./magiskboot --cpio-backup ramdisk.cpio ramdisk.cpio.orig $SHA1
-
-if ! $KEEPVERITY && [ -f dtb ]; then
-  ./magiskboot --dtb-patch dtb && ui_print "- Patching fstab in dtb to remove dm-verity"
+if [ "$STATUS" = "stock" ]; then
+  ui_print "- Backing up stock boot image"
+  STOCKDUMP=stock_boot_${SHA1}.img
+  dd if="$BOOTIMAGE" of=$STOCKDUMP
+  ./magiskboot --compress $STOCKDUMP
 fi
 
-rm -f ramdisk.cpio.orig
-
-##########################################################################################
-# Repack and flash
-##########################################################################################
-
-# Hexpatches
-
-# Remove Samsung RKP in stock kernel
-./magiskboot --hexpatch kernel \
-49010054011440B93FA00F71E9000054010840B93FA00F7189000054001840B91FA00F7188010054 \
-A1020054011440B93FA00F7140020054010840B93FA00F71E0010054001840B91FA00F7181010054
-
-# skip_initramfs -> want_initramfs
-./magiskboot --hexpatch kernel \
-736B69705F696E697472616D6673 \
-77616E745F696E697472616D6673
-
-ui_print "- Repacking boot image"
-./magiskboot --repack "$BOOTIMAGE" || abort "! Unable to repack boot image!"
-
 # Sign chromeos boot
 $CHROMEOS && sign_chromeos
 
@@ -144,6 +144,13 @@ flash_boot_image() {
   case "$2" in
     /dev/block/*)
       ui_print "- Flashing new boot image"
+      # Only write the parts that changed of an uncompressed, unsigned image
+      if ! $BOOTSIGNED; then
+        case "$1" in
+          *.gz) ;;
+          *) $MAGISKBIN/magiskboot --flash "$1" "$2" >/dev/null 2>&1 && return;;
+        esac
+      fi
       eval $COMMAND | eval $SIGNCOM | cat - /dev/zero | dd of="$2" bs=4096 >/dev/null 2>&1
       ;;
     *)